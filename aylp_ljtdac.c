@@ -1,139 +1,1828 @@
+#include <ctype.h>
 #include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <gsl/gsl_vector.h>
 #include <libaylp/anyloop.h>
 #include <libaylp/logging.h>
 #include <libaylp/xalloc.h>
 
 #include "labjack_u3.h"
+#include "ljbroker.h"
+#include "ljcache.h"
+#include "ljchan.h"
+#include "ljclock.h"
+#include "ljdisc.h"
+#include "ljlog.h"
+#include "ljmodel.h"
+#include "ljmon.h"
+#include "ljpredict.h"
+#include "ljprobe.h"
+#include "ljsession.h"
+#include "ljsim.h"
+#include "ljspi.h"
+#include "ljtrace.h"
 #include "ljtdac.h"
 #include "aylp_ljtdac.h"
 
 
-// U3-specific initialization
-static int init_u3(struct aylp_ljtdac_data *data)
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Work out the timer clock and the timer/counter config. Timers and counters
+// are assigned to consecutive pins starting at the pin offset, timers first:
+// the square wave (if any), then the timer inputs, then the PWM outputs, then
+// the system timer read, then the trigger counter. Doesn't talk to the device.
+static int plan_timers(struct aylp_ljtdac_data *data)
+{
+	uint8_t n_pins = data->n_timers + (data->trigger ? 1 : 0);
+	if (!n_pins) {
+		data->timer_counter_config = 0x40;	// offset = 4
+		return 0;
+	}
+	if (data->timer_offset > data->model->max_offset) {
+		log_error("Timer/counter pin offset %hhu is too high",
+			data->timer_offset
+		);
+		return -1;
+	}
+	for (uint8_t pin = data->timer_offset;
+		pin < data->timer_offset + n_pins; pin++
+	) {
+		if (pin == data->sda_pin || pin == data->scl_pin) {
+			log_error("Timer/counter pin %hhu collides with the "
+				"LJTick pins", pin
+			);
+			return -1;
+		}
+	}
+
+	// the square wave decides the clock; otherwise run as fast as we can
+	if (data->square_hz) {
+		log_info("You requested square_hz = %lu", data->square_hz);
+		double hz_real;
+		data->model->square_clock(data->square_hz, &data->clock_config,
+			&data->clock_divisor, &data->timer_values[0], &hz_real
+		);
+		data->timer_hz = hz_real * 2 * data->timer_values[0];
+		log_info("Best I could do: %G Hz", hz_real);
+		// the LabJack turns counter 0 off with the divided clocks
+		if (data->trigger && data->trigger_counter == 0
+			&& data->clock_config >= LJU3_CLOCK_1MHZ_DIV
+		) {
+			log_error("Counter 0 doesn't count alongside square_hz; "
+				"use trigger \"counter1\""
+			);
+			return -1;
+		}
+	} else {
+		data->clock_config = LJU3_CLOCK_48MHZ;
+		data->clock_divisor = 0;
+		data->timer_hz = 48000000;
+	}
+
+	struct ljmodel_io io = {
+		.n_timers = data->n_timers,
+		.counters = data->trigger ? 1 << data->trigger_counter : 0,
+		.offset = data->timer_offset,
+	};
+	data->timer_counter_config = ljmodel_io_pack(&io);
+	return 0;
+}
+
+
+// Write the timer setup from plan_timers to the device.
+static int config_timers(struct aylp_ljtdac_data *data)
+{
+	int err;
+	if (!data->n_timers && !data->trigger) return 0;
+	struct ljmodel_io io;
+	ljmodel_io_unpack(data->timer_counter_config, &io);
+	err = data->model->config_timers(data->dev,
+		data->clock_config, data->clock_divisor,
+		data->timer_offset, io.counters,
+		data->n_timers, data->timer_modes, data->timer_values
+	);
+	if (err) {
+		log_error("config_timers returned %d: %s",
+			err, strerror(-err)
+		);
+		log_debug("errno was %d: %s", errno, strerror(errno));
+		return err;
+	}
+	return 0;
+}
+
+
+// Log where everything ended up, and remember where the trigger count starts.
+static int start_timers(struct aylp_ljtdac_data *data)
+{
+	int err;
+	for (uint8_t i = 0; i < data->n_timers; i++) {
+		log_info("Timer %hhu is on pin %hhu in mode %hhu",
+			i, data->timer_offset + i, data->timer_modes[i]
+		);
+	}
+	for (uint8_t i = 0; i < data->n_pwm; i++) {
+		log_info("PWM on timer %hhu runs at %G Hz",
+			data->pwm[i].timer, data->timer_hz / (
+				data->pwm[i].mode == LJU3_TIMER_OUT_PWM8
+				? 256 : 65536
+			)
+		);
+	}
+	if (!data->trigger) return 0;
+
+	log_info("Trigger counter %hhu is on pin %hhu",
+		data->trigger_counter, data->trigger_pin
+	);
+	err = data->model->read_counter(data->dev, data->trigger_counter,
+		false, &data->trigger_count
+	);
+	if (err) {
+		log_error("read_counter returned %d: %s",
+			err, strerror(-err)
+		);
+		return -1;
+	}
+	data->edge_lat_min = UINT64_MAX;
+	return 0;
+}
+
+
+// Pack a PORT_STATE_WRITE or PORT_DIR_WRITE IOType setting the pins in mask
+// to their bits in bits.
+static unsigned pack_ports(uint8_t *cmd, uint8_t io_type,
+	uint32_t mask, uint32_t bits
+) {
+	cmd[0] = io_type;
+	for (unsigned k = 0; k < 3; k++) {
+		cmd[1 + k] = mask >> 8 * k;
+		cmd[4 + k] = bits >> 8 * k;
+	}
+	return 7;
+}
+
+
+// Drive the pins of digital output channels low, and if dir is set, make
+// them outputs too. Needs build_channels first. Like the DAC writes, skips
+// reading the response if read isn't set.
+static int config_digital(struct aylp_ljtdac_data *data, bool dir, bool read)
+{
+	int err;
+	if (!data->dio_mask) return 0;
+	uint8_t cmd[2 * 7];
+	unsigned n = pack_ports(cmd, PORT_STATE_WRITE, data->dio_mask, 0);
+	if (dir) {
+		n += pack_ports(cmd + n, PORT_DIR_WRITE,
+			data->dio_mask, data->dio_mask
+		);
+	}
+	uint8_t resp[1];
+	struct ljud_batch batch = {0};
+	int k = ljud_batch_add(&batch, 0, data->model->feedback_resp_len(0));
+	batch.n_tx[k] = data->model->pack_feedback(batch.tx[k], cmd, n);
+	err = ljud_batch_run(data->dev, &batch, read);
+	if (!err && read)
+		err = data->model->unpack_feedback(batch.rx[k], resp, 0);
+	if (err) {
+		log_error("Digital output setup returned %d: %s",
+			err, strerror(-err)
+		);
+		log_debug("errno was %d: %s", errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+// Fill in a cache entry with what we've just set the device up with.
+static void fill_cache(struct aylp_ljtdac_data *data, struct ljcache *cache)
+{
+	memset(cache, 0, sizeof(struct ljcache));
+	cache->serial_number = data->serial_number;
+	cache->sda_pin = data->sda_pin;
+	cache->scl_pin = data->scl_pin;
+	cache->cal_mem = data->cal_mem;
+	cache->timer_counter_config = data->timer_counter_config;
+	cache->clock_config = data->clock_config;
+	cache->clock_divisor = data->clock_divisor;
+	cache->n_timers = data->n_timers;
+	memcpy(cache->timer_modes, data->timer_modes, sizeof(cache->timer_modes));
+	memcpy(cache->timer_values, data->timer_values,
+		sizeof(cache->timer_values)
+	);
+}
+
+
+static void save_cache(struct aylp_ljtdac_data *data)
+{
+	int err;
+	struct ljcache cache;
+	if (!data->cache_dir) return;
+	fill_cache(data, &cache);
+	err = ljcache_save(data->cache_dir, &cache);
+	if (err) {
+		log_warn("Couldn't save cache to %s: %s",
+			data->cache_dir, strerror(-err)
+		);
+	}
+}
+
+
+// Check whether the device still holds the config we'd write. The timer modes
+// can't be read back, so we trust the cache for those as long as ConfigIO
+// (which resets on power cycle) still matches.
+static bool config_unchanged(struct aylp_ljtdac_data *data,
+	const struct ljcache *cache
+) {
+	int err;
+	struct ljcache want;
+	fill_cache(data, &want);
+	if (
+		cache->timer_counter_config != want.timer_counter_config
+		|| cache->clock_config != want.clock_config
+		|| cache->clock_divisor != want.clock_divisor
+		|| cache->n_timers != want.n_timers
+		|| memcmp(cache->timer_modes, want.timer_modes,
+			sizeof(want.timer_modes))
+		|| memcmp(cache->timer_values, want.timer_values,
+			sizeof(want.timer_values))
+	) {
+		return false;
+	}
+	struct ljmodel_io got;
+	err = data->model->config_io(data->dev, NULL, &got);
+	if (err) return false;
+	return ljmodel_io_pack(&got) == want.timer_counter_config
+		&& got.digital && got.analog == data->analog_mask;
+}
+
+
+// Turn a raw timer reading into something with sensible units.
+static double convert_input(struct aylp_ljtdac_data *data,
+	uint8_t mode, uint32_t value
+) {
+	switch (mode) {
+	case LJU3_TIMER_IN_QUAD:
+		// signed count of quadrature edges
+		return (int32_t)value;
+	case LJU3_TIMER_IN_P32R:
+		// period in seconds
+		return value / data->timer_hz;
+	case LJU3_TIMER_IN_DUTY: {
+		// LSW is high time and MSW is low time, both in clock ticks
+		uint32_t high = value & 0xFFFF;
+		uint32_t low = value >> 16;
+		if (!(high + low)) return 0.0;
+		return (double)high / (high + low);
+	}
+	default:
+		return value;
+	}
+}
+
+
+// Take a new reading of the trigger counter. Returns whether an edge has come
+// in since the last one.
+static bool count_edges(struct aylp_ljtdac_data *data, uint32_t count)
+{
+	if (count == data->trigger_count) return false;
+	// unsigned subtraction handles wraparound
+	uint32_t n_edges = count - data->trigger_count;
+	data->edges_missed += n_edges - 1;
+	data->trigger_count = count;
+	return true;
+}
+
+
+// Wait for a new edge on the trigger counter, polling it with commands of its
+// own. On success, *t_edge is the time of the poll that saw the edge, or 0 if
+// none came in before the timeout.
+static int poll_trigger(struct aylp_ljtdac_data *data, uint64_t *t_edge)
+{
+	int err;
+	uint32_t count;
+	uint64_t t_start = now_ns();
+	uint64_t t_poll;
+	*t_edge = 0;
+	do {
+		t_poll = now_ns();
+		err = data->model->read_counter(data->dev,
+			data->trigger_counter, false, &count
+		);
+		if (err) return err;
+		if (count_edges(data, count)) {
+			*t_edge = t_poll;
+			return 0;
+		}
+	} while (t_poll - t_start < data->trigger_timeout_ms * 1000000);
+	data->edge_timeouts += 1;
+	ljlog_warn(data->log, "Timed out waiting for trigger edge");
+	return 0;
+}
+
+
+// Whether pin is one of the SPI DAC's.
+static bool spi_pin(const struct aylp_ljtdac_data *data, uint8_t pin)
+{
+	const struct ljspi_bus *bus = &data->spidac.bus;
+	return data->spidac.n && (pin == bus->cs_pin || pin == bus->clk_pin
+		|| pin == bus->miso_pin || pin == bus->mosi_pin
+	);
+}
+
+
+// Fold one channel's params and its output's calibration into the map.
+// Digital outputs go high when the scaled value reaches threshold.
+static int add_channel(struct aylp_ljtdac_data *data, size_t index,
+	ljchan_output output, double scale, double offset,
+	double min, double max, bool round, double threshold
+) {
+	double cal_gain, cal_offset;
+	double code_max = 0xFFFF;
+	switch (output) {
+	case LJCHAN_DACA:
+		cal_gain = fp642dbl(data->cal_mem.daca_slope);
+		cal_offset = fp642dbl(data->cal_mem.daca_offset);
+		break;
+	case LJCHAN_DACB:
+		cal_gain = fp642dbl(data->cal_mem.dacb_slope);
+		cal_offset = fp642dbl(data->cal_mem.dacb_offset);
+		break;
+	case LJCHAN_PWM0:
+	case LJCHAN_PWM1:
+		if (output - LJCHAN_PWM0 >= data->n_pwm) {
+			log_error("%s isn't set up in the pwm param",
+				ljchan_output_name(output)
+			);
+			return -1;
+		}
+		// duty cycle (time high) to timer value (time low of 65536)
+		cal_gain = -65536.0;
+		cal_offset = 65536.0;
+		break;
+	default: {
+		if (output >= LJCHAN_SPI0 && output < LJCHAN_N_OUTPUTS) {
+			uint8_t chan = output - LJCHAN_SPI0;
+			if (chan >= data->spidac.n) {
+				log_error("%s isn't set up in the spidac param",
+					ljchan_output_name(output)
+				);
+				return -1;
+			}
+			cal_gain = data->spidac.slope[chan];
+			cal_offset = data->spidac.offset[chan];
+			code_max = (1UL << data->spidac.data_bits) - 1;
+			break;
+		}
+		if (output < LJCHAN_DIO0 || output >= LJCHAN_SPI0)
+			return -1;
+		uint8_t pin = output - LJCHAN_DIO0;
+		uint8_t n_pins = data->n_timers + (data->trigger ? 1 : 0);
+		if (pin == data->sda_pin || pin == data->scl_pin
+			|| spi_pin(data, pin) || (
+				pin >= data->timer_offset
+				&& pin < data->timer_offset + n_pins
+			)
+		) {
+			log_error("%s is already taken by the LJTick, the SPI "
+				"bus or a timer", ljchan_output_name(output)
+			);
+			return -1;
+		}
+		// codes 0 and 1, with 1 from half a code past the threshold
+		// on, so rounding does the comparison
+		cal_gain = 1.0;
+		cal_offset = 0.5 - threshold;
+		code_max = 1;
+		round = true;
+		data->dio_mask |= 1UL << pin;
+		break;
+	}
+	}
+	for (size_t i = 0; i < data->chans.n; i++) {
+		if (data->chans.output[i] == output) {
+			log_error("%s is mapped twice",
+				ljchan_output_name(output)
+			);
+			return -1;
+		}
+	}
+	if (ljchan_add(&data->chans, index, output, scale, offset,
+		min, max, round, cal_gain, cal_offset, 0, code_max
+	) < 0) {
+		log_error("Too many channels");
+		return -1;
+	}
+	log_debug("Channel %zu: element %zu -> %s",
+		data->chans.n - 1, index, ljchan_output_name(output)
+	);
+	return 0;
+}
+
+
+// Build the channel map from the channels param, or the default map of DACA,
+// DACB, each PWM output, then each SPI DAC channel if there's no param. Needs
+// calibration first.
+static int build_channels(struct aylp_ljtdac_data *data)
+{
+	int err;
+	data->chans.n = 0;
+	data->dio_mask = 0;
+	if (!data->channels) {
+		err = add_channel(data, 0, LJCHAN_DACA,
+			1.0, 0.0, -INFINITY, INFINITY, true, 0.0
+		);
+		if (err) return err;
+		err = add_channel(data, 1, LJCHAN_DACB,
+			1.0, 0.0, -INFINITY, INFINITY, true, 0.0
+		);
+		if (err) return err;
+		for (uint8_t i = 0; i < data->n_pwm; i++) {
+			err = add_channel(data, 2 + i, LJCHAN_PWM0 + i,
+				1.0, 0.0, -INFINITY, INFINITY, true, 0.0
+			);
+			if (err) return err;
+		}
+		for (uint8_t i = 0; i < data->spidac.n; i++) {
+			err = add_channel(data, 2 + data->n_pwm + i,
+				LJCHAN_SPI0 + i,
+				1.0, 0.0, -INFINITY, INFINITY, true, 0.0
+			);
+			if (err) return err;
+		}
+		return 0;
+	}
+	size_t n = json_object_array_length(data->channels);
+	for (size_t i = 0; i < n; i++) {
+		json_object *chan = json_object_array_get_idx(
+			data->channels, i
+		);
+		size_t index = i;
+		int output = -1;
+		double scale = 1.0;
+		double offset = 0.0;
+		double min = -INFINITY;
+		double max = INFINITY;
+		bool round = true;
+		double threshold = 0.5;
+		double period_ms = 0.0;
+		int priority = 0;
+		json_object_object_foreach(chan, key, val) {
+			if (key[0] == '_') {
+				// keys starting with _ are comments
+			} else if (!strcmp(key, "index")) {
+				index = json_object_get_uint64(val);
+			} else if (!strcmp(key, "output")) {
+				const char *name = json_object_get_string(val);
+				output = ljchan_output_from_name(name);
+				if (output < 0) {
+					log_error("Unknown output: %s", name);
+					return -1;
+				}
+			} else if (!strcmp(key, "scale")) {
+				scale = json_object_get_double(val);
+			} else if (!strcmp(key, "offset")) {
+				offset = json_object_get_double(val);
+			} else if (!strcmp(key, "min")) {
+				min = json_object_get_double(val);
+			} else if (!strcmp(key, "max")) {
+				max = json_object_get_double(val);
+			} else if (!strcmp(key, "round")) {
+				round = json_object_get_boolean(val);
+			} else if (!strcmp(key, "threshold")) {
+				threshold = json_object_get_double(val);
+			} else if (!strcmp(key, "period_ms")) {
+				period_ms = json_object_get_double(val);
+			} else if (!strcmp(key, "priority")) {
+				priority = json_object_get_int(val);
+			} else {
+				log_warn("Unknown channel parameter \"%s\"",
+					key
+				);
+			}
+		}
+		if (output < 0) {
+			log_error("Channel %zu has no output", i);
+			return -1;
+		}
+		err = add_channel(data, index, output,
+			scale, offset, min, max, round, threshold
+		);
+		if (err) return err;
+		if (period_ms < 0) {
+			log_error("Channel %zu has a negative period", i);
+			return -1;
+		}
+		ljchan_set_rate(&data->chans, data->chans.n - 1,
+			period_ms * 1e6, priority
+		);
+	}
+	return 0;
+}
+
+
+// Collect the responses that earlier loops left on the device, checking them
+// as we go, so that this loop's responses come back in order.
+static int drain_unread(struct aylp_ljtdac_data *data)
+{
+	uint8_t rx[LJUD_PACKET_MAX];
+	int err = 0;
+	for (unsigned i = 0; i < data->n_unread; i++) {
+		int e = ljud_read_resp(data->dev, rx, data->unread_rx[i]);
+		if (!err) err = e;
+	}
+	data->n_unread = 0;
+	return err;
+}
+
+
+// Adaptive mode: decide whether to read this loop's n responses back.
+static bool choose_verify(struct aylp_ljtdac_data *data, unsigned n)
+{
+	data->verify_credit += data->verify_min;
+	if (data->verifying) return true;
+	// sample now and then even when we can't afford it
+	if (data->verify_credit >= 1) return true;
+	// and don't let unread responses pile up on the device
+	return data->n_unread + n > AYLP_LJTDAC_UNREAD_MAX;
+}
+
+
+// Adaptive mode: account for a loop that took dt ns of I/O, and switch
+// between verified and write-only loops against the budget.
+static void adapt(struct aylp_ljtdac_data *data,
+	struct ljud_batch *batch, bool read, uint64_t dt
+) {
+	data->n_loops += 1;
+	if (!read) {
+		for (unsigned i = 0; i < batch->n; i++)
+			data->unread_rx[data->n_unread++] = batch->n_rx[i];
+		return;
+	}
+	data->n_verified += 1;
+	data->verify_credit = data->verify_credit >= 1
+		? data->verify_credit - 1 : 0;
+	data->verified_ns = data->verified_ns
+		? data->verified_ns + ((double)dt - data->verified_ns) / 8
+		: dt;
+	// switch with some hysteresis so we don't flap around the budget
+	if (data->verifying && data->verified_ns > data->budget_ns) {
+		data->verifying = false;
+		data->n_switches += 1;
+		ljlog_info(data->log,
+			"Verified I/O takes %.0f us, over the %lu us budget; "
+			"skipping reads", data->verified_ns * 1e-3,
+			data->budget_ns / 1000
+		);
+	} else if (!data->verifying
+		&& data->verified_ns < 0.8 * data->budget_ns
+	) {
+		data->verifying = true;
+		data->n_switches += 1;
+		ljlog_info(data->log,
+			"Verified I/O takes %.0f us, within the %lu us budget; "
+			"reading back every loop", data->verified_ns * 1e-3,
+			data->budget_ns / 1000
+		);
+	}
+}
+
+
+// Errors that might go away if we try again.
+static bool transient(int err)
+{
+	return err == -ECOMM || err == -EREMOTEIO || err == -EBADE
+		|| err == -EBADMSG || err == -ETIMEDOUT;
+}
+
+
+// After an error, responses can't be trusted to line up with commands any
+// more, so throw away whatever's left over. If t_end isn't 0, stop reading
+// around then, going by how long a packet takes, and leave the rest owed.
+static void resync(struct aylp_ljtdac_data *data, uint64_t t_end)
+{
+	const unsigned n_max = AYLP_LJTDAC_UNREAD_MAX + LJUD_BATCH_MAX + 1;
+	unsigned max_reads = n_max;
+	if (t_end && data->packet_ns > 0) {
+		uint64_t t = now_ns();
+		double n = t < t_end ? (t_end - t) / data->packet_ns : 0;
+		if (n < max_reads) max_reads = n;
+	}
+	data->n_unread = 0;
+	data->desynced = true;
+	if (!max_reads) return;
+	data->n_resyncs += 1;
+	int n = data->model->resync(data->dev, max_reads);
+	// running out of reads we cut short isn't the device's fault
+	data->desynced = n == -EPROTO && max_reads < n_max;
+	data->resync_failed = n < 0 && !data->desynced;
+	if (data->desynced) {
+		ljlog_debug(data->log, "Out of time to resync; "
+			"finishing next loop"
+		);
+	} else if (n < 0) {
+		ljlog_warn(data->log, "resync returned %d: %s",
+			n, strerror(-n)
+		);
+	} else if (n) {
+		ljlog_debug(data->log, "Threw away %d stale responses", n);
+	}
+}
+
+
+// Run the loop's I/O, retrying transient errors until we run out of retries
+// or run past the deadline. Returns 0 or negative error code.
+static int run_io(struct aylp_ljtdac_data *data,
+	struct ljud_batch *batch, bool read, uint64_t t_start
+) {
+	int err;
+	uint64_t t_end = data->deadline_ns ? t_start + data->deadline_ns : 0;
+	for (unsigned attempt = 0; ; attempt++) {
+		err = 0;
+		if (read && data->n_unread) err = drain_unread(data);
+		if (!err) err = ljud_batch_run(data->dev, batch, read);
+		if (!err) break;
+		ljlog_warn(data->log, "Loop I/O returned %d: %s",
+			err, strerror(-err)
+		);
+		ljlog_debug(data->log, "errno was %d: %s",
+			errno, strerror(errno)
+		);
+		if (!transient(err)) return err;
+		// in plain fast mode, nobody reads the responses anyway
+		bool sync = read || data->budget_ns;
+		if (t_end && now_ns() >= t_end) {
+			data->n_deadline_misses += 1;
+			if (sync) {
+				data->n_unread = 0;
+				data->desynced = true;
+			}
+			return err;
+		}
+		if (sync) resync(data, t_end);
+		if (attempt >= data->retries) return err;
+		if (data->desynced) {
+			data->n_deadline_misses += 1;
+			return err;
+		}
+		data->n_retries += 1;
+	}
+	if (t_end && now_ns() > t_end) data->n_deadline_misses += 1;
+	return 0;
+}
+
+
+// Put the setpoints and the input readings in the output vector. resp is
+// NULL if the loop failed, in which case inputs hold their last readings or
+// read as NAN, depending on on_miss.
+static void set_inputs(struct aylp_ljtdac_data *data,
+	struct aylp_state *state, const uint8_t *resp
+) {
+	// We can be handed our own output back (by a loop with nothing after
+	// us, say). Then only the setpoints at the start of it are input, and
+	// they're already in place.
+	bool own = state->vector == data->out;
+	size_t n_set = state->vector->size - (own ? data->n_inputs : 0);
+	size_t n_out = n_set + data->n_inputs;
+	bool fresh = false;
+	if (!own && (!data->out || data->out->size != n_out)) {
+		if (data->out) gsl_vector_free(data->out);
+		data->out = gsl_vector_alloc(n_out);
+		fresh = true;
+	}
+	for (size_t i = 0; !own && i < n_set; i++) {
+		gsl_vector_set(data->out, i, gsl_vector_get(state->vector, i));
+	}
+	for (uint8_t i = 0; i < data->n_inputs; i++) {
+		double x = NAN;
+		if (resp) {
+			const uint8_t *r = resp + 4 * i;
+			uint32_t value = (
+				(uint32_t)r[0] | (uint32_t)r[1] << 8
+				| (uint32_t)r[2] << 16 | (uint32_t)r[3] << 24
+			);
+			x = convert_input(data, data->inputs[i].mode, value);
+		} else if (data->on_miss == AYLP_LJTDAC_HOLD && !fresh) {
+			continue;
+		}
+		gsl_vector_set(data->out, n_set + i, x);
+	}
+	state->vector = data->out;
+}
+
+
+// Record what happened to channel i this loop, for monitors.
+static void watch_chan(struct aylp_ljtdac_data *data, size_t i,
+	uint8_t status, uint16_t code, uint64_t t
+) {
+	struct ljmon_chan *c = &data->mon_snap.chans[i];
+	c->index = data->chans.index[i];
+	c->output = data->chans.output[i];
+	c->status = status;
+	c->residual = data->predict.resid[i];
+	if (status != LJMON_WRITTEN) return;
+	c->code = code;
+	c->value = ljchan_value(&data->chans, i, code);
+	c->t_ns = t;
+}
+
+
+// Let monitors know how this loop went. Needs set_inputs done first.
+static void publish(struct aylp_ljtdac_data *data,
+	struct aylp_state *state, uint32_t status
+) {
+	if (!data->mon.shm) return;
+	struct ljmon_snapshot *snap = &data->mon_snap;
+	snap->t_ns = now_ns();
+	snap->n_loops += 1;
+	if (status != LJMON_OK) snap->n_failed += 1;
+	snap->status = status;
+	snap->delay_ns = data->predict.delay_ns;
+	// While we're lost, the reconnect thread is rebuilding the channels and
+	// the clock, so monitors keep seeing them as of the last loop before.
+	if (!data->lost) {
+		snap->n_chans = data->chans.n;
+		snap->drift_ppm = data->clock
+			? ljclock_drift_ppm(&data->clk) : 0.0;
+	}
+	snap->n_inputs = data->n_inputs;
+	for (uint8_t i = 0; i < data->n_inputs; i++) {
+		snap->inputs[i] = gsl_vector_get(state->vector,
+			state->vector->size - data->n_inputs + i
+		);
+	}
+	ljmon_publish(&data->mon, snap);
+}
+
+
+// Whether an error means the device has gone away altogether.
+static bool lost(struct aylp_ljtdac_data *data, int err)
+{
+	return data->reconnect && (err == -ECOMM || data->resync_failed);
+}
+
+
+// A loop whose I/O failed for good. Returns what proc should return.
+static int give_up(struct aylp_ljtdac_data *data,
+	struct aylp_state *state, int err
+) {
+	if (data->on_miss == AYLP_LJTDAC_FAIL) return err;
+	data->n_given_up += 1;
+	ljlog_warn(data->log, "Giving up on this loop (%s)",
+		data->on_miss == AYLP_LJTDAC_HOLD ? "holding" : "skipping"
+	);
+	if (data->n_inputs) set_inputs(data, state, NULL);
+	publish(data, state, LJMON_FAILED);
+	return 0;
+}
+
+
+// Parse the readback param.
+static int parse_readback(struct aylp_ljtdac_data *data, json_object *obj)
+{
+	data->n_readback = 0;
+	json_object_object_foreach(obj, key, val) {
+		if (key[0] == '_') {
+			// keys starting with _ are comments
+		} else if (!strcasecmp(key, "DACA") || !strcasecmp(key, "DACB")) {
+			const char *name = json_object_get_string(val);
+			int ain = lju3_ain_from_name(name);
+			if (ain < 0) {
+				log_error("Unknown analog input: %s", name);
+				return -1;
+			}
+			int dac = ljchan_output_from_name(key);
+			for (uint8_t i = 0; i < data->n_readback; i++) {
+				if (data->readback[i].dac != dac) continue;
+				log_error("%s is read back twice",
+					ljchan_output_name(dac)
+				);
+				return -1;
+			}
+			data->readback[data->n_readback].dac = dac;
+			data->readback[data->n_readback].ain = ain;
+			data->n_readback += 1;
+		} else if (!strcmp(key, "every")) {
+			data->readback_every = json_object_get_uint64(val);
+		} else if (!strcmp(key, "tolerance")) {
+			data->readback_tolerance = json_object_get_double(val);
+		} else if (!strcmp(key, "divider")) {
+			data->readback_divider = json_object_get_double(val);
+		} else if (!strcmp(key, "hv")) {
+			data->readback_hv = json_object_get_boolean(val);
+		} else {
+			log_warn("Unknown readback parameter \"%s\"", key);
+		}
+	}
+	if (!data->readback_every || !(data->readback_divider > 0)) {
+		log_error("readback needs every and divider above 0");
+		return -1;
+	}
+	if (data->n_readback == 2
+		&& data->readback[0].ain == data->readback[1].ain
+	) {
+		log_error("DACA and DACB can't read back on the same input");
+		return -1;
+	}
+	// the U3-HV's AIN0-3 are analog whatever we say
+	data->analog_mask = data->readback_hv ? 0x0F : 0;
+	for (uint8_t i = 0; i < data->n_readback; i++)
+		data->analog_mask |= 1 << data->readback[i].ain;
+	return 0;
+}
+
+
+// Parse an SPI word, given as a number or as a string like "0x300000".
+static int parse_word(json_object *val, uint32_t *word)
+{
+	if (json_object_is_type(val, json_type_string)) {
+		const char *s = json_object_get_string(val);
+		char *end;
+		errno = 0;
+		unsigned long long x = strtoull(s, &end, 0);
+		if (errno || end == s || *end || x > UINT32_MAX) {
+			log_error("Bad SPI word: %s", s);
+			return -1;
+		}
+		*word = x;
+		return 0;
+	}
+	int64_t x = json_object_get_int64(val);
+	if (x < 0 || x > UINT32_MAX) {
+		log_error("Bad SPI word: %ld", x);
+		return -1;
+	}
+	*word = x;
+	return 0;
+}
+
+
+// Parse a list of SPI words into words, at most LJSPI_DAC_MAX of them.
+// Returns how many there were, or -1.
+static int parse_words(json_object *arr, uint32_t *words)
+{
+	size_t n = json_object_array_length(arr);
+	if (n > LJSPI_DAC_MAX) {
+		log_error("spidac takes at most %d words", LJSPI_DAC_MAX);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		json_object *val = json_object_array_get_idx(arr, i);
+		if (parse_word(val, &words[i])) return -1;
+	}
+	return n;
+}
+
+
+// Parse the spidac param.
+static int parse_spidac(struct aylp_ljtdac_data *data, json_object *obj)
+{
+	struct ljspi_dac *dac = &data->spidac;
+	int pins[4] = {-1, -1, -1, -1};	// cs, clk, miso, mosi
+	static const char *const pin_keys[4] = {"cs", "clk", "miso", "mosi"};
+	json_object *range = NULL;
+	json_object *cal = NULL;
+	int n;
+	dac->bus.options = LJ_SPI_AUTO_CS | LJ_SPI_MODE_A;
+	dac->word_bits = 16;
+	dac->data_bits = 16;
+	dac->n = 0;
+	json_object_object_foreach(obj, key, val) {
+		int p = -1;
+		for (int i = 0; i < 4; i++)
+			if (!strcmp(key, pin_keys[i])) p = i;
+		if (key[0] == '_') {
+			// keys starting with _ are comments
+		} else if (p >= 0) {
+			const char *name = json_object_get_string(val);
+			pins[p] = lju3_pin_from_name(name);
+			if (pins[p] < 0) {
+				log_error("Unknown pin: %s", name);
+				return -1;
+			}
+		} else if (!strcmp(key, "mode")) {
+			const char *mode = json_object_get_string(val);
+			int m = strlen(mode) == 1 ? toupper(mode[0]) - 'A' : -1;
+			if (m < 0 || m > 3) {
+				log_error("Unknown SPI mode: %s", mode);
+				return -1;
+			}
+			dac->bus.options = LJ_SPI_AUTO_CS | m;
+		} else if (!strcmp(key, "clock_factor")) {
+			int64_t f = json_object_get_int64(val);
+			if (f < 0 || f > 255) {
+				log_error("clock_factor must be from 0 to 255");
+				return -1;
+			}
+			dac->bus.clock_factor = f;
+		} else if (!strcmp(key, "word_bits")) {
+			dac->word_bits = json_object_get_uint64(val);
+		} else if (!strcmp(key, "data_bits")) {
+			dac->data_bits = json_object_get_uint64(val);
+		} else if (!strcmp(key, "data_shift")) {
+			dac->data_shift = json_object_get_uint64(val);
+		} else if (!strcmp(key, "commands")) {
+			n = parse_words(val, dac->command);
+			if (n < 0) return -1;
+			dac->n = n;
+		} else if (!strcmp(key, "setup")) {
+			n = parse_words(val, data->spidac_setup);
+			if (n < 0) return -1;
+			data->n_spidac_setup = n;
+		} else if (!strcmp(key, "range")) {
+			range = val;
+		} else if (!strcmp(key, "cal")) {
+			cal = val;
+		} else if (!strcmp(key, "transfer")) {
+			const char *transfer = json_object_get_string(val);
+			if (!strcasecmp(transfer, "packed")) {
+				data->spidac_transfer = AYLP_LJTDAC_SPI_PACKED;
+			} else if (!strcasecmp(transfer, "each")) {
+				data->spidac_transfer = AYLP_LJTDAC_SPI_EACH;
+			} else if (!strcasecmp(transfer, "chain")) {
+				data->spidac_transfer = AYLP_LJTDAC_SPI_CHAIN;
+			} else {
+				log_error("Unknown SPI transfer: %s", transfer);
+				return -1;
+			}
+		} else {
+			log_warn("Unknown spidac parameter \"%s\"", key);
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		if (pins[i] < 0) {
+			log_error("spidac needs a %s pin", pin_keys[i]);
+			return -1;
+		}
+		for (int j = 0; j < i; j++) {
+			if (pins[i] == pins[j]) {
+				log_error("spidac's %s and %s pins are the "
+					"same", pin_keys[j], pin_keys[i]
+				);
+				return -1;
+			}
+		}
+	}
+	dac->bus.cs_pin = pins[0];
+	dac->bus.clk_pin = pins[1];
+	dac->bus.miso_pin = pins[2];
+	dac->bus.mosi_pin = pins[3];
+	if (!dac->n) {
+		log_error("spidac needs a command word for each channel");
+		return -1;
+	}
+	if (dac->word_bits % 8 || !dac->word_bits || dac->word_bits > 32
+		|| !dac->data_bits || dac->data_bits > 16
+		|| dac->data_shift + dac->data_bits > dac->word_bits
+	) {
+		log_error("spidac's codes need to fit in its words, which are "
+			"8, 16, 24 or 32 bits; codes are at most 16"
+		);
+		return -1;
+	}
+	// the LJTick's writes, a Feedback packet and a calibration check leave
+	// this much of a batch for SPI transfers of their own
+	if (data->spidac_transfer == AYLP_LJTDAC_SPI_EACH
+		&& dac->n > LJUD_BATCH_MAX - 4
+	) {
+		log_error("spidac can have at most %d channels with a transfer "
+			"each", LJUD_BATCH_MAX - 4
+		);
+		return -1;
+	}
+	// a range for every channel, then calibration for any that have it
+	if (!range && !cal) {
+		log_error("spidac needs a range or a cal");
+		return -1;
+	}
+	if (range) {
+		double v_min = json_object_get_double(
+			json_object_array_get_idx(range, 0)
+		);
+		double v_max = json_object_get_double(
+			json_object_array_get_idx(range, 1)
+		);
+		if (json_object_array_length(range) != 2 || !(v_max > v_min)) {
+			log_error("spidac's range should be [min, max] volts");
+			return -1;
+		}
+		for (uint8_t i = 0; i < dac->n; i++)
+			ljspi_dac_set_range(dac, i, v_min, v_max);
+	}
+	size_t n_cal = cal ? json_object_array_length(cal) : 0;
+	if ((!range && n_cal != dac->n) || n_cal > dac->n) {
+		log_error("spidac's cal needs a [slope, offset] per channel");
+		return -1;
+	}
+	for (size_t i = 0; i < n_cal; i++) {
+		json_object *c = json_object_array_get_idx(cal, i);
+		dac->slope[i] = json_object_get_double(
+			json_object_array_get_idx(c, 0)
+		);
+		dac->offset[i] = json_object_get_double(
+			json_object_array_get_idx(c, 1)
+		);
+		if (json_object_array_length(c) != 2 || !dac->slope[i]) {
+			log_error("spidac's cal needs a [slope, offset] per "
+				"channel"
+			);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+// Check the readback inputs are free, and get their calibration. Needs
+// build_channels first.
+static int setup_readback(struct aylp_ljtdac_data *data)
+{
+	int err;
+	if (!data->n_readback) return 0;
+	uint8_t n_pins = data->n_timers + (data->trigger ? 1 : 0);
+	for (uint8_t i = 0; i < data->n_readback; i++) {
+		uint8_t pin = data->readback[i].ain;
+		if (pin == data->sda_pin || pin == data->scl_pin
+			|| data->dio_mask & 1UL << pin || spi_pin(data, pin)
+			|| (
+				pin >= data->timer_offset
+				&& pin < data->timer_offset + n_pins
+			)
+		) {
+			log_error("AIN%hhu is already taken by the LJTick, a "
+				"timer, the SPI bus or a digital output", pin
+			);
+			return -1;
+		}
+	}
+	struct lju3_cal_mem cal_mem;
+	err = lju3_read_cal_mem(data->dev, &cal_mem);
+	if (err) {
+		log_error("lju3_read_cal_mem returned %d: %s",
+			err, strerror(-err)
+		);
+		log_debug("errno was %d: %s", errno, strerror(errno));
+		return -1;
+	}
+	for (uint8_t i = 0; i < data->n_readback; i++) {
+		lju3_ain_cal(&cal_mem, data->readback_hv,
+			data->readback[i].ain,
+			&data->readback[i].slope, &data->readback[i].offset
+		);
+		// the device may have been power cycled, so nothing's known
+		data->readback[i].want = NAN;
+		data->readback[i].last_want = NAN;
+		log_debug("%s reads back on AIN%hhu at %G V/bit + %G V",
+			ljchan_output_name(data->readback[i].dac),
+			data->readback[i].ain, data->readback[i].slope,
+			data->readback[i].offset
+		);
+	}
+	return 0;
+}
+
+
+// Check the SPI bus is clear of the LJTick and the timers, send the DAC its
+// setup words (each in a transfer of its own), and note every channel as
+// sitting at 0 V until it's written. Needs build_channels first.
+static int setup_spidac(struct aylp_ljtdac_data *data)
+{
+	int err;
+	const struct ljspi_dac *dac = &data->spidac;
+	if (!dac->n) return 0;
+	uint8_t n_pins = data->n_timers + (data->trigger ? 1 : 0);
+	const uint8_t pins[] = {
+		dac->bus.cs_pin, dac->bus.clk_pin,
+		dac->bus.miso_pin, dac->bus.mosi_pin,
+	};
+	for (unsigned i = 0; i < sizeof(pins); i++) {
+		if (pins[i] == data->sda_pin || pins[i] == data->scl_pin || (
+			pins[i] >= data->timer_offset
+			&& pins[i] < data->timer_offset + n_pins
+		)) {
+			log_error("SPI pin %hhu is already taken by the LJTick "
+				"or a timer", pins[i]
+			);
+			return -1;
+		}
+	}
+	if (data->n_spidac_setup) {
+		unsigned n_b = dac->word_bits / 8;
+		struct ljud_batch batch = {0};
+		for (uint8_t i = 0; i < data->n_spidac_setup; i++) {
+			int k = ljud_batch_add(&batch, 0, LJSPI_RX(n_b));
+			batch.n_tx[k] = ljspi_dac_pack_words(batch.tx[k], dac,
+				1, &data->spidac_setup[i]
+			);
+		}
+		err = ljud_batch_run(data->dev, &batch, true);
+		for (unsigned k = 0; !err && k < batch.n; k++)
+			err = ljspi_unpack(batch.rx[k], NULL, n_b);
+		if (err) {
+			log_error("SPI DAC setup returned %d: %s",
+				err, strerror(-err)
+			);
+			log_debug("errno was %d: %s", errno, strerror(errno));
+			return -1;
+		}
+	}
+	for (uint8_t i = 0; i < dac->n; i++)
+		data->spidac_code[i] = ljspi_dac_code(dac, i, 0.0);
+	log_debug("SPI DAC: %hhu channels of %hhu-bit codes in %hhu-bit words",
+		dac->n, dac->data_bits, dac->word_bits
+	);
+	return 0;
+}
+
+
+// Queue the SPI DAC writes of code[i] to channel chan[i], framed the way the
+// spidac param says, and put how many packets that took in *n_packets.
+// Chains get a word for every channel, the ones not being written repeating
+// their last code, and starting from the far end of the chain so that SPI0
+// is the DAC on MOSI. Returns the index of the first packet, or negative
+// error code.
+static int pack_spidac(struct aylp_ljtdac_data *data,
+	struct ljud_batch *batch, unsigned n, const uint8_t *chan,
+	const uint16_t *code, unsigned *n_packets
+) {
+	const struct ljspi_dac *dac = &data->spidac;
+	unsigned n_b = dac->word_bits / 8;
+	uint8_t all_chan[LJSPI_DAC_MAX];
+	uint16_t all_code[LJSPI_DAC_MAX];
+	int first = -ENODATA;
+	*n_packets = 0;
+	for (unsigned i = 0; i < n; i++) data->spidac_code[chan[i]] = code[i];
+	if (data->spidac_transfer == AYLP_LJTDAC_SPI_CHAIN) {
+		n = dac->n;
+		for (unsigned i = 0; i < n; i++) {
+			all_chan[i] = n - 1 - i;
+			all_code[i] = data->spidac_code[n - 1 - i];
+		}
+		chan = all_chan;
+		code = all_code;
+	}
+	// a transfer for each word, or one for the lot
+	unsigned per = data->spidac_transfer == AYLP_LJTDAC_SPI_EACH ? 1 : n;
+	for (unsigned i = 0; i < n; i += per) {
+		int k = ljud_batch_add(batch, 0, LJSPI_RX(per * n_b));
+		if (k < 0) return k;
+		int n_tx = ljspi_dac_pack_write(batch->tx[k], dac,
+			per, chan + i, code + i
+		);
+		if (n_tx < 0) return n_tx;
+		batch->n_tx[k] = n_tx;
+		if (first < 0) first = k;
+		*n_packets += 1;
+	}
+	return first;
+}
+
+
+// Check the responses to the n_packets packets pack_spidac queued from first.
+// Returns 0, or the first error.
+static int check_spidac(const struct ljud_batch *batch,
+	int first, unsigned n_packets
+) {
+	for (unsigned i = 0; i < n_packets; i++) {
+		const struct ljud_spi_header *head = (const void *)
+			batch->tx[first + i];
+		int err = ljspi_unpack(batch->rx[first + i], NULL,
+			head->n_spi_bytes
+		);
+		if (err) return err;
+	}
+	return 0;
+}
+
+
+// Write 0 V to every SPI DAC channel.
+static int zero_spidac(struct aylp_ljtdac_data *data)
+{
+	int err;
+	uint8_t chan[LJSPI_DAC_MAX];
+	uint16_t code[LJSPI_DAC_MAX];
+	unsigned n_packets;
+	struct ljud_batch batch = {0};
+	for (uint8_t i = 0; i < data->spidac.n; i++) {
+		chan[i] = i;
+		code[i] = ljspi_dac_code(&data->spidac, i, 0.0);
+	}
+	int first = pack_spidac(data, &batch, data->spidac.n, chan, code,
+		&n_packets
+	);
+	if (first < 0) return first;
+	err = ljud_batch_run(data->dev, &batch, true);
+	if (err) return err;
+	return check_spidac(&batch, first, n_packets);
+}
+
+
+// Note what a DAC was just told, in volts, for its readback.
+static void readback_written(struct aylp_ljtdac_data *data,
+	ljchan_output output, uint16_t code
+) {
+	for (uint8_t i = 0; i < data->n_readback; i++) {
+		if (data->readback[i].dac != output) continue;
+		fp64 slope = output == LJCHAN_DACA
+			? data->cal_mem.daca_slope : data->cal_mem.dacb_slope;
+		fp64 offset = output == LJCHAN_DACA
+			? data->cal_mem.daca_offset : data->cal_mem.dacb_offset;
+		data->readback[i].want = (code - fp642dbl(offset))
+			/ fp642dbl(slope);
+	}
+}
+
+
+// Compare the readback inputs' raw readings (two bytes each, from a Feedback
+// response) with what the DACs were last told, flagging anything off.
+static void check_readback(struct aylp_ljtdac_data *data, const uint8_t *raw)
+{
+	double tol = data->readback_tolerance;
+	double div = data->readback_divider;
+	for (uint8_t i = 0; i < data->n_readback; i++) {
+		struct aylp_ljtdac_readback *rb = &data->readback[i];
+		const char *name = ljchan_output_name(rb->dac);
+		uint16_t code = raw[2 * i] | raw[2 * i + 1] << 8;
+		double got = (code * rb->slope + rb->offset) / div;
+		double want = rb->want;
+		if (isnan(want)) continue;
+		// the AIN can't tell us about anything outside its range
+		double lo = rb->offset / div;
+		double hi = (0xFFFF * rb->slope + rb->offset) / div;
+		if (want < lo + tol || want > hi - tol) {
+			rb->n_skipped += 1;
+			continue;
+		}
+		rb->n_checks += 1;
+		double err = fabs(got - want);
+		if (err > rb->max_err) rb->max_err = err;
+		if (code < 0x0010 || code >= 0xFFF0) {
+			// pinned, though what we want is well within range
+			rb->n_wiring += 1;
+			ljlog_warn(data->log,
+				"%s reads back pinned at %G V on AIN%hhu, but "
+				"should be %G V; check the wiring",
+				name, got, rb->ain, want
+			);
+		} else if (err > tol && !isnan(rb->last_want)
+			&& fabs(want - rb->last_want) > tol
+			&& fabs(got - rb->last_got) <= tol
+		) {
+			rb->n_stuck += 1;
+			ljlog_warn(data->log,
+				"%s looks stuck at %G V: told to go from %G V "
+				"to %G V", name, got, rb->last_want, want
+			);
+		} else if (err > tol) {
+			rb->n_drift += 1;
+			ljlog_warn(data->log,
+				"%s reads back %G V, but should be %G V",
+				name, got, want
+			);
+		}
+		rb->last_want = want;
+		rb->last_got = got;
+	}
+}
+
+
+// Compare the calibration the LJTick just sent us (in packet k of the loop's
+// batch) with the cached one, and start using (and caching) the real one if
+// they differ. If the read didn't go through, we try again next loop.
+static int verify_cal(struct aylp_ljtdac_data *data,
+	const struct ljud_batch *batch, unsigned k
+) {
+	int err;
+	struct ljtdac_cal_mem cal_mem;
+	err = ljtdac_unpack_cal_mem(batch, k, &cal_mem);
+	if (err) {
+		ljlog_warn(data->log, "LJTick calibration check returned %d",
+			err
+		);
+		return 0;
+	}
+	data->cal_unverified = false;
+	if (!memcmp(&cal_mem, &data->cal_mem, sizeof(cal_mem))) {
+		ljlog_debug(data->log, "Cached LJTick calibration checks out");
+		return 0;
+	}
+	ljlog_warn(data->log, "Cached LJTick calibration was stale; this "
+		"loop's writes used it"
+	);
+	data->cal_mem = cal_mem;
+	err = build_channels(data);
+	if (err) return err;
+	save_cache(data);
+	return 0;
+}
+
+
+// Open the device over USB. Goes through the ljdisc map if we could start
+// discovery, and otherwise has liblabjackusb walk the bus. Once we know the
+// serial number, reconnecting looks for the same device again.
+static int open_usb(struct aylp_ljtdac_data *data)
+{
+	const struct ljmodel *model = data->model;
+	uint32_t serial = data->serial ? data->serial : data->serial_number;
+	if (data->disc) {
+		size_t dev_count = ljdisc_count(model->product_id);
+		if (!serial && dev_count > 1) {
+			log_info("I see %zu %ss. Using the lowest serial number.",
+				dev_count, model->name
+			);
+		}
+		data->dev = ljdisc_open(model->product_id, serial);
+		if (!data->dev && errno == ENOENT) {
+			if (serial) {
+				log_error("No %s with serial number %u",
+					model->name, serial
+				);
+			} else {
+				log_error("No %ss found", model->name);
+			}
+			return -1;
+		}
+		return 0;
+	}
+	size_t dev_count = LJUSB_GetDevCount(model->product_id);
+	if (!dev_count) {
+		log_error("LJUSB_GetDevCount returned 0.");
+		return -1;
+	}
+	if (!serial) {
+		if (dev_count > 1) {
+			log_info("I see %u %ss. Using the first.",
+				dev_count, model->name
+			);
+		}
+		data->dev = model->open(1);
+		return 0;
+	}
+	// without discovery, the only way to find a serial number is to open
+	// each device in turn and ask it
+	for (unsigned i = 1; i <= dev_count; i++) {
+		struct ljud_dev *dev = model->open(i);
+		// someone else may have it open
+		if (!dev) continue;
+		struct ljmodel_info info;
+		if (!model->read_config(dev, &info)
+			&& info.serial_number == serial
+		) {
+			data->dev = dev;
+			return 0;
+		}
+		ljud_close(dev);
+	}
+	log_error("No %s with serial number %u", model->name, serial);
+	return -1;
+}
+
+
+// Open the device for a session of sharers, when we're the first in.
+static struct ljud_dev *open_shared(void *arg)
+{
+	struct aylp_ljtdac_data *data = arg;
+	if (open_usb(data)) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return data->dev;
+}
+
+
+// Open and set up whichever model the host param picked
+static int init_dev(struct aylp_ljtdac_data *data)
 {
 	int err;
+	const struct ljmodel *model = data->model;
 	// decide on pins
 	// TODO: parametrize
 	data->square_pin = LJU3_FIO6;
-	data->sda_pin = LJU3_FIO5;
-	data->scl_pin = LJU3_FIO4;
+	data->sda_pin = model->sda_pin;
+	data->scl_pin = model->scl_pin;
+
+	// lay out the timers: square wave first, then inputs
+	data->n_timers = 0;
+	if (data->square_hz) {
+		data->timer_modes[data->n_timers++] = LJU3_TIMER_OUT_SQUARE;
+	}
+	for (uint8_t i = 0; i < data->n_inputs; i++) {
+		unsigned n = data->inputs[i].mode == LJU3_TIMER_IN_QUAD ? 2 : 1;
+		if (data->n_timers + n > 2) {
+			log_error("Only two timers are supported");
+			return -1;
+		}
+		data->inputs[i].timer = data->n_timers;
+		for (unsigned j = 0; j < n; j++) {
+			data->timer_values[data->n_timers] = 0;
+			data->timer_modes[data->n_timers++] =
+				data->inputs[i].mode;
+		}
+	}
+	for (uint8_t i = 0; i < data->n_pwm; i++) {
+		if (data->n_timers + 1 > 2) {
+			log_error("Only two timers are supported");
+			return -1;
+		}
+		data->pwm[i].timer = data->n_timers;
+		// start out low
+		data->timer_values[data->n_timers] = 0xFFFF;
+		data->timer_modes[data->n_timers++] = data->pwm[i].mode;
+	}
+	if (data->clock) {
+		if (data->n_timers + 1 > 2) {
+			log_error("Only two timers are supported");
+			return -1;
+		}
+		data->clock_timer = data->n_timers;
+		data->timer_values[data->n_timers] = 0;
+		data->timer_modes[data->n_timers++] = LJU3_TIMER_READ_LOW;
+		// a new connection might be to a device that's been reset
+		ljclock_init(&data->clk, LJU3_SYSTEM_TIMER_HZ);
+	}
+	data->timer_offset = data->square_pin;
+	if (data->trigger) {
+		if (data->trigger_pin == 0xFF) {
+			// counter goes right after the timers
+			data->trigger_pin = data->timer_offset + data->n_timers;
+		} else if (data->trigger_pin < data->n_timers) {
+			log_error("trigger_pin leaves no room for timers");
+			return -1;
+		}
+		data->timer_offset = data->trigger_pin - data->n_timers;
+	}
+	data->square_pin = data->timer_offset;
 
 	// get a handle
-	size_t dev_count = LJUSB_GetDevCount(U3_PRODUCT_ID);
-	if (!dev_count) {
-		log_error("LJUSB_GetDevCount returned 0.");
-		return -1;
-	} else if (dev_count > 1) {
-		log_info("I see %u U3s. Using the first.", dev_count);
+	switch (data->transport) {
+	case AYLP_LJTDAC_USB:
+		if (data->share) {
+			data->dev = ljsession_join(model->product_id,
+				data->serial, open_shared, data
+			);
+			data->member = data->dev;
+			break;
+		}
+		err = open_usb(data);
+		if (err) return err;
+		break;
+	case AYLP_LJTDAC_SIM:
+		data->dev = ljsim_open(model->product_id,
+			data->sim_latency ? &model->sim_profile : NULL
+		);
+		break;
+	case AYLP_LJTDAC_BROKER:
+		data->dev = ljbroker_connect(data->broker_name
+			? data->broker_name : LJBROKER_DEFAULT_NAME
+		);
+		break;
+	case AYLP_LJTDAC_REPLAY:
+		if (!data->replay_path) {
+			log_error("The replay transport needs a replay param");
+			return -1;
+		}
+		data->dev = ljtrace_replay(data->replay_path,
+			data->replay_scale
+		);
+		break;
 	}
-	data->dev = LJUSB_OpenDevice(1, 0, U3_PRODUCT_ID);
 	if (!data->dev) {
-		log_error("Failed to open U3: %s", strerror(errno));
+		log_error("Failed to open %s: %s", model->name, strerror(errno));
 		return -1;
 	}
+	// a new recording would clobber the old one, so only record the first
+	// connection
+	if (data->record_path && !data->n_outages) {
+		struct ljud_dev *rec = ljtrace_record(data->dev,
+			data->record_path
+		);
+		if (!rec) {
+			log_error("Couldn't record to %s: %s",
+				data->record_path, strerror(errno)
+			);
+			return -1;
+		}
+		data->dev = rec;
+		log_info("Recording %s traffic to %s",
+			model->name, data->record_path
+		);
+	}
+	log_debug("Opened %s through %s transport",
+		model->name, data->dev->ops->name
+	);
 
-	// check that we can read startup config
-	struct lju3_config_resp config_resp;
-	err = lju3_read_config(data->dev, &config_resp);
+	// check that we can read startup config, and that it's what we expect
+	struct ljmodel_info info;
+	err = model->read_config(data->dev, &info);
 	if (err) {
-		log_error("lju3_config_resp returned %d: %s",
-			err, strerror(-err)
-		);
+		log_error("read_config returned %d: %s", err, strerror(-err));
 		log_debug("errno was %d: %s", errno, strerror(errno));
 		return -1;
 	}
-	log_debug("U3 startup configuration:");
+	log_debug("%s startup configuration:", model->name);
 	log_debug("	firmware_version: %hhu.%hhu",
-		config_resp.firmware_version >> 8,
-		config_resp.firmware_version
+		info.firmware_version >> 8, info.firmware_version
 	);
 	log_debug("	bootloader_version: %hhu.%hhu",
-		config_resp.bootloader_version >> 8,
-		config_resp.bootloader_version
+		info.bootloader_version >> 8, info.bootloader_version
 	);
 	log_debug("	hardware_version: %hhu.%hhu",
-		config_resp.hardware_version >> 8,
-		config_resp.hardware_version
-	);
-	log_debug("	serial_number: %u", config_resp.serial_number);
-	log_debug("	product_id: %u", config_resp.product_id);
-	log_debug("	local_id: %u", config_resp.local_id);
-	log_debug("	timer_counter_mask: 0x%hhX",
-		config_resp.timer_counter_mask
-	);
-	log_debug("	fio_analog: %u", config_resp.fio_analog);
-	log_debug("	fio_direction: %u", config_resp.fio_direction);
-	log_debug("	fio_state: %u", config_resp.fio_state);
-	log_debug("	eio_analog: %u", config_resp.eio_analog);
-	log_debug("	eio_direction: %u", config_resp.eio_direction);
-	log_debug("	eio_state: %u", config_resp.eio_state);
-	log_debug("	cio_direction: %u", config_resp.cio_direction);
-	log_debug("	cio_state: %u", config_resp.cio_state);
-	log_debug("	dac1_enable: %u", config_resp.dac1_enable);
-	log_debug("	dac0: %u", config_resp.dac0);
-	log_debug("	dac1: %u", config_resp.dac1);
-	log_debug("	clock_config: %u", config_resp.clock_config);
-	log_debug("	clock_divisor: %u", config_resp.clock_divisor);
-	log_debug("	compatibility: %u", config_resp.compatibility);
-	log_debug("	version_info: 0x%hhX",
-		config_resp.version_info
+		info.hardware_version >> 8, info.hardware_version
 	);
-
-	// configure IO ports
-	struct lju3_config_io config_io = {0};
-	struct lju3_config_io_resp config_io_resp;
-	config_io.write_mask |= 1 << 0;		// set counter_config
-	config_io.write_mask |= 1 << 1;		// set dac1_enable
-	config_io.write_mask |= 1 << 2;		// set fio_analog
-	config_io.timer_counter_config = 0x40;	// disable counters, offset = 4
-	config_io.dac1_enable = 0;		// disable dac1
-	config_io.fio_analog = 0;		// set to digital
-	err = lju3_config_io(data->dev, &config_io, &config_io_resp);
-	if (err) {
-		log_error("lju3_config_io returned %d: %s",
-			err, strerror(-err)
+	log_debug("	serial_number: %u", info.serial_number);
+	log_debug("	product_id: %u", info.product_id);
+	log_debug("	local_id: %u", info.local_id);
+	if (info.product_id != model->product_id) {
+		log_error("Expected a %s (product ID %lu) but got product ID %u",
+			model->name, model->product_id, info.product_id
+		);
+		return -1;
+	}
+	if (data->serial && info.serial_number != data->serial) {
+		log_error("Expected serial number %u but got %u",
+			data->serial, info.serial_number
 		);
-		log_debug("errno was %d: %s", errno, strerror(errno));
 		return -1;
 	}
-	log_debug("U3 ConfigIO:");
-	log_debug("	timer_counter_config: %hhX",
-		config_io_resp.timer_counter_config
-	);
-	log_debug("	dac1_enable: %u", config_io_resp.dac1_enable);
-	log_debug("	fio_analog: %u", config_io_resp.fio_analog);
-	log_debug("	eio_analog: %u", config_io_resp.eio_analog);
 
-	// output square wave if wanted
-	if (data->square_hz) {
-		log_info("You requested square_hz = %lu", data->square_hz);
-		double hz_real;
-		err = lju3_square(
-			data->dev, LJU3_FIO6, data->square_hz, &hz_real
+	data->serial_number = info.serial_number;
+
+	err = plan_timers(data);
+	if (err) return err;
+
+	// if we've set this device up the same way before, skip all that
+	struct ljcache cache;
+	if (data->cache_dir) {
+		err = ljcache_load(data->cache_dir, data->serial_number, &cache);
+		if (err && err != -ENOENT) {
+			log_warn("Ignoring cache entry: %s", strerror(-err));
+		}
+		if (!err && config_unchanged(data, &cache)) {
+			log_info("%s is already configured; skipping ConfigIO",
+				model->name
+			);
+			data->configured = true;
+		}
+		if (
+			!err && cache.sda_pin == data->sda_pin
+			&& cache.scl_pin == data->scl_pin
+		) {
+			data->cal_mem = cache.cal_mem;
+			data->cal_cached = true;
+			data->cal_unverified = true;
+		}
+	}
+
+	if (!data->configured) {
+		// configure IO ports: counters off, offset 4, all digital but
+		// any readback inputs
+		struct ljmodel_io io;
+		err = model->config_io(data->dev, &(struct ljmodel_io){
+			.offset = 4, .digital = true,
+			.analog = data->analog_mask,
+		}, &io);
+		if (err) {
+			log_error("config_io returned %d: %s", err, strerror(-err));
+			log_debug("errno was %d: %s", errno, strerror(errno));
+			return -1;
+		}
+		log_debug("%s ConfigIO:", model->name);
+		log_debug("	n_timers: %hhu", io.n_timers);
+		log_debug("	counters: 0x%hhX", io.counters);
+		log_debug("	offset: %hhu", io.offset);
+
+		// set up square wave, timer inputs and trigger counter
+		err = config_timers(data);
+		if (err) return err;
+	}
+
+	err = start_timers(data);
+	if (err) return err;
+
+	return 0;
+}
+
+
+// Open and set up the device and read the LJTick calibration, everything short of
+// parsing params. Used at startup and again when reconnecting.
+static int connect_dev(struct aylp_ljtdac_data *data)
+{
+	int err;
+	err = init_dev(data);
+	if (err) return err;
+
+	// find the fastest I2C clock the LJTick keeps up with, which reads
+	// calibration memory along the way
+	if (data->speed_auto) {
+		double read_ns;
+		err = ljtdac_autotune(data->dev, data->sda_pin, data->scl_pin,
+			AYLP_LJTDAC_TUNE_TRIALS, AYLP_LJTDAC_TUNE_MARGIN,
+			&data->speed_adjust, &data->cal_mem, &read_ns
 		);
 		if (err) {
-			log_error("lju3_square returned %d: %s",
+			log_error("ljtdac_autotune returned %d: %s",
 				err, strerror(-err)
 			);
 			log_debug("errno was %d: %s", errno, strerror(errno));
-			return err;
+			return -1;
 		}
-		log_info("Best I could do: %G Hz", hz_real);
+		log_info("I2C speed_adjust autotuned to %hhu; calibration "
+			"reads take %.0f us", data->speed_adjust, read_ns * 1e-3
+		);
+		data->cal_cached = false;
+		data->cal_unverified = false;
+	}
+
+	// read ljtick-dac calibration memory, unless we have it cached, in
+	// which case the first proc checks it for us
+	if (data->speed_auto) {
+		log_debug("Using autotune's LJTick calibration");
+	} else if (data->cal_cached) {
+		log_debug("Using cached LJTick calibration");
+	} else {
+		err = ljtdac_read_cal_mem(data->dev, &data->cal_mem,
+			data->sda_pin, data->scl_pin, data->speed_adjust
+		);
+		if (err) {
+			log_error("ljtdac_read_cal_mem returned %d: %s",
+				err, strerror(-err)
+			);
+			log_debug("errno was %d: %s", errno, strerror(errno));
+			return -1;
+		}
+	}
+	log_debug("LJTick calibration:");
+	log_debug("	daca_slope: %G", fp642dbl(data->cal_mem.daca_slope));
+	log_debug("	daca_offset: %G", fp642dbl(data->cal_mem.daca_offset));
+	log_debug("	dacb_slope: %G", fp642dbl(data->cal_mem.dacb_slope));
+	log_debug("	dacb_offset: %G", fp642dbl(data->cal_mem.dacb_offset));
+	log_debug("	serial_number: %lu", data->cal_mem.serial_number);
+
+	// now that we have calibration, work out how to convert each channel
+	err = build_channels(data);
+	if (err) return err;
+	err = config_digital(data, true, true);
+	if (err) return err;
+	err = setup_readback(data);
+	if (err) return err;
+	err = setup_spidac(data);
+	if (err) return err;
+
+	if (!data->cal_cached || !data->configured) save_cache(data);
+
+	return 0;
+}
+
+
+// Say so if the recording stopped early, say because the disk filled up. The
+// recorder goes when data->dev is closed, so this is once per recording.
+static void check_recording(struct aylp_ljtdac_data *data)
+{
+	int err = ljtrace_record_error(data->dev);
+	if (err) {
+		log_error("Recording to %s stopped early: %s",
+			data->record_path, strerror(-err)
+		);
+	}
+}
+
+
+// Background thread that keeps trying to bring the device back. proc leaves the
+// device alone until this sets reconnected, so it has data->dev and the
+// calibration to itself until then.
+static void *reconnect_main(void *arg)
+{
+	struct aylp_ljtdac_data *data = arg;
+	check_recording(data);
+	ljud_close(data->dev);
+	data->dev = NULL;
+	while (!atomic_load(&data->reconnect_stop)) {
+		// sleep in short steps so fini doesn't have to wait long
+		for (unsigned long ms = 0; ms < data->reconnect_ms; ms += 50) {
+			if (atomic_load(&data->reconnect_stop)) return NULL;
+			struct timespec ts = {.tv_nsec = 50000000};
+			nanosleep(&ts, NULL);
+		}
+		data->configured = false;
+		data->cal_cached = false;
+		data->cal_unverified = false;
+		if (!connect_dev(data)) {
+			atomic_store_explicit(&data->reconnected, true,
+				memory_order_release
+			);
+			return NULL;
+		}
+		ljud_close(data->dev);
+		data->dev = NULL;
+	}
+	return NULL;
+}
+
+
+static int start_reconnect(struct aylp_ljtdac_data *data)
+{
+	log_error("Lost the %s; reconnecting in the background",
+		data->model->name
+	);
+	data->lost = true;
+	data->t_lost = now_ns();
+	data->n_outages += 1;
+	atomic_store(&data->reconnected, false);
+	atomic_store(&data->reconnect_stop, false);
+	int err = pthread_create(&data->reconnect_thread, NULL,
+		reconnect_main, data
+	);
+	if (err) {
+		log_error("pthread_create returned %d: %s",
+			err, strerror(err)
+		);
+		data->lost = false;
+		return -err;
 	}
+	return 0;
+}
+
 
+// The device is gone: start reconnecting, and carry on without it.
+static int degrade(struct aylp_ljtdac_data *data, struct aylp_state *state)
+{
+	int err = start_reconnect(data);
+	if (err) return err;
+	if (data->n_inputs) set_inputs(data, state, NULL);
+	publish(data, state, LJMON_LOST);
 	return 0;
 }
 
 
+// Returns true if proc should return straight away because we're still
+// waiting on the device, swapping the new handle in if it's ready.
+static bool outage(struct aylp_ljtdac_data *data, struct aylp_state *state)
+{
+	if (!data->lost) return false;
+	uint64_t t = now_ns();
+	if (!atomic_load_explicit(&data->reconnected, memory_order_acquire)) {
+		if (data->n_inputs) set_inputs(data, state, NULL);
+		publish(data, state, LJMON_LOST);
+		uint64_t dt = now_ns() - t;
+		data->outage_proc_n += 1;
+		data->outage_proc_sum_ns += dt;
+		if (dt > data->outage_proc_max_ns)
+			data->outage_proc_max_ns = dt;
+		return true;
+	}
+	pthread_join(data->reconnect_thread, NULL);
+	data->lost = false;
+	data->resync_failed = false;
+	data->desynced = false;
+	data->n_unread = 0;
+	data->downtime_ns += t - data->t_lost;
+	// setpoints from before the outage are too old to fit through
+	data->predict.n_hist = 0;
+	log_info("%s is back after %.3f s",
+		data->model->name, (t - data->t_lost) * 1e-9
+	);
+	return false;
+}
+
+
 int aylp_ljtdac_init(struct aylp_device *self)
 {
 	int err;
 	self->device_data = xcalloc(1, sizeof(struct aylp_ljtdac_data));
 	struct aylp_ljtdac_data *data = self->device_data;
 
-	unsigned product_id = 0;
+	// anything proc logs goes through a ring, to be formatted elsewhere
+	data->log = ljlog_open();
+	if (!data->log) {
+		log_warn("Couldn't start the log thread (%s); proc will log "
+			"synchronously", strerror(errno)
+		);
+	}
+	data->trigger_pin = 0xFF;
+	data->trigger_timeout_ms = 1000;
+	data->replay_scale = 1.0;
+	data->verify_min = 0.05;
+	data->on_miss = AYLP_LJTDAC_FAIL;
+	data->reconnect_ms = 1000;
+	data->readback_every = 100;
+	data->readback_tolerance = 0.05;
+	data->readback_divider = 1.0;
+	bool cache = true;
+	const char *monitor = NULL;
+	unsigned predict = 0;
 
 	if (!self->params) {
 		log_error("No params object found.");
@@ -145,9 +1834,9 @@ int aylp_ljtdac_init(struct aylp_device *self)
 			// keys starting with _ are comments
 		} else if (!strcmp(key, "host")) {
 			const char *host = json_object_get_string(val);
-			if (!strcasecmp(host, "U3")) {
-				log_trace("host = U3");
-				product_id = U3_PRODUCT_ID;
+			data->model = ljmodel_from_name(host);
+			if (data->model) {
+				log_trace("host = %s", data->model->name);
 			} else {
 				log_warn("Unknown host: %s", host);
 			}
@@ -157,42 +1846,274 @@ int aylp_ljtdac_init(struct aylp_device *self)
 		} else if (!strcmp(key, "fast")) {
 			data->fast = json_object_get_boolean(val);
 			log_trace("fast = %hhu", data->fast);
+		} else if (!strcmp(key, "speed_adjust")) {
+			if (json_object_is_type(val, json_type_string)) {
+				const char *speed = json_object_get_string(val);
+				if (strcasecmp(speed, "auto")) {
+					log_error("Unknown speed_adjust: %s",
+						speed
+					);
+					return -1;
+				}
+				data->speed_auto = true;
+				log_trace("speed_adjust = auto");
+			} else {
+				int64_t speed = json_object_get_int64(val);
+				if (speed < 0 || speed > 255) {
+					log_error("speed_adjust must be from 0 "
+						"to 255, or \"auto\""
+					);
+					return -1;
+				}
+				data->speed_adjust = speed;
+				log_trace("speed_adjust = %hhu",
+					data->speed_adjust
+				);
+			}
+		} else if (!strcmp(key, "budget_us")) {
+			data->budget_ns = json_object_get_uint64(val) * 1000;
+			log_trace("budget_us = %lu", data->budget_ns / 1000);
+		} else if (!strcmp(key, "verify_min")) {
+			data->verify_min = json_object_get_double(val);
+			if (data->verify_min < 0 || data->verify_min > 1) {
+				log_error("verify_min must be from 0 to 1");
+				return -1;
+			}
+			log_trace("verify_min = %G", data->verify_min);
+		} else if (!strcmp(key, "predict")) {
+			predict = json_object_get_uint64(val);
+			if (predict > 2) {
+				log_error("predict must be 0, 1 or 2");
+				return -1;
+			}
+			log_trace("predict = %u", predict);
+		} else if (!strcmp(key, "retries")) {
+			data->retries = json_object_get_uint64(val);
+			log_trace("retries = %u", data->retries);
+		} else if (!strcmp(key, "deadline_us")) {
+			data->deadline_ns = json_object_get_uint64(val) * 1000;
+			log_trace("deadline_us = %lu", data->deadline_ns / 1000);
+		} else if (!strcmp(key, "on_miss")) {
+			const char *on_miss = json_object_get_string(val);
+			if (!strcasecmp(on_miss, "fail")) {
+				data->on_miss = AYLP_LJTDAC_FAIL;
+			} else if (!strcasecmp(on_miss, "hold")) {
+				data->on_miss = AYLP_LJTDAC_HOLD;
+			} else if (!strcasecmp(on_miss, "skip")) {
+				data->on_miss = AYLP_LJTDAC_SKIP;
+			} else {
+				log_error("Unknown on_miss: %s", on_miss);
+				return -1;
+			}
+			log_trace("on_miss = %s", on_miss);
+		} else if (!strcmp(key, "reconnect")) {
+			data->reconnect = json_object_get_boolean(val);
+			log_trace("reconnect = %hhu", data->reconnect);
+		} else if (!strcmp(key, "reconnect_ms")) {
+			data->reconnect_ms = json_object_get_uint64(val);
+			log_trace("reconnect_ms = %lu", data->reconnect_ms);
+		} else if (!strcmp(key, "clock")) {
+			data->clock = json_object_get_boolean(val);
+			log_trace("clock = %hhu", data->clock);
+		} else if (!strcmp(key, "monitor")) {
+			monitor = json_object_get_string(val);
+			log_trace("monitor = %s", monitor);
+		} else if (!strcmp(key, "trigger")) {
+			const char *trigger = json_object_get_string(val);
+			if (!strcasecmp(trigger, "counter0")) {
+				data->trigger_counter = 0;
+			} else if (!strcasecmp(trigger, "counter1")) {
+				data->trigger_counter = 1;
+			} else {
+				log_error("Unknown trigger: %s", trigger);
+				return -1;
+			}
+			data->trigger = true;
+			log_trace("trigger = %s", trigger);
+		} else if (!strcmp(key, "trigger_pin")) {
+			const char *pin = json_object_get_string(val);
+			int p = lju3_pin_from_name(pin);
+			if (p < 0) {
+				log_error("Unknown pin: %s", pin);
+				return -1;
+			}
+			data->trigger_pin = p;
+			log_trace("trigger_pin = %s", pin);
+		} else if (!strcmp(key, "trigger_wait")) {
+			data->trigger_wait = json_object_get_boolean(val);
+			log_trace("trigger_wait = %hhu", data->trigger_wait);
+		} else if (!strcmp(key, "trigger_timeout_ms")) {
+			data->trigger_timeout_ms = json_object_get_uint64(val);
+			log_trace("trigger_timeout_ms = %lu",
+				data->trigger_timeout_ms
+			);
+		} else if (!strcmp(key, "inputs")) {
+			size_t n = json_object_array_length(val);
+			if (n > 2) {
+				log_error("Only two timers are supported");
+				return -1;
+			}
+			for (size_t i = 0; i < n; i++) {
+				const char *mode = json_object_get_string(
+					json_object_array_get_idx(val, i)
+				);
+				if (!strcasecmp(mode, "quadrature")) {
+					data->inputs[i].mode =
+						LJU3_TIMER_IN_QUAD;
+				} else if (!strcasecmp(mode, "period")) {
+					data->inputs[i].mode =
+						LJU3_TIMER_IN_P32R;
+				} else if (!strcasecmp(mode, "duty")) {
+					data->inputs[i].mode =
+						LJU3_TIMER_IN_DUTY;
+				} else {
+					log_error("Unknown input: %s", mode);
+					return -1;
+				}
+				log_trace("inputs[%zu] = %s", i, mode);
+			}
+			data->n_inputs = n;
+		} else if (!strcmp(key, "pwm")) {
+			size_t n = json_object_array_length(val);
+			if (n > 2) {
+				log_error("Only two timers are supported");
+				return -1;
+			}
+			for (size_t i = 0; i < n; i++) {
+				const char *mode = json_object_get_string(
+					json_object_array_get_idx(val, i)
+				);
+				if (!strcasecmp(mode, "pwm16")) {
+					data->pwm[i].mode =
+						LJU3_TIMER_OUT_PWM16;
+				} else if (!strcasecmp(mode, "pwm8")) {
+					data->pwm[i].mode = LJU3_TIMER_OUT_PWM8;
+				} else {
+					log_error("Unknown pwm mode: %s", mode);
+					return -1;
+				}
+				log_trace("pwm[%zu] = %s", i, mode);
+			}
+			data->n_pwm = n;
+		} else if (!strcmp(key, "transport")) {
+			const char *transport = json_object_get_string(val);
+			if (!strcasecmp(transport, "usb")) {
+				data->transport = AYLP_LJTDAC_USB;
+			} else if (!strcasecmp(transport, "sim")) {
+				data->transport = AYLP_LJTDAC_SIM;
+			} else if (!strcasecmp(transport, "broker")) {
+				data->transport = AYLP_LJTDAC_BROKER;
+			} else if (!strcasecmp(transport, "replay")) {
+				data->transport = AYLP_LJTDAC_REPLAY;
+			} else {
+				log_error("Unknown transport: %s", transport);
+				return -1;
+			}
+			log_trace("transport = %s", transport);
+		} else if (!strcmp(key, "share")) {
+			data->share = json_object_get_boolean(val);
+			log_trace("share = %hhu", data->share);
+		} else if (!strcmp(key, "serial")) {
+			data->serial = json_object_get_uint64(val);
+			log_trace("serial = %u", data->serial);
+		} else if (!strcmp(key, "broker_name")) {
+			free(data->broker_name);
+			data->broker_name = strdup(json_object_get_string(val));
+			log_trace("broker_name = %s", data->broker_name);
+		} else if (!strcmp(key, "record")) {
+			free(data->record_path);
+			data->record_path = strdup(json_object_get_string(val));
+			log_trace("record = %s", data->record_path);
+		} else if (!strcmp(key, "sim_latency")) {
+			data->sim_latency = json_object_get_boolean(val);
+			log_trace("sim_latency = %hhu", data->sim_latency);
+		} else if (!strcmp(key, "replay")) {
+			free(data->replay_path);
+			data->replay_path = strdup(json_object_get_string(val));
+			log_trace("replay = %s", data->replay_path);
+		} else if (!strcmp(key, "replay_scale")) {
+			data->replay_scale = json_object_get_double(val);
+			log_trace("replay_scale = %G", data->replay_scale);
+		} else if (!strcmp(key, "cache")) {
+			cache = json_object_get_boolean(val);
+			log_trace("cache = %hhu", cache);
+		} else if (!strcmp(key, "cache_dir")) {
+			free(data->cache_dir);
+			data->cache_dir = strdup(json_object_get_string(val));
+			log_trace("cache_dir = %s", data->cache_dir);
+		} else if (!strcmp(key, "channels")) {
+			data->channels = val;
+			log_trace("channels = %s", json_object_get_string(val));
+		} else if (!strcmp(key, "readback")) {
+			err = parse_readback(data, val);
+			if (err) return err;
+			log_trace("readback = %s", json_object_get_string(val));
+		} else if (!strcmp(key, "spidac")) {
+			err = parse_spidac(data, val);
+			if (err) return err;
+			log_trace("spidac = %s", json_object_get_string(val));
 		} else {
 			log_warn("Unknown parameter \"%s\"", key);
 		}
 	}
 
+	// adaptive mode starts out verifying until it knows better
+	data->verifying = true;
+	ljpredict_init(&data->predict, predict);
+
+	if (!cache) {
+		free(data->cache_dir);
+		data->cache_dir = NULL;
+	} else if (!data->cache_dir) {
+		data->cache_dir = ljcache_default_dir();
+	}
+
 	log_debug("liblabjackusb version %G", LJUSB_GetLibraryVersion());
 
-	switch (product_id) {
-	case U3_PRODUCT_ID:
-		err = init_u3(data);
-		if (err) return err;
-		self->proc = &aylp_ljtdac_u3_proc;
-		self->fini = &aylp_ljtdac_u3_fini;
-		break;
-	default:
+	if (!data->model) {
 		log_error("Didn't get a valid \"host\" param.");
 		return -1;
 	}
-
-	// read ljtick-dac calibration memory
-	err = ljtdac_read_cal_mem(
-		data->dev, &data->cal_mem, data->sda_pin, data->scl_pin
-	);
-	if (err) {
-		log_error("ljtdac_read_cal_mem returned %d: %s",
-			err, strerror(-err)
-		);
-		log_debug("errno was %d: %s", errno, strerror(errno));
+	if (data->n_readback && data->model != &ljmodel_u3) {
+		log_error("readback is only implemented for the U3");
 		return -1;
 	}
-	log_debug("LJTick calibration:");
-	log_debug("	daca_slope: %G", fp642dbl(data->cal_mem.daca_slope));
-	log_debug("	daca_offset: %G", fp642dbl(data->cal_mem.daca_offset));
-	log_debug("	dacb_slope: %G", fp642dbl(data->cal_mem.dacb_slope));
-	log_debug("	dacb_offset: %G", fp642dbl(data->cal_mem.dacb_offset));
-	log_debug("	serial_number: %lu", data->cal_mem.serial_number);
+	if (data->clock && data->model != &ljmodel_u3) {
+		log_error("clock is only implemented for the U3");
+		return -1;
+	}
+	if (data->spidac.n && data->model != &ljmodel_u3) {
+		log_error("spidac is only implemented for the U3");
+		return -1;
+	}
+	data->exec_min_ns = UINT64_MAX;
+	if (data->transport == AYLP_LJTDAC_USB) {
+		err = ljdisc_get();
+		data->disc = !err;
+		if (err) {
+			log_info("Not using hotplug discovery: %s",
+				strerror(-err)
+			);
+		}
+	}
+	err = connect_dev(data);
+	if (err) {
+		if (data->disc) ljdisc_put();
+		return err;
+	}
+	self->proc = &aylp_ljtdac_proc;
+	self->fini = &aylp_ljtdac_fini;
+
+	if (monitor) {
+		err = ljmon_create(&data->mon, monitor);
+		if (err) {
+			log_error("Couldn't publish to %s: %s",
+				monitor, strerror(-err)
+			);
+			return -1;
+		}
+		log_info("Publishing applied setpoints on %s", monitor);
+	}
 
 	// set types and units
 	self->type_in = AYLP_T_VECTOR;
@@ -203,49 +2124,396 @@ int aylp_ljtdac_init(struct aylp_device *self)
 }
 
 
-int aylp_ljtdac_u3_proc(struct aylp_device *self, struct aylp_state *state)
+// Fold the system timer reading from a loop's Feedback packet into the clock
+// fit, and work out when (in our time) the loop's writes had all run, which
+// is when the reading was taken. Its packet went out at t0 and the response
+// was back by t1, so that's somewhere in between whatever the fit says.
+static uint64_t clock_stamp(struct aylp_ljtdac_data *data,
+	const uint8_t *raw, uint64_t t0, uint64_t t1
+) {
+	uint32_t ticks = raw[0] | raw[1] << 8 | raw[2] << 16
+		| (uint32_t)raw[3] << 24;
+	ljclock_sample(&data->clk, ticks, t0, t1);
+	uint64_t t = ljclock_to_host(&data->clk, ticks);
+	if (t < t0) t = t0;
+	if (t > t1) t = t1;
+	return t;
+}
+
+
+// One loop's worth of proc, without the tracepoints around it
+static int proc_loop(struct aylp_ljtdac_data *data, struct aylp_state *state)
 {
 	int err;
-	struct aylp_ljtdac_data *data = self->device_data;
-	if (state->vector->size > 0) {
-		err = ljtdac_write_dac(
-			data->dev, &data->cal_mem, data->sda_pin, data->scl_pin,
-			data->fast, LJTDAC_WRITE_DACA, state->vector->data[0]
-		);
+	uint64_t t_edge = 0;
+	if (outage(data, state)) return 0;
+	// whatever the last loop left owing comes first, deadline or not,
+	// since nothing read back means anything until it's done
+	if (data->desynced) resync(data, 0);
+	// without waiting, the counter's read along with the loop's writes
+	if (data->trigger && data->trigger_wait) {
+		err = poll_trigger(data, &t_edge);
 		if (err) {
-			log_error("ljtdac_write_dac returned %d: %s",
+			ljlog_error(data->log, "read_counter returned %d: %s",
 				err, strerror(-err)
 			);
-			log_debug("errno was %d: %s", errno, strerror(errno));
-			return err;
+			if (transient(err)) resync(data, 0);
+			if (lost(data, err)) return degrade(data, state);
+			if (data->on_miss == AYLP_LJTDAC_FAIL) return err;
+			// carry on with the write, without an edge to time
+			t_edge = 0;
+		}
+	}
+	// convert every mapped element in one pass, extrapolated over the
+	// actuation delay if we're compensating for it
+	uint64_t t_sched = now_ns();
+	double in[LJCHAN_MAX];
+	uint16_t codes[LJCHAN_MAX];
+	for (size_t i = 0; i < data->chans.n; i++) {
+		size_t j = data->chans.index[i];
+		in[i] = j < state->vector->size ? state->vector->data[j] : NAN;
+	}
+	ljpredict_apply(&data->predict, data->chans.n, t_sched, in);
+	ljchan_codes(&data->chans, in, codes);
+
+	// every so often, read the DACs back on the inputs they're wired to
+	bool check = false;
+	if (data->n_readback
+		&& ++data->readback_count >= data->readback_every
+	) {
+		data->readback_count = 0;
+		check = true;
+	}
+
+	// Work out which channels are due. Under a budget, a DAC costs a packet
+	// (SPI ones too, pessimistically, though they may share one) and a PWM
+	// output (pessimistically) the Feedback packet it rides in, on top of
+	// the packets we send regardless.
+	bool due[LJCHAN_MAX];
+	double cost[LJCHAN_MAX];
+	double budget = 0.0;
+	if (data->budget_ns && data->packet_ns > 0) {
+		unsigned n_fixed = (data->n_inputs > 0 || check)
+			+ data->cal_unverified;
+		for (size_t i = 0; i < data->chans.n; i++) {
+			bool fb = data->chans.output[i] >= LJCHAN_PWM0
+				&& data->chans.output[i] < LJCHAN_SPI0;
+			cost[i] = fb && data->n_inputs ? 0.0 : data->packet_ns;
 		}
-		log_trace("Wrote %G V to DACA.", state->vector->data[0]);
+		// leave a little headroom, so we back off before we hit it
+		budget = 0.9 * data->budget_ns - n_fixed * data->packet_ns;
+		if (budget <= 0.0) budget = DBL_MIN;
 	}
-	if (state->vector->size > 1) {
-		ljtdac_write_dac(
-			data->dev, &data->cal_mem, data->sda_pin, data->scl_pin,
-			data->fast, LJTDAC_WRITE_DACB, state->vector->data[1]
+	ljchan_schedule(&data->chans, t_sched, cost, budget, due);
+
+	// queue up all of this loop's I/O so it shares one round trip
+	LJ_PROBE1(build_start, data->chans.n);
+	struct ljud_batch batch = {0};
+	int i_fb = -1;
+	// the PWM duty cycle writes, digital outputs, input reads and readback
+	// share a Feedback packet
+	uint8_t cmd[2 * 4 + 7 + 2 + 2 * 3] = {0};
+	unsigned n_fb = 0;
+	unsigned n_fb_resp = 0;
+	uint32_t dio_mask = 0;
+	uint32_t dio_state = 0;
+	uint8_t spi_chan[LJSPI_DAC_MAX];
+	uint16_t spi_code[LJSPI_DAC_MAX];
+	unsigned n_spi = 0;
+	int i_dac[2];
+	unsigned n_dac = 0;
+	unsigned n_written = 0;
+	for (size_t i = 0; i < data->chans.n; i++) {
+		// elements past the end of the vector aren't written
+		if (data->chans.index[i] >= state->vector->size) {
+			due[i] = false;
+			continue;
+		}
+		if (!due[i]) continue;
+		n_written += 1;
+		LJ_PROBE3(pack_chan,
+			data->chans.index[i], data->chans.output[i], codes[i]
 		);
-		if (err) {
-			log_error("ljtdac_write_dac returned %d: %s",
-				err, strerror(-err)
+		int k;
+		switch (data->chans.output[i]) {
+		case LJCHAN_DACA:
+		case LJCHAN_DACB:
+			k = ljtdac_batch_write_code(&batch,
+				data->sda_pin, data->scl_pin,
+				data->speed_adjust,
+				data->chans.output[i] == LJCHAN_DACA
+					? LJTDAC_WRITE_DACA : LJTDAC_WRITE_DACB,
+				codes[i]
 			);
-			log_debug("errno was %d: %s", errno, strerror(errno));
-			return err;
+			if (k < 0) return k;
+			i_dac[n_dac++] = k;
+			break;
+		case LJCHAN_PWM0:
+		case LJCHAN_PWM1:
+			k = data->chans.output[i] - LJCHAN_PWM0;
+			cmd[n_fb + 0] = TIMER0 + 2 * data->pwm[k].timer;
+			cmd[n_fb + 1] = 1;	// update value
+			cmd[n_fb + 2] = codes[i] & 0xFF;
+			cmd[n_fb + 3] = codes[i] >> 8;
+			n_fb += 4;
+			n_fb_resp += 4;
+			break;
+		default:
+			if (data->chans.output[i] >= LJCHAN_SPI0) {
+				spi_chan[n_spi] = data->chans.output[i]
+					- LJCHAN_SPI0;
+				spi_code[n_spi++] = codes[i];
+				break;
+			}
+			k = data->chans.output[i] - LJCHAN_DIO0;
+			dio_mask |= 1UL << k;
+			dio_state |= (uint32_t)codes[i] << k;
+			break;
+		}
+	}
+	// the SPI DAC's writes go out before the Feedback packet, so that
+	// readings in it come after them like the rest
+	int i_spi = -1;
+	unsigned n_spi_packets = 0;
+	if (n_spi) {
+		i_spi = pack_spidac(data, &batch, n_spi, spi_chan, spi_code,
+			&n_spi_packets
+		);
+		if (i_spi < 0) return i_spi;
+	}
+	// digital outputs, a bit at a time if there's only one
+	if (dio_mask & (dio_mask - 1)) {
+		n_fb += pack_ports(cmd + n_fb, PORT_STATE_WRITE,
+			dio_mask, dio_state
+		);
+	} else if (dio_mask) {
+		cmd[n_fb + 0] = BIT_STATE_WRITE;
+		cmd[n_fb + 1] = __builtin_ctz(dio_mask) | (dio_state ? 0x80 : 0);
+		n_fb += 2;
+	}
+	// the system timer, read as soon as this loop's writes have run
+	int i_clock = -1;
+	if (data->clock) {
+		i_clock = n_fb_resp;
+		cmd[n_fb] = TIMER0 + 2 * data->clock_timer;
+		n_fb += 4;
+		n_fb_resp += 4;
+	}
+	int i_count = -1;
+	if (data->trigger && !data->trigger_wait) {
+		i_count = n_fb_resp;
+		cmd[n_fb + 0] = COUNTER0 + data->trigger_counter;
+		cmd[n_fb + 1] = 0;	// don't reset
+		n_fb += 2;
+		n_fb_resp += 4;
+	}
+	unsigned i_inputs = n_fb_resp;
+	for (uint8_t i = 0; i < data->n_inputs; i++) {
+		cmd[n_fb] = TIMER0 + 2 * data->inputs[i].timer;
+		n_fb += 4;
+		n_fb_resp += 4;
+	}
+	// after the DAC writes, so they see this loop's values
+	unsigned i_readback = n_fb_resp;
+	for (uint8_t i = 0; check && i < data->n_readback; i++) {
+		cmd[n_fb + 0] = AIN;
+		cmd[n_fb + 1] = data->readback[i].ain;
+		cmd[n_fb + 2] = 31;	// single-ended
+		n_fb += 3;
+		n_fb_resp += 2;
+	}
+	if (n_fb) {
+		i_fb = ljud_batch_add(&batch, 0,
+			data->model->feedback_resp_len(n_fb_resp)
+		);
+		batch.n_tx[i_fb] = data->model->pack_feedback(batch.tx[i_fb],
+			cmd, n_fb
+		);
+	}
+	// check cached calibration against the LJTick while we're at it
+	int i_cal = -1;
+	if (data->cal_unverified) {
+		i_cal = ljtdac_batch_read_cal_mem(&batch,
+			data->sda_pin, data->scl_pin, data->speed_adjust
+		);
+		if (i_cal < 0) return i_cal;
+	}
+	// we have to read every response if we read any, or we'd get them out
+	// of order next time around. Plain fast mode doesn't keep track of what
+	// it left unread, so readback there means reading every loop.
+	bool must_read = data->n_inputs || data->trigger || i_cal >= 0
+		|| check || (data->n_readback && !data->budget_ns)
+		|| data->clock;
+	bool read = must_read || !data->fast;
+	if (data->budget_ns)
+		read = must_read || choose_verify(data, batch.n);
+	LJ_PROBE3(build_end, batch.n, n_fb, read);
+	uint64_t t_io = now_ns();
+	err = run_io(data, &batch, read, t_io);
+	if (err && lost(data, err)) return degrade(data, state);
+	if (err) return give_up(data, state, err);
+	uint64_t dt_io = now_ns() - t_io;
+	if (data->budget_ns) adapt(data, &batch, read, dt_io);
+	// a loop that doesn't wait for its responses only times the writes,
+	// which would drag the estimate down to nothing in fast mode
+	if (batch.n && read) {
+		double x = (double)dt_io / batch.n;
+		data->packet_ns = data->packet_ns
+			? data->packet_ns + (x - data->packet_ns) / 8 : x;
+	}
+	uint8_t resp[2 * 4 + 4 + 2 * 2];
+	int err_fb = 0;
+	if (i_fb >= 0 && read) {
+		err_fb = data->model->unpack_feedback(batch.rx[i_fb],
+			resp, n_fb_resp
+		);
+	}
+	int err_spi = 0;
+	if (i_spi >= 0 && read)
+		err_spi = check_spidac(&batch, i_spi, n_spi_packets);
+	int err_dac = 0;
+	for (unsigned i = 0; read && !err_dac && i < n_dac; i++)
+		err_dac = ljud_i2c_result(&batch, i_dac[i], NULL, NULL);
+	// Without the device's clock, the writes are as done as we can tell
+	// once run_io returns, which is after their responses if we read them
+	// and after sending otherwise. With it, we know when they ran.
+	uint64_t t_done = t_io + dt_io;
+	if (i_clock >= 0 && !err_fb) {
+		t_done = clock_stamp(data, resp + i_clock,
+			batch.t_tx[i_fb], batch.t_rx[i_fb]
+		);
+		if (n_written) {
+			uint64_t exec = t_done > t_sched ? t_done - t_sched : 0;
+			data->exec_n += 1;
+			data->exec_sum_ns += exec;
+			data->exec_sum_sq_ns += (double)exec * exec;
+			if (exec < data->exec_min_ns) data->exec_min_ns = exec;
+			if (exec > data->exec_max_ns) data->exec_max_ns = exec;
+		}
+	}
+	if (n_written) ljpredict_delay(&data->predict, t_done - t_sched);
+	ljchan_written(&data->chans, due, t_sched);
+	for (size_t i = 0; i < data->chans.n; i++) {
+		uint8_t status = LJMON_WRITTEN;
+		if (data->chans.index[i] >= state->vector->size) {
+			status = LJMON_UNMAPPED;
+		} else if (!due[i]) {
+			status = data->chans.deferred[i]
+				? LJMON_HELD : LJMON_WAITING;
+		} else {
+			ljlog_trace(data->log, "Wrote %G V (code %hu) to %s.",
+				in[i], codes[i],
+				ljchan_output_name(data->chans.output[i])
+			);
+			if (data->n_readback) {
+				readback_written(data, data->chans.output[i],
+					codes[i]
+				);
+			}
 		}
-		log_trace("Wrote %G V to DACB.", state->vector->data[1]);
+		if (data->mon.shm)
+			watch_chan(data, i, status, codes[i], t_done);
+	}
+
+	if (i_cal >= 0) {
+		err = verify_cal(data, &batch, i_cal);
+		if (err) return err;
+	}
+
+	if (err_fb) {
+		ljlog_error(data->log, "unpack_feedback returned %d", err_fb);
+		return give_up(data, state, err_fb);
+	}
+	if (err_spi) {
+		ljlog_error(data->log, "SPI DAC write returned %d", err_spi);
+		return give_up(data, state, err_spi);
+	}
+	if (err_dac) {
+		ljlog_error(data->log, "LJTick DAC write returned %d", err_dac);
+		return give_up(data, state, err_dac);
+	}
+	if (i_count >= 0) {
+		const uint8_t *r = resp + i_count;
+		uint32_t count = r[0] | r[1] << 8 | r[2] << 16
+			| (uint32_t)r[3] << 24;
+		// the edge came in before the packet that saw it went out
+		if (count_edges(data, count)) t_edge = batch.t_tx[i_fb];
 	}
+	if (data->n_inputs) set_inputs(data, state, resp + i_inputs);
+	if (check) check_readback(data, resp + i_readback);
+	if (t_edge) {
+		uint64_t lat = now_ns() - t_edge;
+		data->edge_n += 1;
+		data->edge_lat_sum += lat;
+		if (lat < data->edge_lat_min) data->edge_lat_min = lat;
+		if (lat > data->edge_lat_max) data->edge_lat_max = lat;
+		ljlog_trace(data->log, "Edge to write latency: %lu ns", lat);
+	}
+	publish(data, state, LJMON_OK);
 	return 0;
 }
 
 
-int aylp_ljtdac_u3_fini(struct aylp_device *self)
+int aylp_ljtdac_proc(struct aylp_device *self, struct aylp_state *state)
+{
+	struct aylp_ljtdac_data *data = self->device_data;
+	LJ_PROBE1(proc_entry, state->vector->size);
+	int err = proc_loop(data, state);
+	// let anything we left queued for sharers go out with theirs
+	if (data->member && !data->lost) ljsession_loop_done(data->member);
+	LJ_PROBE1(proc_return, err);
+	return err;
+}
+
+
+int aylp_ljtdac_fini(struct aylp_device *self)
 {
 	int err;
 	struct aylp_ljtdac_data *data = self->device_data;
+	if (data->lost) {
+		atomic_store(&data->reconnect_stop, true);
+		pthread_join(data->reconnect_thread, NULL);
+		if (atomic_load(&data->reconnected)) {
+			data->lost = false;
+		} else {
+			data->downtime_ns += now_ns() - data->t_lost;
+		}
+	}
+	if (data->n_outages) {
+		log_info("Outages: %lu, down for %.3f s in total",
+			data->n_outages, data->downtime_ns * 1e-9
+		);
+	}
+	if (data->outage_proc_n) {
+		log_info("proc during outages over %lu loops: "
+			"mean %lu ns, max %lu ns", data->outage_proc_n,
+			data->outage_proc_sum_ns / data->outage_proc_n,
+			data->outage_proc_max_ns
+		);
+	}
+	if (data->lost) goto done;
+	if (data->n_unread) {
+		err = drain_unread(data);
+		if (err) {
+			log_error("Unread response check returned %d: %s",
+				err, strerror(-err)
+			);
+		}
+	}
+	// Plain fast mode doesn't keep track of the responses it leaves on the
+	// device, so throw them away before reading any of our own. Shutting
+	// down isn't in a hurry, so the writes below wait for theirs.
+	if (data->fast && !data->budget_ns) {
+		err = data->model->resync(data->dev,
+			AYLP_LJTDAC_UNREAD_MAX + LJUD_BATCH_MAX + 1
+		);
+		if (err < 0) {
+			log_error("resync returned %d: %s", err, strerror(-err));
+		}
+	}
 	err = ljtdac_write_dac(
 		data->dev, &data->cal_mem, data->sda_pin, data->scl_pin,
-		data->fast, LJTDAC_WRITE_DACA, 0.0
+		data->speed_adjust, false, LJTDAC_WRITE_DACA, 0.0
 	);
 	if (err) {
 		log_error("ljtdac_write_dac returned %d: %s",
@@ -255,7 +2523,7 @@ int aylp_ljtdac_u3_fini(struct aylp_device *self)
 	}
 	err = ljtdac_write_dac(
 		data->dev, &data->cal_mem, data->sda_pin, data->scl_pin,
-		data->fast, LJTDAC_WRITE_DACB, 0.0
+		data->speed_adjust, false, LJTDAC_WRITE_DACB, 0.0
 	);
 	if (err) {
 		log_error("ljtdac_write_dac returned %d: %s",
@@ -263,7 +2531,113 @@ int aylp_ljtdac_u3_fini(struct aylp_device *self)
 		);
 		log_debug("errno was %d: %s", errno, strerror(errno));
 	}
-	LJUSB_CloseDevice(data->dev);
+	if (data->spidac.n) {
+		err = zero_spidac(data);
+		if (err) {
+			log_error("Zeroing the SPI DAC returned %d: %s",
+				err, strerror(-err)
+			);
+			log_debug("errno was %d: %s", errno, strerror(errno));
+		}
+	}
+	config_digital(data, false, !data->fast);
+	if (data->trigger && data->edge_n) {
+		log_info("Edge to write latency over %lu edges: "
+			"min %lu ns, mean %lu ns, max %lu ns",
+			data->edge_n, data->edge_lat_min,
+			data->edge_lat_sum / data->edge_n, data->edge_lat_max
+		);
+	}
+	if (data->trigger) {
+		log_info("Trigger edges missed: %lu, timeouts: %lu",
+			data->edges_missed, data->edge_timeouts
+		);
+	}
+	if (data->packet_ns) {
+		log_info("I/O time per packet at I2C speed_adjust %hhu: "
+			"%.1f us", data->speed_adjust, data->packet_ns * 1e-3
+		);
+	}
+	if (data->predict.order && data->predict.n_delays) {
+		log_info("Actuation delay: %.1f us",
+			data->predict.delay_ns * 1e-3
+		);
+		for (size_t i = 0; i < data->chans.n; i++) {
+			log_info("Channel %zu (%s) RMS prediction residual: %G",
+				i, ljchan_output_name(data->chans.output[i]),
+				ljpredict_rms(&data->predict, i)
+			);
+		}
+	}
+	for (uint8_t i = 0; i < data->n_readback; i++) {
+		struct aylp_ljtdac_readback *rb = &data->readback[i];
+		log_info("%s readback on AIN%hhu: %lu checks, max error %G V, "
+			"drift %lu, stuck %lu, wiring %lu, out of range %lu",
+			ljchan_output_name(rb->dac), rb->ain, rb->n_checks,
+			rb->max_err, rb->n_drift, rb->n_stuck, rb->n_wiring,
+			rb->n_skipped
+		);
+	}
+	if (data->budget_ns && data->n_loops) {
+		log_info("Verified %lu of %lu loops (%.1f%%), "
+			"switched modes %lu times",
+			data->n_verified, data->n_loops,
+			100.0 * data->n_verified / data->n_loops,
+			data->n_switches
+		);
+	}
+	if (data->chans.n_deferred) {
+		log_info("Channel writes held back for the budget: %lu",
+			data->chans.n_deferred
+		);
+	}
+	if (data->n_retries || data->n_resyncs || data->n_deadline_misses
+		|| data->n_given_up
+	) {
+		log_info("Retries: %lu, resyncs: %lu, deadline misses: %lu, "
+			"loops given up on: %lu",
+			data->n_retries, data->n_resyncs,
+			data->n_deadline_misses, data->n_given_up
+		);
+	}
+	if (data->exec_n) {
+		double mean = data->exec_sum_ns / data->exec_n;
+		double var = data->exec_sum_sq_ns / data->exec_n - mean * mean;
+		log_info("Setpoints to execution on the device: mean %.1f us, "
+			"jitter %.1f us, min %.1f us, max %.1f us",
+			mean / 1e3, (var > 0 ? sqrt(var) : 0.0) / 1e3,
+			data->exec_min_ns / 1e3, data->exec_max_ns / 1e3
+		);
+		log_info("Device clock drift %+.2f ppm, fit RMS %.1f us",
+			ljclock_drift_ppm(&data->clk),
+			ljclock_rms_ns(&data->clk) / 1e3
+		);
+	}
+	if (data->member) {
+		struct ljsession_stats st;
+		ljsession_stats(data->member, &st);
+		log_info("Sharing the %s: %lu packets from all instances went "
+			"out as %lu in %lu round trips, %lu responses unread",
+			data->model->name, st.n_member_packets,
+			st.n_device_packets, st.n_flushes, st.n_dropped
+		);
+	}
+	if (data->transport == AYLP_LJTDAC_REPLAY) {
+		log_info("Writes that differed from the trace: %lu",
+			ljtrace_mismatches(data->dev)
+		);
+	}
+	check_recording(data);
+	ljud_close(data->dev);
+done:
+	if (data->disc) ljdisc_put();
+	ljmon_destroy(&data->mon);
+	if (data->out) gsl_vector_free(data->out);
+	free(data->cache_dir);
+	free(data->broker_name);
+	free(data->replay_path);
+	free(data->record_path);
+	ljlog_close(data->log);
 	xfree(data);
 	return 0;
 }
@@ -1,12 +1,55 @@
 #ifndef AYLP_LJTDAC_H_
 #define AYLP_LJTDAC_H_
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <libaylp/anyloop.h>
 
 
+// how we reach the device
+enum {
+	AYLP_LJTDAC_USB,
+	AYLP_LJTDAC_SIM,	// simulated device, no hardware needed
+	AYLP_LJTDAC_BROKER,	// a device shared through aylp_ljbroker
+	AYLP_LJTDAC_REPLAY,	// a recorded trace played back
+};
+
+// what to do with a loop whose I/O failed for good
+enum {
+	AYLP_LJTDAC_FAIL,	// return the error, stopping the pipeline
+	AYLP_LJTDAC_HOLD,	// carry on, inputs holding their last readings
+	AYLP_LJTDAC_SKIP,	// carry on, inputs reading as NAN
+};
+
+// how the SPI DAC's channel writes are framed
+enum {
+	AYLP_LJTDAC_SPI_PACKED,	// a loop's writes share one transfer
+	AYLP_LJTDAC_SPI_EACH,	// a transfer (and CS pulse) per write
+	AYLP_LJTDAC_SPI_CHAIN,	// every channel in every transfer, for chains
+};
+
+// most responses we leave unread on the device before collecting them
+#define AYLP_LJTDAC_UNREAD_MAX 32
+
+// how hard the I2C autotune tries each speed, and how many speed steps it
+// backs off from the fastest one that works
+#define AYLP_LJTDAC_TUNE_TRIALS 8
+#define AYLP_LJTDAC_TUNE_MARGIN 1
+
 struct aylp_ljtdac_data {
-	HANDLE dev;
+	const struct ljmodel *model;	// which LabJack, from the host param
+	struct ljud_dev *dev;
+	uint8_t transport;
+	uint32_t serial;	// which device to open over USB, 0 for any
+	bool disc;		// holding a reference to the ljdisc map
+	bool share;		// share the device with other instances
+	struct ljud_dev *member;	// our ljsession membership, if sharing
+	bool sim_latency;	// give the simulated device the model's latency
+	char *broker_name;	// shared memory name for AYLP_LJTDAC_BROKER
+	char *replay_path;	// trace to play back for AYLP_LJTDAC_REPLAY
+	double replay_scale;	// timing scale for playback, 0 for none
+	char *record_path;	// trace to record traffic to, if any
 	struct ljtdac_cal_mem cal_mem;
 	unsigned long square_hz;
 	bool fast;
@@ -16,16 +59,161 @@ struct aylp_ljtdac_data {
 	uint8_t square_pin;	// pin to write square wave on
 	uint8_t sda_pin;	// sda for ljtick i2c
 	uint8_t scl_pin;	// scl for ljtick i2c
+	uint8_t speed_adjust;	// ljtick i2c clock, 0 fastest to 255 slowest
+	bool speed_auto;	// autotune speed_adjust on connecting
+
+	// timers and counters sit on consecutive pins from timer_offset,
+	// timers first, then counters
+	uint8_t timer_offset;
+	uint8_t n_timers;
+	uint8_t timer_modes[2];
+	uint16_t timer_values[2];
+	double timer_hz;	// timer clock, for converting periods
+
+	// timer inputs read back in the same transaction as the DAC writes
+	uint8_t n_inputs;
+	struct {
+		uint8_t mode;	// an lju3_timer_mode
+		uint8_t timer;
+	} inputs[2];
+	gsl_vector *out;	// setpoints followed by inputs
+
+	// PWM timer outputs, whose duty cycles follow the DAC voltages in the
+	// state vector
+	uint8_t n_pwm;
+	struct {
+		uint8_t mode;	// an lju3_timer_mode
+		uint8_t timer;
+	} pwm[2];
+
+	// adaptive verification: read responses back when the latency budget
+	// allows, and skip reading them when it doesn't
+	uint64_t budget_ns;	// 0 if adaptive verification is off
+	double verify_min;	// least fraction of loops to verify anyway
+	double verify_credit;	// verify once this reaches 1
+	bool verifying;		// whether we're reading back every loop
+	double verified_ns;	// moving average of verified I/O time
+	uint8_t n_unread;	// responses left on the device for later
+	uint8_t unread_rx[AYLP_LJTDAC_UNREAD_MAX];	// and their lengths
+	uint64_t n_loops;
+	uint64_t n_verified;
+	uint64_t n_switches;
+
+	// error recovery
+	unsigned retries;	// most times to retry a loop's I/O
+	uint64_t deadline_ns;	// no retries after this long into a loop
+	uint8_t on_miss;	// AYLP_LJTDAC_FAIL, _HOLD, or _SKIP
+	uint64_t n_retries;
+	uint64_t n_resyncs;
+	uint64_t n_deadline_misses;
+	uint64_t n_given_up;
+	bool desynced;		// a resync is owed before the next I/O
+
+	// background reconnection after the device drops off
+	bool reconnect;		// whether to try
+	unsigned long reconnect_ms;	// between attempts
+	bool lost;		// device is gone, and proc is running degraded
+	bool resync_failed;	// last resync got nothing back
+	pthread_t reconnect_thread;
+	atomic_bool reconnected;	// thread has the device ready
+	atomic_bool reconnect_stop;	// fini wants the thread to give up
+	uint64_t t_lost;
+	uint64_t n_outages;
+	uint64_t downtime_ns;
+	uint64_t outage_proc_n;
+	uint64_t outage_proc_sum_ns;
+	uint64_t outage_proc_max_ns;
+
+	// disk cache of calibration and config, keyed by serial_number
+	char *cache_dir;	// NULL if caching is off
+	uint32_t serial_number;	// of the device
+	uint8_t timer_counter_config;	// what we want ConfigIO to hold
+	bool configured;	// device already held our config at startup
+	bool cal_cached;	// cal_mem came from the cache
+	bool cal_unverified;	// cal_mem still needs checking against the LJTick
+
+	// checking the DAC outputs on the analog inputs they're wired back to
+	uint8_t n_readback;	// 0 if off
+	struct aylp_ljtdac_readback {
+		uint8_t dac;		// LJCHAN_DACA or LJCHAN_DACB
+		uint8_t ain;		// U3 AIN it's wired to
+		double slope;		// AIN calibration, raw to volts
+		double offset;
+		double want;		// volts last commanded, NAN if unknown
+		double last_want;	// and as of the last check
+		double last_got;	// what the last check read
+		uint64_t n_checks;
+		uint64_t n_drift;	// off by more than the tolerance
+		uint64_t n_stuck;	// didn't follow a change of command
+		uint64_t n_wiring;	// pinned at the end of the AIN's range
+		uint64_t n_skipped;	// commanded past what the AIN can see
+		double max_err;
+	} readback[2];
+	bool readback_hv;	// the U3 is a U3-HV
+	unsigned long readback_every;	// loops between checks
+	unsigned long readback_count;	// loops since the last one
+	double readback_divider;	// AIN volts per DAC volt
+	double readback_tolerance;	// in DAC volts
+	uint16_t analog_mask;	// FIO and EIO pins ConfigIO leaves analog
+
+	// a DAC on the SPI bus, whose channels are the SPI0 and on outputs
+	struct ljspi_dac spidac;	// spidac.n is 0 if there isn't one
+	uint8_t spidac_transfer;	// an AYLP_LJTDAC_SPI_ framing
+	uint16_t spidac_code[LJSPI_DAC_MAX];	// last written, for chains
+	uint8_t n_spidac_setup;	// words sent on connecting
+	uint32_t spidac_setup[LJSPI_DAC_MAX];
+
+	// which state vector element goes to which output, and how
+	json_object *channels;	// the channels param, if any
+	struct ljchan_map chans;
+	uint32_t dio_mask;	// pins driven by digital output channels
+	double packet_ns;	// moving average of round trip time per packet
+
+	// extrapolating setpoints over the actuation delay
+	struct ljpredict predict;	// predict.order is 0 if off
+
+	// correlating the device's system timer with our clock, to tell when
+	// each loop's writes actually ran
+	bool clock;		// whether to
+	uint8_t clock_timer;	// timer reading the system timer
+	struct ljclock clk;
+	uint64_t exec_n;	// setpoints to execution, over loops that wrote
+	double exec_sum_ns;
+	double exec_sum_sq_ns;
+	uint64_t exec_min_ns;
+	uint64_t exec_max_ns;
+
+	// what we've applied, published for monitors like aylp_ljmon
+	struct ljmon mon;	// mon.shm is NULL if publishing is off
+
+	// where proc logs to, NULL if that has to be synchronous
+	struct ljlog *log;
+	struct ljmon_snapshot mon_snap;
+
+	// external trigger on a hardware counter
+	bool trigger;		// whether a trigger counter is enabled
+	bool trigger_wait;	// block in proc until the next edge
+	uint8_t trigger_counter;	// 0 or 1
+	uint8_t trigger_pin;	// pin the counter lands on
+	unsigned long trigger_timeout_ms;
+	uint32_t trigger_count;	// last count we saw
+	// edge-to-write latency statistics, in ns
+	uint64_t edge_n;
+	uint64_t edge_lat_min;
+	uint64_t edge_lat_max;
+	uint64_t edge_lat_sum;
+	uint64_t edges_missed;
+	uint64_t edge_timeouts;
 };
 
 // initialize device
 int aylp_ljtdac_init(struct aylp_device *self);
 
 // process device once per loop
-int aylp_ljtdac_u3_proc(struct aylp_device *self, struct aylp_state *state);
+int aylp_ljtdac_proc(struct aylp_device *self, struct aylp_state *state);
 
 // close device when loop exits
-int aylp_ljtdac_u3_fini(struct aylp_device *self);
+int aylp_ljtdac_fini(struct aylp_device *self);
 
 #endif
 
@@ -1,11 +1,14 @@
 #include <errno.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "labjack_u3.h"
 
 
-int lju3_config_timer_clock(HANDLE dev,
+int lju3_config_timer_clock(struct ljud_dev *dev,
 	struct lju3_config_timer_clock *config,
 	struct lju3_config_timer_clock_resp *config_resp
 ) {
@@ -25,10 +28,10 @@ int lju3_config_timer_clock(HANDLE dev,
 		(uint8_t *)config + 1, n_head - 1
 	);
 
-	n = LJUSB_Write(dev, (uint8_t *)config, n_tx);
+	n = ljud_write(dev, (uint8_t *)config, n_tx);
 	if (n < n_tx) return -ECOMM;
 
-	n = LJUSB_Read(dev, (uint8_t *)config_resp, n_rx);
+	n = ljud_read(dev, (uint8_t *)config_resp, n_rx);
 	if (n < n_rx) {
 		// LJ is telling us we have a bad checksum
 		if (*(uint16_t *)config_resp == 0xB8B8) return -EBADMSG;
@@ -49,7 +52,7 @@ int lju3_config_timer_clock(HANDLE dev,
 }
 
 
-int lju3_config_io(HANDLE dev,
+int lju3_config_io(struct ljud_dev *dev,
 	struct lju3_config_io *config, struct lju3_config_io_resp *config_resp
 ) {
 	unsigned long n;
@@ -68,10 +71,10 @@ int lju3_config_io(HANDLE dev,
 		(uint8_t *)config + 1, n_head - 1
 	);
 
-	n = LJUSB_Write(dev, (uint8_t *)config, n_tx);
+	n = ljud_write(dev, (uint8_t *)config, n_tx);
 	if (n < n_tx) return -ECOMM;
 
-	n = LJUSB_Read(dev, (uint8_t *)config_resp, n_rx);
+	n = ljud_read(dev, (uint8_t *)config_resp, n_rx);
 	if (n < n_rx) {
 		// LJ is telling us we have a bad checksum
 		if (*(uint16_t *)config_resp == 0xB8B8) return -EBADMSG;
@@ -90,7 +93,7 @@ int lju3_config_io(HANDLE dev,
 }
 
 
-int lju3_feedback_timer_config(HANDLE dev,
+int lju3_feedback_timer_config(struct ljud_dev *dev,
 	struct lju3_feedback_timer_config *config,
 	struct lju3_feedback_resp_header *config_resp
 ) {
@@ -113,10 +116,10 @@ int lju3_feedback_timer_config(HANDLE dev,
 		(uint8_t *)config + 1, n_head - 1
 	);
 
-	n = LJUSB_Write(dev, (uint8_t *)config, n_tx);
+	n = ljud_write(dev, (uint8_t *)config, n_tx);
 	if (n < n_tx) return -ECOMM;
 
-	n = LJUSB_Read(dev, (uint8_t *)config_resp, n_rx);
+	n = ljud_read(dev, (uint8_t *)config_resp, n_rx);
 	if (n < n_rx) {
 		// LJ is telling us we have a bad checksum
 		if (*(uint16_t *)config_resp == 0xB8B8) return -EBADMSG;
@@ -137,20 +140,467 @@ int lju3_feedback_timer_config(HANDLE dev,
 }
 
 
-int lju3_read_cal_mem(HANDLE dev, struct lju3_cal_mem *cal_mem)
+int lju3_iotype_len(lju3_io_type io_type, unsigned *n_cmd, unsigned *n_resp)
 {
+	switch (io_type) {
+	case AIN:		*n_cmd = 3; *n_resp = 2; break;
+	case WAIT_SHORT:
+	case WAIT_LONG:
+	case LED:		*n_cmd = 2; *n_resp = 0; break;
+	case BIT_STATE_READ:
+	case BIT_DIR_READ:	*n_cmd = 2; *n_resp = 1; break;
+	case BIT_STATE_WRITE:
+	case BIT_DIR_WRITE:	*n_cmd = 2; *n_resp = 0; break;
+	case PORT_STATE_READ:
+	case PORT_DIR_READ:	*n_cmd = 1; *n_resp = 3; break;
+	case PORT_STATE_WRITE:
+	case PORT_DIR_WRITE:	*n_cmd = 7; *n_resp = 0; break;
+	case DAC0_8:
+	case DAC1_8:		*n_cmd = 2; *n_resp = 0; break;
+	case DAC0_16:
+	case DAC1_16:		*n_cmd = 3; *n_resp = 0; break;
+	case TIMER0:
+	case TIMER1:
+	case TIMER2:
+	case TIMER3:		*n_cmd = 4; *n_resp = 4; break;
+	case TIMER0_CONFIG:
+	case TIMER1_CONFIG:
+	case TIMER2_CONFIG:
+	case TIMER3_CONFIG:	*n_cmd = 4; *n_resp = 0; break;
+	case COUNTER0:
+	case COUNTER1:		*n_cmd = 2; *n_resp = 4; break;
+	case BUZZER:		*n_cmd = 6; *n_resp = 0; break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+
+unsigned lju3_resp_len(const uint8_t *tx, unsigned n_tx)
+{
+	if (n_tx < 2) return 0;
+	// normal commands that we don't use
+	if (tx[1] != 0xF8) return 0;
+	if (n_tx < sizeof(struct ljud_extended_header)) return 0;
+	switch (tx[3]) {
+	case 0x00: {
+		// Feedback: add up the IOTypes, stopping at the padding
+		unsigned n_resp = 0;
+		unsigned i = sizeof(struct lju3_feedback_header);
+		while (i < n_tx) {
+			unsigned n_c, n_r;
+			if (lju3_iotype_len(tx[i], &n_c, &n_r)) break;
+			n_resp += n_r;
+			i += n_c;
+		}
+		return lju3_feedback_resp_len(n_resp);
+	}
+	case 0x08:
+		return sizeof(struct lju3_config_resp);
+	case 0x0A:
+		return sizeof(struct lju3_config_timer_clock_resp);
+	case 0x0B:
+		return sizeof(struct lju3_config_io_resp);
+	case 0x2D:
+		return sizeof(struct lju3_readmem_resp);
+	case 0x3A:
+		// SPI: header, then as many bytes as we sent
+		if (n_tx < sizeof(struct ljud_spi_header)) return 0;
+		return (
+			sizeof(struct ljud_spi_resp_header)
+			+ ((struct ljud_spi_header *)tx)->n_spi_bytes + 1
+		) & ~1U;
+	case 0x3B:
+		// I2C: header, then however many bytes we asked for
+		if (n_tx < sizeof(struct ljud_i2c_header)) return 0;
+		return LJUD_I2C_RX(
+			((struct ljud_i2c_header *)tx)->n_i2c_bytes_rx
+		);
+	default:
+		return 0;
+	}
+}
+
+
+unsigned lju3_pack_feedback(uint8_t *tx, const uint8_t *cmd, unsigned n_cmd)
+{
+	const unsigned n_head = sizeof(struct ljud_extended_header);
+	// command packets are a multiple of words long, so round up
+	const unsigned n_tx = (
+		sizeof(struct lju3_feedback_header) + n_cmd + 1
+	) & ~1U;
+	struct lju3_feedback_header *head = (struct lju3_feedback_header *)tx;
+
+	memset(tx, 0, n_tx);
+	memcpy(tx + sizeof(struct lju3_feedback_header), cmd, n_cmd);
+
+	head->echo = 0xAA;	// arbitrary
+	head->header.command = 0xF8;
+	head->header.n_data_words = (n_tx - n_head) / 2;
+	head->header.extended_command = 0x00;
+	head->header.checksum16 = ljud_checksum16(tx + 6, n_tx - 6);
+	head->header.checksum8 = ljud_checksum8(tx + 1, n_head - 1);
+	return n_tx;
+}
+
+
+unsigned lju3_feedback_resp_len(unsigned n_resp)
+{
+	// response data starts after the header proper, not after the padding
+	return (offsetof(struct lju3_feedback_resp_header, _padding)
+		+ n_resp + 1) & ~1U;
+}
+
+
+int lju3_unpack_feedback(const uint8_t *rx, uint8_t *resp, unsigned n_resp)
+{
+	const struct lju3_feedback_resp_header *resp_head = (
+		(const struct lju3_feedback_resp_header *)rx
+	);
+	if (resp_head->echo != 0xAA) return -EBADE;
+	if (resp_head->err) return resp_head->err;
+	memcpy(resp,
+		rx + offsetof(struct lju3_feedback_resp_header, _padding),
+		n_resp
+	);
+	return 0;
+}
+
+
+bool lju3_parse_feedback(const uint8_t *tx, unsigned n_tx,
+	unsigned *n_cmd, unsigned *n_resp, unsigned *n_frames
+) {
+	const unsigned n_head = sizeof(struct ljud_extended_header);
+	const struct ljud_extended_header *head = (const void *)tx;
+	if (n_tx < sizeof(struct lju3_feedback_header)) return false;
+	if (head->command != 0xF8 || head->extended_command != 0x00)
+		return false;
+	if (head->n_data_words * 2U + 6 != n_tx) return false;
+	if (head->checksum8 != ljud_checksum8((uint8_t *)tx + 1, n_head - 1))
+		return false;
+	if (head->checksum16 != ljud_checksum16((uint8_t *)tx + 6, n_tx - 6))
+		return false;
+	*n_cmd = *n_resp = *n_frames = 0;
+	unsigned i = sizeof(struct lju3_feedback_header);
+	while (i < n_tx) {
+		unsigned n_c, n_r;
+		// a trailing zero is padding to a whole word
+		if (tx[i] == 0 && i == n_tx - 1) break;
+		if (lju3_iotype_len(tx[i], &n_c, &n_r)) return false;
+		if (i + n_c > n_tx) return false;
+		i += n_c;
+		*n_cmd += n_c;
+		*n_resp += n_r;
+		*n_frames += 1;
+	}
+	return true;
+}
+
+
+unsigned lju3_split_feedback(uint8_t *out, const uint8_t *rx, uint8_t echo,
+	unsigned frame, unsigned n_frames, unsigned resp, unsigned n_resp
+) {
+	const unsigned d = offsetof(struct lju3_feedback_resp_header, _padding);
+	const struct lju3_feedback_resp_header *dh = (const void *)rx;
+	struct lju3_feedback_resp_header *h = (void *)out;
+	unsigned n = lju3_feedback_resp_len(n_resp);
+	memset(out, 0, n);
+	h->err = 0;
+	h->error_frame = 0;
+	if (dh->err) {
+		unsigned f = dh->error_frame;
+		if (f >= frame + n_frames) {
+			// went wrong after our commands ran
+		} else if (f >= frame) {
+			h->err = dh->err;
+			h->error_frame = f - frame;
+		} else {
+			// went wrong before ours ran at all
+			h->err = dh->err;
+		}
+	}
+	h->echo = echo;
+	memcpy(out + d, rx + d + resp, n_resp);
+	h->header.command = 0xF8;
+	h->header.n_data_words = (n - 6) / 2;
+	h->header.extended_command = 0x00;
+	h->header.checksum16 = ljud_checksum16(out + 6, n - 6);
+	h->header.checksum8 = ljud_checksum8(
+		out + 1, sizeof(struct ljud_extended_header) - 1
+	);
+	return n;
+}
+
+
+void lju3_merge_reset(struct lju3_merge *m)
+{
+	m->n_jobs = 0;
+	m->n_outs = 0;
+	m->n_sent = 0;
+}
+
+
+int lju3_merge_add(struct lju3_merge *m, const uint8_t *tx, unsigned n_tx,
+	unsigned after, bool merge
+) {
+	if (m->n_jobs >= LJU3_MERGE_JOBS) return -ENOBUFS;
+	unsigned n_cmd, n_resp, n_frames;
+	bool fb = merge && lju3_parse_feedback(tx, n_tx,
+		&n_cmd, &n_resp, &n_frames
+	);
+	unsigned o = m->n_outs;
+	if (fb) for (o = after; o < m->n_outs; o++) {
+		if (!m->outs[o].feedback) continue;
+		if (m->outs[o].n_cmd + n_cmd > LJU3_FEEDBACK_MAX_CMD) continue;
+		if (m->outs[o].n_resp + n_resp > LJU3_FEEDBACK_MAX_RESP)
+			continue;
+		break;
+	}
+	if (o == m->n_outs) {
+		if (m->n_outs >= LJU3_MERGE_BATCH) return -ENOBUFS;
+		m->n_outs += 1;
+		m->outs[o].feedback = fb;
+		m->outs[o].n_cmd = m->outs[o].n_resp = 0;
+		m->outs[o].n_frames = 0;
+		if (!fb) {
+			memcpy(m->outs[o].tx, tx, n_tx);
+			m->outs[o].n_tx = n_tx;
+			m->outs[o].n_rx = merge ? lju3_resp_len(tx, n_tx) : 0;
+			// we don't know, so take whatever comes
+			if (!m->outs[o].n_rx) m->outs[o].n_rx = LJUD_PACKET_MAX;
+		}
+	}
+	unsigned j = m->n_jobs++;
+	m->jobs[j].out = o;
+	m->jobs[j].merged = fb;
+	if (fb) {
+		m->jobs[j].echo = tx[6];
+		m->jobs[j].frame = m->outs[o].n_frames;
+		m->jobs[j].n_frames = n_frames;
+		m->jobs[j].resp = m->outs[o].n_resp;
+		m->jobs[j].n_resp = n_resp;
+		memcpy(m->outs[o].cmd + m->outs[o].n_cmd,
+			tx + sizeof(struct lju3_feedback_header), n_cmd
+		);
+		m->outs[o].n_cmd += n_cmd;
+		m->outs[o].n_resp += n_resp;
+		m->outs[o].n_frames += n_frames;
+	}
+	return o;
+}
+
+
+int lju3_merge_run(struct lju3_merge *m, struct ljud_dev *dev)
+{
+	int err = 0;
+	for (unsigned o = 0; o < m->n_outs; o++) {
+		if (!m->outs[o].feedback) continue;
+		m->outs[o].n_tx = lju3_pack_feedback(
+			m->outs[o].tx, m->outs[o].cmd, m->outs[o].n_cmd
+		);
+		m->outs[o].n_rx = lju3_feedback_resp_len(m->outs[o].n_resp);
+	}
+	for (m->n_sent = 0; m->n_sent < m->n_outs; m->n_sent++) {
+		unsigned o = m->n_sent;
+		m->outs[o].n = 0;
+		if (ljud_write(dev, m->outs[o].tx, m->outs[o].n_tx)
+			< m->outs[o].n_tx
+		) {
+			err = -ECOMM;
+			break;
+		}
+	}
+	for (unsigned o = 0; o < m->n_sent; o++) {
+		m->outs[o].n = ljud_read(dev, m->outs[o].rx, m->outs[o].n_rx);
+	}
+	return err;
+}
+
+
+int lju3_merge_result(const struct lju3_merge *m, unsigned j, uint8_t *out)
+{
+	unsigned o = m->jobs[j].out;
+	if (o >= m->n_sent) return -ECOMM;
+	const uint8_t *rx = m->outs[o].rx;
+	unsigned long n = m->outs[o].n;
+	if (!m->jobs[j].merged) {
+		memcpy(out, rx, n);
+		return n;
+	}
+	if (n < m->outs[o].n_rx) {
+		// pass a bad checksum response along, but nothing else
+		if (n >= 2 && *(uint16_t *)rx == LJ_BAD_CHECKSUM) {
+			memcpy(out, rx, 2);
+			return 2;
+		}
+		return 0;
+	}
+	// cut our frames and response data out of the shared packet, and
+	// rebuild the header around them
+	return lju3_split_feedback(out, rx, m->jobs[j].echo,
+		m->jobs[j].frame, m->jobs[j].n_frames,
+		m->jobs[j].resp, m->jobs[j].n_resp
+	);
+}
+
+
+int lju3_feedback(struct ljud_dev *dev,
+	const uint8_t *cmd, unsigned n_cmd, uint8_t *resp, unsigned n_resp
+) {
 	unsigned long n;
-	struct lju3_readmem tx;
-	struct lju3_readmem_resp *rx;
-	const unsigned n_tx = sizeof(struct lju3_config);
-	const unsigned n_rx = sizeof(struct lju3_config_resp);
+	if (n_cmd > LJU3_FEEDBACK_MAX_CMD || n_resp > LJU3_FEEDBACK_MAX_RESP)
+		return -EMSGSIZE;
+	const unsigned n_rx = lju3_feedback_resp_len(n_resp);
+	uint8_t tx[LJUD_PACKET_MAX];
+	uint8_t rx[LJUD_PACKET_MAX];
+	const unsigned n_tx = lju3_pack_feedback(tx, cmd, n_cmd);
+
+	n = ljud_write(dev, tx, n_tx);
+	if (n < n_tx) return -ECOMM;
+
+	n = ljud_read(dev, rx, n_rx);
+	if (n < n_rx) {
+		// LJ is telling us we have a bad checksum
+		if (*(uint16_t *)rx == LJ_BAD_CHECKSUM) return -EBADMSG;
+		return -EREMOTEIO;
+	}
+
+	if (
+		((struct ljud_extended_header *)rx)->checksum16
+		!= ljud_checksum16(rx + 6, n_rx - 6)
+	) {
+		// LJ checksum failed
+		return -EBADE;
+	}
+
+	return lju3_unpack_feedback(rx, resp, n_resp);
+}
+
+
+int lju3_read_counter(struct ljud_dev *dev, unsigned counter, bool reset,
+	uint32_t *count
+) {
+	int err;
+	if (counter > 1) return -EINVAL;
+	uint8_t cmd[2] = {COUNTER0 + counter, reset};
+	uint8_t resp[4];
+	err = lju3_feedback(dev, cmd, sizeof(cmd), resp, sizeof(resp));
+	if (err) return err;
+	*count = (
+		(uint32_t)resp[0] | (uint32_t)resp[1] << 8
+		| (uint32_t)resp[2] << 16 | (uint32_t)resp[3] << 24
+	);
+	return 0;
+}
+
+
+int lju3_resync(struct ljud_dev *dev, unsigned max_reads)
+{
+	// anything but the echo every other Feedback command uses, and
+	// different from the last resync's, in case its response is still
+	// on the way
+	uint8_t echo = dev->resync_echo + 1;
+	if (echo == 0xAA) ++echo;
+	dev->resync_echo = echo;
+	const uint8_t cmd[2] = {WAIT_SHORT, 0};
+	uint8_t tx[LJUD_PACKET_MAX];
+	uint8_t rx[LJUD_PACKET_MAX];
+	const unsigned n_tx = lju3_pack_feedback(tx, cmd, sizeof(cmd));
+	const unsigned n_rx = lju3_feedback_resp_len(0);
+	struct lju3_feedback_header *head = (struct lju3_feedback_header *)tx;
+	head->echo = echo;
+	head->header.checksum16 = ljud_checksum16(tx + 6, n_tx - 6);
+	head->header.checksum8 = ljud_checksum8(tx + 1,
+		sizeof(struct ljud_extended_header) - 1
+	);
+
+	unsigned long n = ljud_write(dev, tx, n_tx);
+	if (n < n_tx) return -ECOMM;
+
+	for (unsigned i = 0; i < max_reads; i++) {
+		// ask for a whole packet, since we don't know what's coming
+		n = ljud_read(dev, rx, LJUD_PACKET_MAX);
+		if (!n) return -ETIMEDOUT;
+		const struct lju3_feedback_resp_header *resp = (
+			(const struct lju3_feedback_resp_header *)rx
+		);
+		if (n == n_rx && resp->header.extended_command == 0x00
+			&& resp->echo == echo
+			&& resp->header.checksum16
+				== ljud_checksum16(rx + 6, n_rx - 6)
+		) {
+			return i;
+		}
+	}
+	return -EPROTO;
+}
+
+
+int lju3_pin_from_name(const char *name)
+{
+	int base;
+	if (!strncasecmp(name, "FIO", 3)) base = LJU3_FIO0;
+	else if (!strncasecmp(name, "EIO", 3)) base = LJU3_EIO0;
+	else if (!strncasecmp(name, "CIO", 3)) base = LJU3_CIO0;
+	else return -EINVAL;
+	if (name[3] < '0' || name[3] > '7' || name[4]) return -EINVAL;
+	return base + name[3] - '0';
+}
+
+
+int lju3_ain_from_name(const char *name)
+{
+	if (strncasecmp(name, "AIN", 3)) return -EINVAL;
+	char *end;
+	unsigned long ain = strtoul(name + 3, &end, 10);
+	if (end == name + 3 || *end || ain > 15) return -EINVAL;
+	return ain;
+}
+
+
+void lju3_ain_cal(const struct lju3_cal_mem *cal_mem, bool hv, unsigned ain,
+	double *slope, double *offset
+) {
+	if (!hv || ain >= 4) {
+		*slope = fp642dbl(cal_mem->block0.lv_ain_se_slope);
+		*offset = fp642dbl(cal_mem->block0.lv_ain_se_offset);
+		return;
+	}
+	const fp64 hv_slope[4] = {
+		cal_mem->block3.hv_ain0_slope, cal_mem->block3.hv_ain1_slope,
+		cal_mem->block3.hv_ain2_slope, cal_mem->block3.hv_ain3_slope,
+	};
+	const fp64 hv_offset[4] = {
+		cal_mem->block4.hv_ain0_offset, cal_mem->block4.hv_ain1_offset,
+		cal_mem->block4.hv_ain2_offset, cal_mem->block4.hv_ain3_offset,
+	};
+	*slope = fp642dbl(hv_slope[ain]);
+	*offset = fp642dbl(hv_offset[ain]);
+}
+
+
+int lju3_read_cal_mem(struct ljud_dev *dev, struct lju3_cal_mem *cal_mem)
+{
+	unsigned long n;
+	struct lju3_readmem tx = {0};
+	uint8_t rx[sizeof(struct lju3_readmem_resp)];
+	const struct lju3_readmem_resp *resp = (
+		(const struct lju3_readmem_resp *)rx
+	);
+	const unsigned n_tx = sizeof(struct lju3_readmem);
+	const unsigned n_rx = sizeof(struct lju3_readmem_resp);
 	const unsigned n_head = sizeof(struct ljud_extended_header);
+	const unsigned n_block = sizeof(resp->data);
+	static_assert(sizeof(struct lju3_cal_mem) == 5 * sizeof(resp->data),
+		"bad lju3_cal_mem"
+	);
 
 	tx.header.command = 0xF8;
-	tx.header.n_data_words = 1;
+	tx.header.n_data_words = (n_tx - n_head) / 2;
 	tx.header.extended_command = 0x2D;
 
-	for (unsigned i = 0; i <= 4; i++) {
+	for (unsigned i = 0; i < sizeof(struct lju3_cal_mem) / n_block; i++) {
 		tx.block_num = i;
 		tx.header.checksum16 = ljud_checksum16(
 			(uint8_t *)&tx + 6, n_tx - 6
@@ -159,34 +609,21 @@ int lju3_read_cal_mem(HANDLE dev, struct lju3_cal_mem *cal_mem)
 			(uint8_t *)&tx + 1, n_head - 1
 		);
 
-		n = LJUSB_Write(dev, (void *)&tx, n_tx);
+		n = ljud_write(dev, (uint8_t *)&tx, n_tx);
 		if (n < n_tx) return -ECOMM;
 
-		n = LJUSB_Read(dev, (void *)&rx, n_rx);
-		if (n < n_rx) {
-			// LJ is telling us we have a bad checksum
-			if (*(uint16_t *)rx == 0xB8B8) return -EBADMSG;
-			return -EREMOTEIO;
-		}
-
-		if (
-			rx->header.checksum16
-			!= ljud_checksum16((uint8_t *)rx + 6, n_rx - 6)
-		) {
-			return -EBADE;
-		}
+		int err = ljud_read_resp(dev, rx, n_rx);
+		if (err) return err;
+		if (resp->err) return resp->err;
 
-		memcpy(
-			(uint8_t *)cal_mem + sizeof(cal_mem->block0),
-			rx, sizeof(cal_mem->block0)
-		);
+		memcpy((uint8_t *)cal_mem + i * n_block, resp->data, n_block);
 	}
 
 	return 0;
 }
 
 
-int lju3_read_config(HANDLE dev, struct lju3_config_resp *config_resp)
+int lju3_read_config(struct ljud_dev *dev, struct lju3_config_resp *config_resp)
 {
 	unsigned long n;
 	uint8_t tx[sizeof(struct lju3_config)] = {0};
@@ -205,10 +642,10 @@ int lju3_read_config(HANDLE dev, struct lju3_config_resp *config_resp)
 	t->header.checksum16 = ljud_checksum16(tx + 6, sizeof(tx) - 6);
 	t->header.checksum8 = ljud_checksum8(tx + 1, sizeof(tx) - 1);
 
-	n = LJUSB_Write(dev, tx, sizeof(tx));
+	n = ljud_write(dev, tx, sizeof(tx));
 	if (n < sizeof(tx)) return -ECOMM;
 
-	n = LJUSB_Read(dev, rx, sizeof(rx));
+	n = ljud_read(dev, rx, sizeof(rx));
 	if (n < sizeof(rx)) return -EREMOTEIO;
 
 	if (
@@ -223,8 +660,10 @@ int lju3_read_config(HANDLE dev, struct lju3_config_resp *config_resp)
 }
 
 
-int lju3_square(
-	HANDLE dev, ljud_pin pin, unsigned long hz_req, double *hz_real
+int lju3_config_timers(struct ljud_dev *dev,
+	lju3_clock_config clock_config, uint8_t clock_divisor,
+	ljud_pin offset, lju3_timer_counter_config counters,
+	unsigned n_timers, const lju3_timer_mode *modes, const uint16_t *values
 ) {
 	int err;
 
@@ -234,13 +673,42 @@ int lju3_square(
 	// this involves communicating the following structs:
 	// config_timer_clock: base, divisor
 	// config_io.timer_counter_config: number enabled, pin offset
-	// feedback_timer_config: value, mode
+	// feedback TIMERx_CONFIG: value, mode
+	if (n_timers > 2) return -EINVAL;
 
-	// let's do the timer clock config first
 	struct lju3_config_timer_clock config_timer_clock = {0};
 	struct lju3_config_timer_clock_resp config_timer_clock_resp;
-	config_timer_clock.clock_config = LJU3_WRITE_CLOCK_CONFIG;
+	config_timer_clock.clock_config = LJU3_WRITE_CLOCK_CONFIG | clock_config;
+	config_timer_clock.clock_divisor = clock_divisor;
+	err = lju3_config_timer_clock(dev,
+		&config_timer_clock, &config_timer_clock_resp
+	);
+	if (err) return err;
+
+	struct lju3_config_io config_io = {0};
+	struct lju3_config_io_resp config_io_resp;
+	config_io.write_mask |= 1 << 0;		// set timer_counter_config
+	config_io.timer_counter_config = n_timers | counters | offset << 4;
+	err = lju3_config_io(dev, &config_io, &config_io_resp);
+	if (err) return err;
+
+	if (!n_timers) return 0;
+	uint8_t cmd[2 * 4];
+	uint8_t resp[1];
+	for (unsigned i = 0; i < n_timers; i++) {
+		cmd[4*i + 0] = TIMER0_CONFIG + 2*i;
+		cmd[4*i + 1] = modes[i];
+		cmd[4*i + 2] = values[i] & 0xFF;
+		cmd[4*i + 3] = values[i] >> 8;
+	}
+	return lju3_feedback(dev, cmd, 4 * n_timers, resp, 0);
+}
 
+
+void lju3_square_clock(unsigned long hz_req,
+	lju3_clock_config *clock_config, uint8_t *clock_divisor,
+	uint16_t *value, double *hz_real
+) {
 	// LJ docs: frequency = TimerClockBase/(TimerClockDivisor*2*TimerValue)
 	// base in {1,4,12,48} MHz, divisor <= 0xFF, value <= 0xFF
 	// (0x0 maps to 0x100 for divisor and value)
@@ -249,16 +717,16 @@ int lju3_square(
 	unsigned base;
 	if (hz_req > (48000000 >> 0x11)) {
 		base = 48000000;
-		config_timer_clock.clock_config |= LJU3_CLOCK_48MHZ_DIV;
+		*clock_config = LJU3_CLOCK_48MHZ_DIV;
 	} else if (hz_req > (12000000 >> 0x11)) {
 		base = 12000000;
-		config_timer_clock.clock_config |= LJU3_CLOCK_12MHZ_DIV;
+		*clock_config = LJU3_CLOCK_12MHZ_DIV;
 	} else if (hz_req > (4000000 >> 0x11)) {
 		base = 4000000;
-		config_timer_clock.clock_config |= LJU3_CLOCK_4MHZ_DIV;
+		*clock_config = LJU3_CLOCK_4MHZ_DIV;
 	} else {
 		base = 1000000;
-		config_timer_clock.clock_config |= LJU3_CLOCK_1MHZ_DIV;
+		*clock_config = LJU3_CLOCK_1MHZ_DIV;
 	}
 
 	// we want divisor and value to multiply close to this
@@ -298,33 +766,22 @@ int lju3_square(
 	}
 
 	*hz_real = (double)base / (divisor_best * 2 * value_best);
-	config_timer_clock.clock_divisor = divisor_best;
-
-	err = lju3_config_timer_clock(dev,
-		&config_timer_clock, &config_timer_clock_resp
-	);
-	if (err) return err;
+	*clock_divisor = divisor_best;
+	*value = value_best;
+}
 
-	// now, config_io.timer_counter_config
-	struct lju3_config_io config_io = {0};
-	struct lju3_config_io_resp config_io_resp;
-	config_io.write_mask |= 1 << 0;		// set timer_counter_config
-	config_io.timer_counter_config = 1;	// enable 1 timer
-	// pin offset to the requested pin
-	config_io.timer_counter_config |= pin << 4;
-	err = lju3_config_io(dev, &config_io, &config_io_resp);
-	if (err) return err;
 
-	// finally, feedback
-	struct lju3_feedback_timer_config feedback_timer_config;
-	struct lju3_feedback_resp_header feedback_timer_config_resp;
-	feedback_timer_config.timer_mode = LJU3_TIMER_OUT_SQUARE;
-	feedback_timer_config.value = value_best;
-	err = lju3_feedback_timer_config(
-		dev, &feedback_timer_config, &feedback_timer_config_resp
+int lju3_square(
+	struct ljud_dev *dev, ljud_pin pin, unsigned long hz_req, double *hz_real
+) {
+	lju3_clock_config clock_config;
+	uint8_t clock_divisor;
+	uint16_t value;
+	const lju3_timer_mode mode = LJU3_TIMER_OUT_SQUARE;
+	lju3_square_clock(hz_req, &clock_config, &clock_divisor, &value,
+		hz_real
+	);
+	return lju3_config_timers(dev, clock_config, clock_divisor,
+		pin, 0, 1, &mode, &value
 	);
-	if (err) return err;
-
-	return 0;
 }
-
@@ -4,6 +4,7 @@
 #ifndef LABJACK_U3_H_
 #define LABJACK_U3_H_
 
+#include <stdbool.h>
 #include "labjack_ud.h"
 
 // pins
@@ -115,6 +116,9 @@ enum {
 	BUZZER			= 63,
 };
 
+/** The free-running system timer that LJU3_TIMER_READ_LOW and _HIGH read. */
+#define LJU3_SYSTEM_TIMER_HZ 4000000
+
 typedef uint8_t lju3_timer_mode;
 enum {
 	// 16-bit PWM output
@@ -268,6 +272,10 @@ static_assert(sizeof(struct lju3_feedback_resp_header) == 9 + 1,
 	"bad lju3_feedback_resp_header"
 );
 
+// Feedback packets are at most 64 bytes in either direction
+#define LJU3_FEEDBACK_MAX_CMD (64 - sizeof(struct lju3_feedback_header))
+#define LJU3_FEEDBACK_MAX_RESP (64 - 9)
+
 struct lju3_feedback_timer_config {
 	struct lju3_feedback_header header;
 	lju3_io_type io_type;
@@ -297,7 +305,7 @@ static_assert(sizeof(struct lju3_readmem_resp) == 40, "bad lju3_readmem_resp");
 /** Set and get the timer clock configuration using a ConfigTimerClock
  * command. Will set header and check checksums for you.
  */
-int lju3_config_timer_clock(HANDLE dev,
+int lju3_config_timer_clock(struct ljud_dev *dev,
 	struct lju3_config_timer_clock *config,
 	struct lju3_config_timer_clock_resp *config_resp
 );
@@ -305,23 +313,196 @@ int lju3_config_timer_clock(HANDLE dev,
 /** Set and get the IO configuration using a ConfigIO command.
  * Will set header and check checksums for you.
  */
-int lju3_config_io(HANDLE dev,
+int lju3_config_io(struct ljud_dev *dev,
 	struct lju3_config_io *config, struct lju3_config_io_resp *config_resp
 );
 
-/** Read calibration memory into a struct lju3_cal_mem.
- * \warning This function is untested!
+/** Look up how many command bytes (including the IOType) and response bytes
+ * a Feedback IOType takes. Returns -EINVAL for IOTypes we don't know.
+ */
+int lju3_iotype_len(lju3_io_type io_type, unsigned *n_cmd, unsigned *n_resp);
+
+/** Work out how long the response to a command packet will be, so that
+ * something sitting between us and the device knows how much to read.
+ * Returns 0 for commands we don't know.
+ */
+unsigned lju3_resp_len(const uint8_t *tx, unsigned n_tx);
+
+/** Build a Feedback packet out of the (unpadded) IOTypes in cmd into tx,
+ * returning the padded packet length.
+ */
+unsigned lju3_pack_feedback(uint8_t *tx, const uint8_t *cmd, unsigned n_cmd);
+
+/** Length of the Feedback response packet carrying n_resp bytes of data. */
+unsigned lju3_feedback_resp_len(unsigned n_resp);
+
+/** Check the echo and error code of a Feedback response packet (whose
+ * checksums have already been checked), then copy out n_resp bytes of data.
+ */
+int lju3_unpack_feedback(const uint8_t *rx, uint8_t *resp, unsigned n_resp);
+
+/** Check that tx is a well-formed Feedback packet made of IOTypes we know,
+ * and if so, add up the length of its commands (without the header or
+ * padding) and responses, and count them. Returns false otherwise, including
+ * for bad checksums.
+ */
+bool lju3_parse_feedback(const uint8_t *tx, unsigned n_tx,
+	unsigned *n_cmd, unsigned *n_resp, unsigned *n_frames
+);
+
+/** For a Feedback packet that went out merged with others: cut its share of
+ * rx (the merged response, checksums checked) into out, as the response the
+ * device would have sent it alone. Its n_frames IOTypes started at frame of
+ * the merged packet, and their n_resp bytes of data at resp bytes into the
+ * merged data. Returns the length of out.
+ */
+unsigned lju3_split_feedback(uint8_t *out, const uint8_t *rx, uint8_t echo,
+	unsigned frame, unsigned n_frames, unsigned resp, unsigned n_resp
+);
+
+/** Most packets one struct lju3_merge takes. */
+#define LJU3_MERGE_JOBS 64
+/** Most device packets one struct lju3_merge sends before reading responses
+ * back.
+ */
+#define LJU3_MERGE_BATCH 16
+
+/** A batch of packets from several independent streams (broker clients,
+ * session members) on their way to one device. Feedback packets are merged
+ * into shared ones where they fit, and their responses split back out, so
+ * everyone's I/O goes out in as few packets as it can.
+ */
+struct lju3_merge {
+	// one packet as it was handed to us
+	struct {
+		unsigned out;		// the device packet it goes out in
+		bool merged;
+		uint8_t echo;
+		unsigned frame;		// first frame within the device packet
+		unsigned n_frames;
+		unsigned resp;		// where its response data starts
+		unsigned n_resp;
+	} jobs[LJU3_MERGE_JOBS];
+	unsigned n_jobs;
+	// one packet as it goes to the device
+	struct {
+		uint8_t tx[LJUD_PACKET_MAX];
+		uint8_t rx[LJUD_PACKET_MAX];
+		unsigned n_tx;
+		unsigned n_rx;
+		unsigned long n;	// response bytes read
+		bool feedback;
+		uint8_t cmd[LJU3_FEEDBACK_MAX_CMD];
+		unsigned n_cmd;
+		unsigned n_resp;
+		unsigned n_frames;
+	} outs[LJU3_MERGE_BATCH];
+	unsigned n_outs;
+	unsigned n_sent;	// device packets that went out
+};
+
+/** Empty m, ready for the next batch. */
+void lju3_merge_reset(struct lju3_merge *m);
+
+/** Add a packet from one of the streams to m. To keep each stream's packets
+ * in order, it only goes in device packet after or a later one, where after
+ * is what this returned for the stream's previous packet in the batch (0 for
+ * its first). Feedback packets are only merged if merge is set, which is only
+ * right for a U3. Returns the device packet it'll go out in, or -ENOBUFS if
+ * there's no room for it in this batch.
+ */
+int lju3_merge_add(struct lju3_merge *m, const uint8_t *tx, unsigned n_tx,
+	unsigned after, bool merge
+);
+
+/** Send every device packet in m, pipelined, then read back the responses to
+ * the ones that went out, so the device doesn't keep any for the next batch.
+ * Returns 0, or -ECOMM if a write failed, in which case that packet and the
+ * rest never went out.
+ */
+int lju3_merge_run(struct lju3_merge *m, struct ljud_dev *dev);
+
+/** Put the response to packet j (the jth one added) into out, which holds
+ * LJUD_PACKET_MAX bytes, as the device would have sent it alone. Returns its
+ * length, which is short (as the stream would read it) if the device's was,
+ * or -ECOMM if the packet never went out.
  */
-int lju3_read_cal_mem(HANDLE dev, struct lju3_cal_mem *cal_mem);
+int lju3_merge_result(const struct lju3_merge *m, unsigned j, uint8_t *out);
+
+/** Send a Feedback command made of the (unpadded) IOTypes in cmd, and copy
+ * the n_resp bytes of response data into resp. Will set header, pad, and
+ * check checksums and echo for you.
+ */
+int lju3_feedback(struct ljud_dev *dev,
+	const uint8_t *cmd, unsigned n_cmd, uint8_t *resp, unsigned n_resp
+);
+
+/** Read one of the hardware counters (0 or 1) with a Feedback command.
+ * The counter is reset after reading if reset is set.
+ */
+int lju3_read_counter(struct ljud_dev *dev, unsigned counter, bool reset,
+	uint32_t *count
+);
+
+/** Get the response stream back in step with the commands after an error,
+ * such as a bad checksum or a lost or late response. Sends a Feedback command
+ * that does nothing, with an echo byte of its own, and throws responses away
+ * until its response turns up, reading at most max_reads. The echo byte is
+ * kept per device, so different devices can be resynced from different
+ * threads. Returns how many stale responses were thrown away, or negative
+ * error code.
+ */
+int lju3_resync(struct ljud_dev *dev, unsigned max_reads);
+
+/** Parse a pin name like "FIO4" or "cio2". Returns the pin, or -EINVAL. */
+int lju3_pin_from_name(const char *name);
+
+/** Parse an analog input name like "AIN3". Returns the channel (0 to 15), or
+ * -EINVAL.
+ */
+int lju3_ain_from_name(const char *name);
+
+/** Look up the single-ended calibration for an analog input, which converts
+ * a raw reading to volts as raw * slope + offset. hv says whether this is a
+ * U3-HV, whose AIN0-3 have their own high voltage calibration.
+ */
+void lju3_ain_cal(const struct lju3_cal_mem *cal_mem, bool hv, unsigned ain,
+	double *slope, double *offset
+);
+
+/** Read calibration memory into a struct lju3_cal_mem, one 32-byte block at
+ * a time. Returns 0, a negative error code for transport trouble, or a
+ * positive ljud_err from the device.
+ */
+int lju3_read_cal_mem(struct ljud_dev *dev, struct lju3_cal_mem *cal_mem);
 
 /** Get the current device configuration using a ConfigU3 command. */
-int lju3_read_config(HANDLE dev, struct lju3_config_resp *config_resp);
+int lju3_read_config(struct ljud_dev *dev, struct lju3_config_resp *config_resp);
+
+/** Set the timer clock, enable n_timers timers (at most 2) plus the given
+ * counters on consecutive pins starting at offset, and set each timer's mode
+ * and value.
+ */
+int lju3_config_timers(struct ljud_dev *dev,
+	lju3_clock_config clock_config, uint8_t clock_divisor,
+	ljud_pin offset, lju3_timer_counter_config counters,
+	unsigned n_timers, const lju3_timer_mode *modes, const uint16_t *values
+);
+
+/** Work out the timer clock and timer value that get a square wave closest to
+ * hz_req. Doesn't talk to the device.
+ */
+void lju3_square_clock(unsigned long hz_req,
+	lju3_clock_config *clock_config, uint8_t *clock_divisor,
+	uint16_t *value, double *hz_real
+);
 
 /** Start outputting a square wave on the specified pin.
- * \todo: only supports one timer at any given time.
+ * \todo: only supports one timer at any given time; use lju3_config_timers
+ * directly to mix it with other timers.
  */
 int lju3_square(
-	HANDLE dev, ljud_pin pin, unsigned long hz_req, double *hz_real
+	struct ljud_dev *dev, ljud_pin pin, unsigned long hz_req, double *hz_real
 );
 
 #endif
@@ -0,0 +1,106 @@
+#include <errno.h>
+#include <string.h>
+
+#include "labjack_u6.h"
+
+
+int lju6_read_config(struct ljud_dev *dev, struct lju6_config_resp *config_resp)
+{
+	unsigned long n;
+	uint8_t tx[sizeof(struct lju6_config)] = {0};
+	uint8_t rx[sizeof(struct lju6_config_resp)];
+	struct lju6_config *t = (struct lju6_config *)tx;
+
+	t->header.command = 0xF8;
+	t->header.n_data_words = (
+		(sizeof(tx) - sizeof(struct ljud_extended_header)) / 2
+	);
+	static_assert(
+		sizeof(tx) - sizeof(struct ljud_extended_header) == 2 * 0x0A,
+		"bad n_data_words"
+	);
+	t->header.extended_command = 0x08;
+	t->header.checksum16 = ljud_checksum16(tx + 6, sizeof(tx) - 6);
+	t->header.checksum8 = ljud_checksum8(tx + 1, 5);
+
+	n = ljud_write(dev, tx, sizeof(tx));
+	if (n < sizeof(tx)) return -ECOMM;
+
+	int err = ljud_read_resp(dev, rx, sizeof(rx));
+	if (err) return err;
+
+	memcpy(config_resp, rx, sizeof(struct lju6_config_resp));
+	if (config_resp->err) return config_resp->err;
+	return 0;
+}
+
+
+int lju6_config_io(struct ljud_dev *dev,
+	struct lju6_config_io *config, struct lju6_config_io_resp *config_resp
+) {
+	unsigned long n;
+	const unsigned n_tx = sizeof(struct lju6_config_io);
+	const unsigned n_rx = sizeof(struct lju6_config_io_resp);
+	const unsigned n_head = sizeof(struct ljud_extended_header);
+
+	config->header.command = 0xF8;
+	config->header.n_data_words = ((n_tx - n_head) / 2);
+	config->header.extended_command = 0x0B;
+
+	config->header.checksum16 = ljud_checksum16(
+		(uint8_t *)config + 6, n_tx - 6
+	);
+	config->header.checksum8 = ljud_checksum8(
+		(uint8_t *)config + 1, n_head - 1
+	);
+
+	n = ljud_write(dev, (uint8_t *)config, n_tx);
+	if (n < n_tx) return -ECOMM;
+
+	int err = ljud_read_resp(dev, (uint8_t *)config_resp, n_rx);
+	if (err) return err;
+
+	if (config_resp->err) return config_resp->err;
+	return 0;
+}
+
+
+int lju6_config_timers(struct ljud_dev *dev,
+	lju3_clock_config clock_config, uint8_t clock_divisor,
+	ljud_pin offset, lju6_counter_enable counters,
+	unsigned n_timers, const lju3_timer_mode *modes, const uint16_t *values
+) {
+	int err;
+
+	// same steps as on the U3; only ConfigIO is laid out differently
+	if (n_timers > LJU6_MAX_TIMERS) return -EINVAL;
+
+	struct lju3_config_timer_clock config_timer_clock = {0};
+	struct lju3_config_timer_clock_resp config_timer_clock_resp;
+	config_timer_clock.clock_config = LJU3_WRITE_CLOCK_CONFIG | clock_config;
+	config_timer_clock.clock_divisor = clock_divisor;
+	err = lju3_config_timer_clock(dev,
+		&config_timer_clock, &config_timer_clock_resp
+	);
+	if (err) return err;
+
+	struct lju6_config_io config_io = {0};
+	struct lju6_config_io_resp config_io_resp;
+	config_io.write_mask = 1 << 0;
+	config_io.n_timers = n_timers;
+	config_io.counter_enable = counters;
+	config_io.pin_offset = offset;
+	err = lju6_config_io(dev, &config_io, &config_io_resp);
+	if (err) return err;
+
+	if (!n_timers) return 0;
+	uint8_t cmd[LJU6_MAX_TIMERS * 4];
+	uint8_t resp[1];
+	for (unsigned i = 0; i < n_timers; i++) {
+		cmd[4*i + 0] = TIMER0_CONFIG + 2*i;
+		cmd[4*i + 1] = modes[i];
+		cmd[4*i + 2] = values[i] & 0xFF;
+		cmd[4*i + 3] = values[i] >> 8;
+	}
+	return lju3_feedback(dev, cmd, 4 * n_timers, resp, 0);
+}
@@ -0,0 +1,90 @@
+/** Low-level functions for the LabJack U6.
+ * The U6 speaks the same UD framing as the U3, and its TimerClock, Feedback
+ * (as far as the IOTypes we use go) and I2C commands are identical, so those
+ * come from labjack_u3.h and labjack_ud.h. What differs is ConfigU6, the
+ * layout of ConfigIO, and that it has four timers rather than two.
+ */
+#ifndef LABJACK_U6_H_
+#define LABJACK_U6_H_
+
+#include <stdbool.h>
+#include "labjack_ud.h"
+#include "labjack_u3.h"
+
+#define LJU6_MAX_TIMERS 4
+
+// https://support.labjack.com/docs/5-low-level-function-reference-u6-datasheet
+struct lju6_config {
+	struct ljud_extended_header header;
+	uint16_t write_mask;
+	uint8_t local_id;
+	uint8_t reserved9[17];
+}__attribute__((packed));
+static_assert(sizeof(struct lju6_config) == 26, "bad lju6_config");
+
+struct lju6_config_resp {
+	struct ljud_extended_header header;
+	ljud_err err;
+	uint8_t reserved7;
+	uint8_t reserved8;
+	uint16_t firmware_version;
+	uint16_t bootloader_version;
+	uint16_t hardware_version;
+	uint32_t serial_number;
+	uint16_t product_id;
+	uint8_t local_id;
+	uint8_t reserved22[15];
+	uint8_t version_info;
+}__attribute__((packed));
+static_assert(sizeof(struct lju6_config_resp) == 38, "bad lju6_config_resp");
+
+typedef uint8_t lju6_counter_enable;
+enum {
+	LJU6_ENABLE_COUNTER0	= 1 << 0,
+	LJU6_ENABLE_COUNTER1	= 1 << 1,
+};
+
+struct lju6_config_io {
+	struct ljud_extended_header header;
+	uint8_t write_mask;	// bit 0: write the rest
+	uint8_t n_timers;
+	lju6_counter_enable counter_enable;
+	uint8_t pin_offset;
+	uint8_t reserved10[6];
+}__attribute__((packed));
+static_assert(sizeof(struct lju6_config_io) == 16, "bad lju6_config_io");
+
+struct lju6_config_io_resp {
+	struct ljud_extended_header header;
+	ljud_err err;
+	uint8_t reserved7;
+	uint8_t n_timers;
+	lju6_counter_enable counter_enable;
+	uint8_t pin_offset;
+	uint8_t reserved11[5];
+}__attribute__((packed));
+static_assert(
+	sizeof(struct lju6_config_io_resp) == 16, "bad lju6_config_io_resp"
+);
+
+/** Get the current device configuration using a ConfigU6 command. */
+int lju6_read_config(struct ljud_dev *dev, struct lju6_config_resp *config_resp);
+
+/** Set and get the timer and counter configuration using a ConfigIO command.
+ * Will set header and check checksums for you.
+ */
+int lju6_config_io(struct ljud_dev *dev,
+	struct lju6_config_io *config, struct lju6_config_io_resp *config_resp
+);
+
+/** Set the timer clock, enable n_timers timers (at most 4) plus the given
+ * counters on consecutive pins starting at offset, and set each timer's mode
+ * and value. Timer clocks and modes are numbered as on the U3.
+ */
+int lju6_config_timers(struct ljud_dev *dev,
+	lju3_clock_config clock_config, uint8_t clock_divisor,
+	ljud_pin offset, lju6_counter_enable counters,
+	unsigned n_timers, const lju3_timer_mode *modes, const uint16_t *values
+);
+
+#endif
@@ -1,4 +1,78 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "labjack_ud.h"
+#include "ljprobe.h"
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static unsigned long usb_write(void *ctx, const uint8_t *buf, unsigned long n)
+{
+	LJ_PROBE1(usb_write_start, n);
+	unsigned long ret = LJUSB_Write(ctx, buf, n);
+	LJ_PROBE2(usb_write_done, n, ret);
+	return ret;
+}
+
+static unsigned long usb_read(void *ctx, uint8_t *buf, unsigned long n)
+{
+	LJ_PROBE1(usb_read_start, n);
+	unsigned long ret = LJUSB_Read(ctx, buf, n);
+	LJ_PROBE2(usb_read_done, n, ret);
+	return ret;
+}
+
+static void usb_close(void *ctx)
+{
+	LJUSB_CloseDevice(ctx);
+}
+
+static const struct ljud_transport usb_transport = {
+	.name = "usb",
+	.write = usb_write,
+	.read = usb_read,
+	.close = usb_close,
+};
+
+
+struct ljud_dev *ljud_open_usb(unsigned long product_id, unsigned dev_num)
+{
+	HANDLE handle = LJUSB_OpenDevice(dev_num, 0, product_id);
+	if (!handle) return NULL;
+	struct ljud_dev *dev = ljud_open(&usb_transport, handle, product_id);
+	if (!dev) LJUSB_CloseDevice(handle);
+	return dev;
+}
+
+
+struct ljud_dev *ljud_open(
+	const struct ljud_transport *ops, void *ctx, unsigned long product_id
+) {
+	struct ljud_dev *dev = malloc(sizeof(struct ljud_dev));
+	if (!dev) return NULL;
+	dev->ops = ops;
+	dev->ctx = ctx;
+	dev->product_id = product_id;
+	dev->resync_echo = 0;
+	return dev;
+}
+
+
+void ljud_close(struct ljud_dev *dev)
+{
+	if (!dev) return;
+	if (dev->ops->close) dev->ops->close(dev->ctx);
+	free(dev);
+}
 
 
 /** All checksums are a “1’s complement checksum”. Both the 8-bit and 16-bit
@@ -25,3 +99,173 @@ uint16_t ljud_checksum16(uint8_t *data, uint8_t len)
 	return acc;
 }
 
+
+
+int ljud_batch_add(struct ljud_batch *batch, unsigned n_tx, unsigned n_rx)
+{
+	if (batch->n >= LJUD_BATCH_MAX) return -ENOBUFS;
+	if (n_tx > LJUD_PACKET_MAX || n_rx > LJUD_PACKET_MAX) return -EMSGSIZE;
+	batch->n_tx[batch->n] = n_tx;
+	batch->n_rx[batch->n] = n_rx;
+	return batch->n++;
+}
+
+
+int ljud_read_resp(struct ljud_dev *dev, uint8_t *rx, unsigned n_rx)
+{
+	unsigned long n = ljud_read(dev, rx, n_rx);
+	if (n < n_rx) {
+		// LJ is telling us we have a bad checksum
+		if (n >= 2 && *(uint16_t *)rx == LJ_BAD_CHECKSUM) {
+			LJ_PROBE3(checksum_fail, 1, 0, n);
+			return -EBADMSG;
+		}
+		return -EREMOTEIO;
+	}
+	if (
+		((struct ljud_extended_header *)rx)->checksum16
+		!= ljud_checksum16(rx + 6, n_rx - 6)
+	) {
+		LJ_PROBE3(checksum_fail, 0, rx[3], n);
+		return -EBADE;
+	}
+	return 0;
+}
+
+
+int ljud_i2c_pack(uint8_t *tx, const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w, unsigned n_r
+) {
+	const unsigned n_head = sizeof(struct ljud_extended_header);
+	if (n_w > LJUD_I2C_W_MAX || n_r > LJUD_I2C_R_MAX) return -EMSGSIZE;
+	// command packets are a whole number of words long, so an odd number
+	// of bytes gets a zero of padding
+	const unsigned n_tx = LJUD_I2C_TX(n_w);
+	memset(tx, 0, n_tx);
+	if (n_w) memcpy(tx + sizeof(struct ljud_i2c_header), w, n_w);
+
+	struct ljud_i2c_header *head = (struct ljud_i2c_header *)tx;
+	head->i2c_options = slave->options;
+	head->speed_adjust = slave->speed_adjust;
+	head->sda_pin = slave->sda_pin;
+	head->scl_pin = slave->scl_pin;
+	head->address_byte = slave->address;
+	head->n_i2c_bytes_tx = n_w;
+	head->n_i2c_bytes_rx = n_r;
+
+	head->header.command = 0xF8;
+	head->header.extended_command = 0x3B;
+	head->header.n_data_words = (n_tx - n_head) / 2;
+	head->header.checksum16 = ljud_checksum16(tx + 6, n_tx - 6);
+	head->header.checksum8 = ljud_checksum8(tx + 1, n_head - 1);
+	return n_tx;
+}
+
+
+uint32_t ljud_i2c_acks(const uint8_t *rx)
+{
+	const struct ljud_i2c_resp_header *resp = (const void *)rx;
+	return (uint32_t)resp->ackarray0 | (uint32_t)resp->ackarray1 << 8
+		| (uint32_t)resp->ackarray2 << 16
+		| (uint32_t)resp->ackarray3 << 24;
+}
+
+
+int ljud_i2c_nak(uint32_t acks, unsigned n_w)
+{
+	// one ACK for the address, then one for each byte written, as far as
+	// the array goes
+	uint32_t want = n_w + 1 >= 32 ? 0xFFFFFFFF : (1U << (n_w + 1)) - 1;
+	uint32_t missing = want & ~acks;
+	return missing ? __builtin_ctz(missing) : -1;
+}
+
+
+int ljud_i2c_batch_add(struct ljud_batch *batch,
+	const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w, unsigned n_r
+) {
+	if (n_w > LJUD_I2C_W_MAX || n_r > LJUD_I2C_R_MAX) return -EMSGSIZE;
+	int k = ljud_batch_add(batch, LJUD_I2C_TX(n_w), LJUD_I2C_RX(n_r));
+	if (k < 0) return k;
+	ljud_i2c_pack(batch->tx[k], slave, w, n_w, n_r);
+	return k;
+}
+
+
+int ljud_i2c_result(const struct ljud_batch *batch, unsigned k,
+	uint8_t *r, uint32_t *acks
+) {
+	const struct ljud_i2c_header *head = (const void *)batch->tx[k];
+	const struct ljud_i2c_resp_header *resp = (const void *)batch->rx[k];
+	if (head->header.extended_command != 0x3B) return -EBADMSG;
+	uint32_t a = ljud_i2c_acks(batch->rx[k]);
+	if (acks) *acks = a;
+	if (resp->err) return resp->err;
+	if (ljud_i2c_nak(a, head->n_i2c_bytes_tx) >= 0) return -ENXIO;
+	if (r && head->n_i2c_bytes_rx) {
+		memcpy(r, batch->rx[k] + sizeof(struct ljud_i2c_resp_header),
+			head->n_i2c_bytes_rx
+		);
+	}
+	return 0;
+}
+
+
+int ljud_i2c_write_read(struct ljud_dev *dev,
+	const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w, uint8_t *r, unsigned n_r
+) {
+	struct ljud_batch batch = {0};
+	int k = ljud_i2c_batch_add(&batch, slave, w, n_w, n_r);
+	if (k < 0) return k;
+	int err = ljud_batch_run(dev, &batch, true);
+	if (err) return err;
+	return ljud_i2c_result(&batch, k, r, NULL);
+}
+
+
+int ljud_i2c_write(struct ljud_dev *dev, const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w
+) {
+	return ljud_i2c_write_read(dev, slave, w, n_w, NULL, 0);
+}
+
+
+int ljud_i2c_read(struct ljud_dev *dev, const struct ljud_i2c_slave *slave,
+	uint8_t *r, unsigned n_r
+) {
+	return ljud_i2c_write_read(dev, slave, NULL, 0, r, n_r);
+}
+
+
+int ljud_batch_write(struct ljud_dev *dev, struct ljud_batch *batch)
+{
+	for (unsigned i = 0; i < batch->n; i++) {
+		batch->t_tx[i] = now_ns();
+		unsigned long n = ljud_write(dev, batch->tx[i], batch->n_tx[i]);
+		if (n < batch->n_tx[i]) return -ECOMM;
+	}
+	return 0;
+}
+
+
+int ljud_batch_read(struct ljud_dev *dev, struct ljud_batch *batch)
+{
+	int err = 0;
+	// keep reading after an error so the next batch starts clean
+	for (unsigned i = 0; i < batch->n; i++) {
+		int e = ljud_read_resp(dev, batch->rx[i], batch->n_rx[i]);
+		batch->t_rx[i] = now_ns();
+		if (!err) err = e;
+	}
+	return err;
+}
+
+
+int ljud_batch_run(struct ljud_dev *dev, struct ljud_batch *batch, bool read)
+{
+	int err = ljud_batch_write(dev, batch);
+	if (err || !read) return err;
+	return ljud_batch_read(dev, batch);
+}
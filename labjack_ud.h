@@ -7,6 +7,7 @@
 #ifndef LABJACK_UD_H_
 #define LABJACK_UD_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "labjackusb.h"
 
@@ -97,6 +98,53 @@ enum {
 	LJ_MODBUS_CMD_OVERFLOW		= 0x91,
 };
 
+/** How packets get to and from a device. The USB transport just wraps
+ * liblabjackusb, but anything that behaves like a device (a simulation, a
+ * broker process, a recording) can stand in for it.
+ */
+struct ljud_transport {
+	const char *name;
+	/** Same semantics as LJUSB_Write: returns the number of bytes written,
+	 * or 0 on failure. */
+	unsigned long (*write)(void *ctx, const uint8_t *buf, unsigned long n);
+	/** Same semantics as LJUSB_Read. */
+	unsigned long (*read)(void *ctx, uint8_t *buf, unsigned long n);
+	void (*close)(void *ctx);
+};
+
+/** A device, as seen through some transport. */
+struct ljud_dev {
+	const struct ljud_transport *ops;
+	void *ctx;
+	unsigned long product_id;
+	uint8_t resync_echo;	// last echo byte lju3_resync sent
+};
+
+static inline unsigned long ljud_write(
+	struct ljud_dev *dev, const uint8_t *buf, unsigned long n
+) {
+	return dev->ops->write(dev->ctx, buf, n);
+}
+
+static inline unsigned long ljud_read(
+	struct ljud_dev *dev, uint8_t *buf, unsigned long n
+) {
+	return dev->ops->read(dev->ctx, buf, n);
+}
+
+/** Open the dev_num'th (starting at 1) USB device with this product ID.
+ * Returns NULL and sets errno on failure.
+ */
+struct ljud_dev *ljud_open_usb(unsigned long product_id, unsigned dev_num);
+
+/** Wrap some other transport in a struct ljud_dev. */
+struct ljud_dev *ljud_open(
+	const struct ljud_transport *ops, void *ctx, unsigned long product_id
+);
+
+/** Close the device and free it. */
+void ljud_close(struct ljud_dev *dev);
+
 /** 2-byte normal response given when LJ detects bad checksum. */
 #define LJ_BAD_CHECKSUM 0xB8B8
 
@@ -160,6 +208,164 @@ static_assert(
 	sizeof(struct ljud_i2c_resp_header) == 12, "bad ljud_i2c_resp_header"
 );
 
+typedef uint8_t ljud_spi_options;
+enum {
+	LJ_SPI_AUTO_CS			= 1 << 7,
+	LJ_SPI_DISABLE_DIR_CONFIG	= 1 << 6,
+	// bits 5-2: reserved
+	// bits 1-0: mode, as clock polarity and phase
+	LJ_SPI_MODE_A			= 0,	// CPOL 0, CPHA 0
+	LJ_SPI_MODE_B			= 1,	// CPOL 0, CPHA 1
+	LJ_SPI_MODE_C			= 2,	// CPOL 1, CPHA 0
+	LJ_SPI_MODE_D			= 3,	// CPOL 1, CPHA 1
+};
+
+struct ljud_spi_header {
+	struct ljud_extended_header header;
+	ljud_spi_options spi_options;
+	uint8_t clock_factor;
+	uint8_t reserved8;
+	uint8_t cs_pin;
+	uint8_t clk_pin;
+	uint8_t miso_pin;
+	uint8_t mosi_pin;
+	uint8_t n_spi_bytes;
+}__attribute__((packed));
+static_assert(sizeof(struct ljud_spi_header) == 14, "bad ljud_spi_header");
+
+struct ljud_spi_resp_header {
+	struct ljud_extended_header header;
+	ljud_err err;
+	uint8_t n_spi_bytes;
+}__attribute__((packed));
+static_assert(
+	sizeof(struct ljud_spi_resp_header) == 8, "bad ljud_spi_resp_header"
+);
+
+
+/** Packets sent to or received from UD devices are at most this long. */
+#define LJUD_PACKET_MAX 64
+
+/** Most packets we will queue up in one ljud_batch. */
+#define LJUD_BATCH_MAX 8
+
+/** A batch of command packets that are all written before any of their
+ * responses are read, so the whole batch costs about one USB round trip.
+ */
+struct ljud_batch {
+	unsigned n;
+	unsigned n_tx[LJUD_BATCH_MAX];
+	unsigned n_rx[LJUD_BATCH_MAX];
+	uint8_t tx[LJUD_BATCH_MAX][LJUD_PACKET_MAX];
+	uint8_t rx[LJUD_BATCH_MAX][LJUD_PACKET_MAX];
+	// CLOCK_MONOTONIC ns when each packet started going out, and when its
+	// response was back, so whatever it did on the device happened between
+	uint64_t t_tx[LJUD_BATCH_MAX];
+	uint64_t t_rx[LJUD_BATCH_MAX];
+};
+
+/** Reserve the next packet in a batch. Returns the index of the packet, whose
+ * tx buffer the caller should then fill with n_tx bytes, or -ENOBUFS.
+ */
+int ljud_batch_add(struct ljud_batch *batch, unsigned n_tx, unsigned n_rx);
+
+/** Write every packet in the batch, then (if read is set) read every response
+ * and check its checksums. Responses are always read in full when read is set,
+ * so that a short read can't shift the stream for later commands.
+ */
+int ljud_batch_run(struct ljud_dev *dev, struct ljud_batch *batch, bool read);
+
+/** The two halves of ljud_batch_run, for callers that want to do something in
+ * between, like collecting responses left unread by earlier batches.
+ */
+int ljud_batch_write(struct ljud_dev *dev, struct ljud_batch *batch);
+int ljud_batch_read(struct ljud_dev *dev, struct ljud_batch *batch);
+
+/** Read one n_rx-byte response into rx and check its checksum. Returns 0 or
+ * negative error code.
+ */
+int ljud_read_resp(struct ljud_dev *dev, uint8_t *rx, unsigned n_rx);
+
+/** An I2C slave: which pins its bus is on, how to drive the bus, and its
+ * address (in its 8-bit form). Any pair of digital pins will do, and any
+ * number of slaves can share them.
+ */
+struct ljud_i2c_slave {
+	ljud_i2c_options options;
+	uint8_t speed_adjust;	// 0 fastest to 255 slowest
+	ljud_pin sda_pin;
+	ljud_pin scl_pin;
+	uint8_t address;
+};
+
+/** Most bytes one I2C command can write, and read. */
+#define LJUD_I2C_W_MAX (LJUD_PACKET_MAX - sizeof(struct ljud_i2c_header))
+#define LJUD_I2C_R_MAX (LJUD_PACKET_MAX - sizeof(struct ljud_i2c_resp_header))
+
+// lengths of the packets sent writing n_w bytes, and received reading n_r
+#define LJUD_I2C_TX(n_w) ((sizeof(struct ljud_i2c_header) + (n_w) + 1) & ~1U)
+#define LJUD_I2C_RX(n_r) \
+	((sizeof(struct ljud_i2c_resp_header) + (n_r) + 1) & ~1U)
+
+/** Build the LJUD_I2C_TX(n_w)-byte packet for one I2C transaction into tx,
+ * without sending it: write the n_w bytes in w to the slave, then (after a
+ * restart, if there was anything to write) read n_r bytes. Either count can
+ * be 0. Returns the length of the packet, or -EMSGSIZE if the transaction
+ * doesn't fit in a packet and its response.
+ */
+int ljud_i2c_pack(uint8_t *tx, const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w, unsigned n_r
+);
+
+/** The ACK array of an I2C response: bit 0 for the address, then a bit for
+ * each byte written, set if the slave ACKed it.
+ */
+uint32_t ljud_i2c_acks(const uint8_t *rx);
+
+/** Which of the address (0) and the n_w bytes written (1 on) the ACK array
+ * shows the slave didn't ACK first, or -1 if it ACKed all of them. Slaves
+ * that aren't there, or a bus run too fast for its wiring, show up as
+ * missing ACKs rather than as errors.
+ */
+int ljud_i2c_nak(uint32_t acks, unsigned n_w);
+
+/** Queue an I2C transaction (as ljud_i2c_pack) in a batch, where it costs no
+ * round trip of its own. Returns the index of its packet, -EMSGSIZE, or
+ * -ENOBUFS if the batch is full.
+ */
+int ljud_i2c_batch_add(struct ljud_batch *batch,
+	const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w, unsigned n_r
+);
+
+/** Check the response to the I2C transaction at index k of a batch that's
+ * been run and read, copying the bytes read into r (unless it's NULL) and the
+ * ACK array into *acks (unless that is). Returns 0, positive ljud_err,
+ * -ENXIO if the slave missed an ACK, or -EBADMSG if packet k isn't an I2C
+ * command.
+ */
+int ljud_i2c_result(const struct ljud_batch *batch, unsigned k,
+	uint8_t *r, uint32_t *acks
+);
+
+/** Run one I2C transaction and wait for it: write the n_w bytes in w to the
+ * slave, then read n_r bytes into r. Returns 0, positive ljud_err, -ENXIO if
+ * the slave missed an ACK, or another negative error code.
+ */
+int ljud_i2c_write_read(struct ljud_dev *dev,
+	const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w, uint8_t *r, unsigned n_r
+);
+
+/** ljud_i2c_write_read, only writing. */
+int ljud_i2c_write(struct ljud_dev *dev, const struct ljud_i2c_slave *slave,
+	const uint8_t *w, unsigned n_w
+);
+
+/** ljud_i2c_write_read, only reading. */
+int ljud_i2c_read(struct ljud_dev *dev, const struct ljud_i2c_slave *slave,
+	uint8_t *r, unsigned n_r
+);
 
 /** Perform the LJ UD 8-bit checksum on some data.
  * \warning the exodriver example code does this differently.
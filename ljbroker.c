@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "labjack_u3.h"
+#include "ljbroker.h"
+
+// how long a client waits for a response before giving up, like a USB read
+#define LJBROKER_TIMEOUT_NS 1000000000
+
+
+static struct ljbroker_packet *ring_peek(struct ljbroker_ring *r)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head == tail) return NULL;
+	return &r->packets[head % LJBROKER_RING];
+}
+
+static void ring_pop(struct ljbroker_ring *r)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static struct ljbroker_packet *ring_reserve(struct ljbroker_ring *r)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (tail - head >= LJBROKER_RING) return NULL;
+	return &r->packets[tail % LJBROKER_RING];
+}
+
+static void ring_push(struct ljbroker_ring *r)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static bool pid_alive(pid_t pid)
+{
+	// pid 0 means the client hasn't filled it in yet
+	return pid == 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+static void free_slot(struct ljbroker_slot *slot)
+{
+	atomic_store_explicit(&slot->sub.head, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->sub.tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->comp.head, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->comp.tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->pid, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->state, LJBROKER_FREE,
+		memory_order_release
+	);
+}
+
+
+int ljbroker_create(struct ljbroker *broker, const char *name,
+	struct ljud_dev *dev
+) {
+	memset(broker, 0, sizeof(struct ljbroker));
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (fd < 0) return -errno;
+	if (ftruncate(fd, sizeof(struct ljbroker_shm))) {
+		int err = -errno;
+		close(fd);
+		shm_unlink(name);
+		return err;
+	}
+	struct ljbroker_shm *shm = mmap(NULL, sizeof(struct ljbroker_shm),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+	);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		int err = -errno;
+		shm_unlink(name);
+		return err;
+	}
+	broker->name = strdup(name);
+	if (!broker->name) {
+		munmap(shm, sizeof(struct ljbroker_shm));
+		shm_unlink(name);
+		return -ENOMEM;
+	}
+	shm->version = LJBROKER_VERSION;
+	shm->product_id = dev->product_id;
+	atomic_store(&shm->broker_pid, getpid());
+	// clients check the magic number last, so write it last
+	atomic_thread_fence(memory_order_release);
+	shm->magic = LJBROKER_MAGIC;
+	broker->shm = shm;
+	broker->dev = dev;
+	return 0;
+}
+
+
+void ljbroker_destroy(struct ljbroker *broker)
+{
+	if (broker->shm) {
+		broker->shm->magic = 0;
+		munmap(broker->shm, sizeof(struct ljbroker_shm));
+		broker->shm = NULL;
+	}
+	if (broker->name) {
+		shm_unlink(broker->name);
+		free(broker->name);
+		broker->name = NULL;
+	}
+	ljud_close(broker->dev);
+	broker->dev = NULL;
+}
+
+
+int ljbroker_sweep(struct ljbroker *broker)
+{
+	struct ljbroker_shm *shm = broker->shm;
+	struct lju3_merge merge;
+	unsigned slots[LJU3_MERGE_JOBS];	// each client packet's slot
+	unsigned last_out[LJBROKER_MAX_CLIENTS] = {0};
+	bool blocked[LJBROKER_MAX_CLIENTS] = {0};
+	lju3_merge_reset(&merge);
+
+	atomic_fetch_add_explicit(&shm->heartbeat, 1, memory_order_relaxed);
+
+	// reclaim slots from clients that have left, politely or not
+	for (unsigned s = 0; s < LJBROKER_MAX_CLIENTS; s++) {
+		struct ljbroker_slot *slot = &shm->slots[s];
+		uint32_t state = atomic_load_explicit(
+			&slot->state, memory_order_acquire
+		);
+		if (state == LJBROKER_CLOSING) free_slot(slot);
+		else if (state == LJBROKER_ACTIVE && !pid_alive(
+			atomic_load_explicit(&slot->pid, memory_order_relaxed)
+		)) free_slot(slot);
+		blocked[s] = state != LJBROKER_ACTIVE;
+	}
+
+	// Take one packet from each client in turn, so a busy client can't
+	// starve the others. Each client's packets have to stay in order, so a
+	// Feedback packet can only merge into a device packet at or after the
+	// one holding that client's previous command.
+	bool progress = true;
+	while (progress && merge.n_jobs < LJU3_MERGE_JOBS) {
+		progress = false;
+		for (unsigned k = 0; k < LJBROKER_MAX_CLIENTS; k++) {
+			if (merge.n_jobs >= LJU3_MERGE_JOBS) break;
+			unsigned s = (broker->next_slot + k) % LJBROKER_MAX_CLIENTS;
+			if (blocked[s]) continue;
+			struct ljbroker_ring *sub = &shm->slots[s].sub;
+			struct ljbroker_packet *p = ring_peek(sub);
+			if (!p) {
+				blocked[s] = true;
+				continue;
+			}
+			unsigned n_tx = p->n < LJUD_PACKET_MAX
+				? p->n : LJUD_PACKET_MAX;
+			int o = lju3_merge_add(&merge, p->buf, n_tx,
+				last_out[s], true
+			);
+			if (o < 0) {
+				// no room; try again next sweep
+				blocked[s] = true;
+				continue;
+			}
+			slots[merge.n_jobs - 1] = s;
+			last_out[s] = o;
+			ring_pop(sub);
+			progress = true;
+		}
+	}
+	broker->next_slot = (broker->next_slot + 1) % LJBROKER_MAX_CLIENTS;
+	if (!merge.n_jobs) return 0;
+
+	int err = lju3_merge_run(&merge, broker->dev);
+
+	// Hand the responses back. A short completion reads as a failed read
+	// on the client side, which is the closest thing to what happened, and
+	// an empty one stands in for a packet that never went out.
+	for (unsigned j = 0; j < merge.n_jobs; j++) {
+		struct ljbroker_slot *slot = &shm->slots[slots[j]];
+		struct ljbroker_packet *c = ring_reserve(&slot->comp);
+		if (!c) {
+			// client isn't reading its responses
+			atomic_fetch_add_explicit(&shm->n_dropped, 1,
+				memory_order_relaxed
+			);
+			continue;
+		}
+		int n = lju3_merge_result(&merge, j, c->buf);
+		c->n = n < 0 ? 0 : n;
+		ring_push(&slot->comp);
+	}
+
+	atomic_fetch_add_explicit(&shm->n_client_packets, merge.n_jobs,
+		memory_order_relaxed
+	);
+	atomic_fetch_add_explicit(&shm->n_device_packets, merge.n_sent,
+		memory_order_relaxed
+	);
+	return err ? err : (int)merge.n_jobs;
+}
+
+
+struct ljbroker_client {
+	struct ljbroker_shm *shm;
+	struct ljbroker_slot *slot;
+};
+
+
+static unsigned long client_write(void *ctx, const uint8_t *buf, unsigned long n)
+{
+	struct ljbroker_client *client = ctx;
+	if (n > LJUD_PACKET_MAX) return 0;
+	struct ljbroker_packet *p = ring_reserve(&client->slot->sub);
+	if (!p) return 0;
+	memcpy(p->buf, buf, n);
+	p->n = n;
+	ring_push(&client->slot->sub);
+	return n;
+}
+
+
+static unsigned long client_read(void *ctx, uint8_t *buf, unsigned long n)
+{
+	struct ljbroker_client *client = ctx;
+	struct ljbroker_packet *p;
+	uint64_t deadline = 0;
+	unsigned spins = 0;
+	while (!(p = ring_peek(&client->slot->comp))) {
+		// spin briefly since the answer is usually close, then yield
+		if (++spins < 1000) continue;
+		if (!deadline) deadline = now_ns() + LJBROKER_TIMEOUT_NS;
+		else if (now_ns() > deadline) return 0;
+		sched_yield();
+	}
+	unsigned long n_rx = p->n < n ? p->n : n;
+	memcpy(buf, p->buf, n_rx);
+	ring_pop(&client->slot->comp);
+	return n_rx;
+}
+
+
+static void client_close(void *ctx)
+{
+	struct ljbroker_client *client = ctx;
+	atomic_store_explicit(&client->slot->state, LJBROKER_CLOSING,
+		memory_order_release
+	);
+	munmap(client->shm, sizeof(struct ljbroker_shm));
+	free(client);
+}
+
+
+static const struct ljud_transport client_transport = {
+	.name = "broker",
+	.write = client_write,
+	.read = client_read,
+	.close = client_close,
+};
+
+
+struct ljud_dev *ljbroker_connect(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct ljbroker_shm)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	struct ljbroker_shm *shm = mmap(NULL, sizeof(struct ljbroker_shm),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+	);
+	close(fd);
+	if (shm == MAP_FAILED) return NULL;
+	int err = 0;
+	if (shm->magic != LJBROKER_MAGIC || shm->version != LJBROKER_VERSION)
+		err = EPROTO;
+	else if (!pid_alive(atomic_load(&shm->broker_pid)))
+		err = ENOENT;
+	atomic_thread_fence(memory_order_acquire);
+
+	struct ljbroker_slot *slot = NULL;
+	for (unsigned s = 0; !err && s < LJBROKER_MAX_CLIENTS; s++) {
+		uint32_t state = LJBROKER_FREE;
+		if (atomic_compare_exchange_strong(&shm->slots[s].state,
+			&state, LJBROKER_ACTIVE
+		)) {
+			slot = &shm->slots[s];
+			atomic_store(&slot->pid, getpid());
+			break;
+		}
+	}
+	if (!err && !slot) err = EBUSY;
+
+	struct ljbroker_client *client = NULL;
+	struct ljud_dev *dev = NULL;
+	if (!err) {
+		client = malloc(sizeof(struct ljbroker_client));
+		if (client) {
+			client->shm = shm;
+			client->slot = slot;
+			dev = ljud_open(&client_transport, client,
+				shm->product_id
+			);
+		}
+		if (!dev) err = ENOMEM;
+	}
+	if (err) {
+		free(client);
+		if (slot) atomic_store(&slot->state, LJBROKER_CLOSING);
+		munmap(shm, sizeof(struct ljbroker_shm));
+		errno = err;
+		return NULL;
+	}
+	return dev;
+}
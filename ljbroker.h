@@ -0,0 +1,101 @@
+/** Sharing one U3 between processes. Only one process can hold a device open
+ * through liblabjackusb, so a broker process holds it instead and serves any
+ * number of clients through POSIX shared memory. Each client gets a slot with
+ * a single-producer single-consumer submission ring (client to broker) and a
+ * completion ring (broker to client), so neither side ever takes a lock.
+ *
+ * The broker sweeps all the slots, merges Feedback commands from different
+ * clients into shared Feedback packets where they fit, pipelines everything to
+ * the device, and hands each client back the response it would have got had
+ * it been talking to the device alone.
+ */
+#ifndef LJBROKER_H_
+#define LJBROKER_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "labjack_ud.h"
+
+#define LJBROKER_MAGIC 0x4C4A4252	// "LJBR"
+#define LJBROKER_VERSION 1
+#define LJBROKER_DEFAULT_NAME "/aylp_ljbroker"
+#define LJBROKER_MAX_CLIENTS 8
+#define LJBROKER_RING 64	// must be a power of 2
+
+/** Slot states. Clients move slots FREE -> ACTIVE -> CLOSING, and only the
+ * broker moves them back to FREE, so it never has a slot pulled out from
+ * under it while it has commands from that slot in flight.
+ */
+enum {
+	LJBROKER_FREE = 0,
+	LJBROKER_ACTIVE = 1,
+	LJBROKER_CLOSING = 2,
+};
+
+struct ljbroker_packet {
+	uint32_t n;
+	uint8_t buf[LJUD_PACKET_MAX];
+};
+
+/** SPSC ring. head is only written by the consumer and tail only by the
+ * producer; they get their own cache lines so the two sides don't fight.
+ */
+struct ljbroker_ring {
+	_Alignas(64) _Atomic uint32_t head;
+	_Alignas(64) _Atomic uint32_t tail;
+	_Alignas(64) struct ljbroker_packet packets[LJBROKER_RING];
+};
+
+struct ljbroker_slot {
+	_Atomic uint32_t state;
+	_Atomic int32_t pid;
+	struct ljbroker_ring sub;
+	struct ljbroker_ring comp;
+};
+
+struct ljbroker_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t product_id;
+	uint32_t serial_number;
+	_Atomic int32_t broker_pid;
+	/** Bumped every sweep, so clients can tell the broker is alive. */
+	_Atomic uint64_t heartbeat;
+	/** Client packets in, device packets out; the ratio is the payoff. */
+	_Atomic uint64_t n_client_packets;
+	_Atomic uint64_t n_device_packets;
+	_Atomic uint64_t n_dropped;
+	struct ljbroker_slot slots[LJBROKER_MAX_CLIENTS];
+};
+
+/** Broker-side state. */
+struct ljbroker {
+	struct ljbroker_shm *shm;
+	char *name;
+	struct ljud_dev *dev;
+	unsigned next_slot;	// for round-robin fairness between clients
+};
+
+/** Create the shared memory segment and take over dev. Any old segment with
+ * the same name is replaced. Returns 0 or negative error code.
+ */
+int ljbroker_create(struct ljbroker *broker, const char *name,
+	struct ljud_dev *dev
+);
+
+/** Serve every client's pending commands once. Returns the number of client
+ * packets handled, or negative error code if the device failed.
+ */
+int ljbroker_sweep(struct ljbroker *broker);
+
+/** Unlink the segment and close the device. */
+void ljbroker_destroy(struct ljbroker *broker);
+
+/** Connect to a running broker, claiming a client slot. Returns NULL and sets
+ * errno on failure: ENOENT if there's no broker, EBUSY if it's full.
+ */
+struct ljud_dev *ljbroker_connect(const char *name);
+
+#endif
@@ -0,0 +1,116 @@
+/** aylp_ljbroker: hold a U3 open and share it with other processes.
+ * See ljbroker.h for how it works.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "labjack_u3.h"
+#include "ljbroker.h"
+#include "ljsim.h"
+
+static volatile sig_atomic_t running = 1;
+
+
+static void stop(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-n name] [-d dev_num] [-s]\n"
+		"  -n name     shared memory name (default %s)\n"
+		"  -d dev_num  which U3 to open, starting at 1 (default 1)\n"
+		"  -s          serve a simulated U3 instead of real hardware\n",
+		argv0, LJBROKER_DEFAULT_NAME
+	);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *name = LJBROKER_DEFAULT_NAME;
+	unsigned dev_num = 1;
+	bool sim = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:sh")) != -1) {
+		switch (opt) {
+		case 'n': name = optarg; break;
+		case 'd': dev_num = strtoul(optarg, NULL, 0); break;
+		case 's': sim = true; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	struct ljud_dev *dev = sim
+		? ljsim_open(U3_PRODUCT_ID, NULL)
+		: ljud_open_usb(U3_PRODUCT_ID, dev_num);
+	if (!dev) {
+		fprintf(stderr, "couldn't open %s U3 %u: %s\n",
+			sim ? "simulated" : "USB", dev_num, strerror(errno)
+		);
+		return EXIT_FAILURE;
+	}
+	struct lju3_config_resp config;
+	int err = lju3_read_config(dev, &config);
+	if (err) {
+		fprintf(stderr, "lju3_read_config returned %d\n", err);
+		ljud_close(dev);
+		return EXIT_FAILURE;
+	}
+
+	struct ljbroker broker;
+	err = ljbroker_create(&broker, name, dev);
+	if (err) {
+		fprintf(stderr, "couldn't create %s: %s\n", name, strerror(-err));
+		ljud_close(dev);
+		return EXIT_FAILURE;
+	}
+	broker.shm->serial_number = config.serial_number;
+	fprintf(stderr, "serving U3 %u on %s\n",
+		(unsigned)config.serial_number, name
+	);
+
+	struct sigaction sa = {.sa_handler = stop};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// back off gradually when idle, so we're quick to answer a busy
+	// client but don't burn a core when nobody's around
+	unsigned idle = 0;
+	while (running) {
+		err = ljbroker_sweep(&broker);
+		if (err < 0) {
+			fprintf(stderr, "ljbroker_sweep returned %d: %s\n",
+				err, strerror(-err)
+			);
+		}
+		if (err) {
+			idle = 0;
+			continue;
+		}
+		if (++idle < 1000) continue;
+		unsigned us = idle < 2000 ? 10 : idle < 3000 ? 100 : 1000;
+		struct timespec ts = {.tv_nsec = us * 1000};
+		nanosleep(&ts, NULL);
+	}
+
+	fprintf(stderr, "%lu client packets in %lu device packets, "
+		"%lu responses dropped\n",
+		(unsigned long)broker.shm->n_client_packets,
+		(unsigned long)broker.shm->n_device_packets,
+		(unsigned long)broker.shm->n_dropped
+	);
+	ljbroker_destroy(&broker);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+/** ljbroker_test: run the broker against a simulated U3, with two clients in
+ * the same process, and check that their Feedback commands share a device
+ * packet and that a failed write comes back as failed reads.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "labjack_u3.h"
+#include "ljbroker.h"
+#include "ljsim.h"
+
+static int n_failed;
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #cond \
+		); \
+		n_failed += 1; \
+	} \
+} while (0)
+
+
+// Queue a Feedback command made of the IOTypes in cmd from a client.
+static void send_feedback(struct ljud_dev *dev, const uint8_t *cmd, unsigned n)
+{
+	uint8_t tx[LJUD_PACKET_MAX];
+	unsigned n_tx = lju3_pack_feedback(tx, cmd, n);
+	check(ljud_write(dev, tx, n_tx) == n_tx);
+}
+
+
+// Queue a read of n bytes of the LJTick's EEPROM from a client.
+static void send_eeprom_read(struct ljud_dev *dev, unsigned n)
+{
+	const struct ljud_i2c_slave eeprom = {
+		.sda_pin = LJU3_FIO5, .scl_pin = LJU3_FIO4, .address = 0xA0,
+	};
+	const uint8_t addr = 0x40;
+	uint8_t tx[LJUD_PACKET_MAX];
+	int n_tx = ljud_i2c_pack(tx, &eeprom, &addr, 1, n);
+	check(n_tx > 0);
+	check(ljud_write(dev, tx, n_tx) == (unsigned long)n_tx);
+}
+
+
+int main(void)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/aylp_ljbroker_test_%d", (int)getpid());
+	struct ljud_dev *dev = ljsim_open(U3_PRODUCT_ID, NULL);
+	if (!dev) {
+		perror("ljsim_open");
+		return EXIT_FAILURE;
+	}
+	struct ljsim *sim = ljsim_get(dev);
+	struct ljbroker broker;
+	int err = ljbroker_create(&broker, name, dev);
+	if (err) {
+		fprintf(stderr, "couldn't create %s: %s\n", name, strerror(-err));
+		ljud_close(dev);
+		return EXIT_FAILURE;
+	}
+	struct ljud_dev *a = ljbroker_connect(name);
+	struct ljud_dev *b = ljbroker_connect(name);
+	check(a && b);
+	if (!a || !b) goto out;
+
+	// a sets FIO7 high and reads it back, b reads the ports after it
+	const uint8_t cmd_a[] = {
+		BIT_DIR_WRITE, 0x80 | 7,
+		BIT_STATE_WRITE, 0x80 | 7,
+		BIT_STATE_READ, 7,
+	};
+	const uint8_t cmd_b[] = {PORT_STATE_READ};
+	send_feedback(a, cmd_a, sizeof(cmd_a));
+	send_feedback(b, cmd_b, sizeof(cmd_b));
+	check(ljbroker_sweep(&broker) == 2);
+	check(broker.shm->n_device_packets == 1);
+	check(sim->n_writes == 1);
+
+	uint8_t rx[LJUD_PACKET_MAX];
+	uint8_t resp[3];
+	unsigned n_rx = lju3_feedback_resp_len(1);
+	check(ljud_read(a, rx, sizeof(rx)) == n_rx);
+	check(!lju3_unpack_feedback(rx, resp, 1));
+	check(resp[0] == 1);
+	n_rx = lju3_feedback_resp_len(3);
+	check(ljud_read(b, rx, sizeof(rx)) == n_rx);
+	check(!lju3_unpack_feedback(rx, resp, 3));
+	check(resp[0] & 1 << 7);
+
+	// Three device packets this time, since I2C doesn't merge. The second
+	// write fails, so exactly one client packet gets its response and the
+	// other two come back empty, and nothing's left on the device.
+	send_feedback(a, cmd_b, sizeof(cmd_b));
+	send_eeprom_read(b, 4);
+	send_eeprom_read(b, 4);
+	sim->fail_write_at = sim->n_writes + 2;
+	check(ljbroker_sweep(&broker) == -ECOMM);
+	check(sim->head == sim->tail);
+	unsigned n_good = 0, n_empty = 0;
+	unsigned long n;
+	n = ljud_read(a, rx, sizeof(rx));
+	n_good += n == lju3_feedback_resp_len(3);
+	n_empty += !n;
+	for (unsigned i = 0; i < 2; i++) {
+		n = ljud_read(b, rx, sizeof(rx));
+		n_good += n == LJUD_I2C_RX(4);
+		n_empty += !n;
+	}
+	check(n_good == 1);
+	check(n_empty == 2);
+
+	// and the broker carries on after that
+	send_feedback(a, cmd_a, sizeof(cmd_a));
+	check(ljbroker_sweep(&broker) == 1);
+	check(ljud_read(a, rx, sizeof(rx)) == lju3_feedback_resp_len(1));
+
+out:
+	if (a) ljud_close(a);
+	if (b) ljud_close(b);
+	ljbroker_destroy(&broker);
+	if (n_failed) {
+		fprintf(stderr, "%d checks failed\n", n_failed);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
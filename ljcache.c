@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ljcache.h"
+
+
+char *ljcache_default_dir(void)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *suffix = "/aylp_labjack";
+	if (!base || !*base) {
+		base = getenv("HOME");
+		if (!base || !*base) return NULL;
+		suffix = "/.cache/aylp_labjack";
+	}
+	size_t n = strlen(base) + strlen(suffix) + 1;
+	char *dir = malloc(n);
+	if (!dir) return NULL;
+	snprintf(dir, n, "%s%s", base, suffix);
+	return dir;
+}
+
+
+// mkdir -p
+static int make_dirs(const char *dir)
+{
+	char path[4096];
+	if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path))
+		return -ENAMETOOLONG;
+	for (char *p = path + 1; *p; p++) {
+		if (*p != '/') continue;
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) return -errno;
+		*p = '/';
+	}
+	if (mkdir(path, 0755) && errno != EEXIST) return -errno;
+	return 0;
+}
+
+
+int ljcache_load(const char *dir, uint32_t serial_number, struct ljcache *cache)
+{
+	char path[4096];
+	if (snprintf(path, sizeof(path), "%s/%u.bin", dir, serial_number)
+		>= (int)sizeof(path)
+	) {
+		return -ENAMETOOLONG;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -errno;
+	ssize_t n = read(fd, cache, sizeof(struct ljcache));
+	int err = n < 0 ? -errno : 0;
+	close(fd);
+	if (err) return err;
+	if (
+		n != sizeof(struct ljcache)
+		|| cache->magic != LJCACHE_MAGIC
+		|| cache->version != LJCACHE_VERSION
+		|| cache->serial_number != serial_number
+	) {
+		return -EBADMSG;
+	}
+	return 0;
+}
+
+
+int ljcache_save(const char *dir, struct ljcache *cache)
+{
+	int err;
+	char path[4096];
+	char tmp[4096 + 8];
+	cache->magic = LJCACHE_MAGIC;
+	cache->version = LJCACHE_VERSION;
+	err = make_dirs(dir);
+	if (err) return err;
+	if (snprintf(path, sizeof(path), "%s/%u.bin", dir,
+		cache->serial_number) >= (int)sizeof(path)
+	) {
+		return -ENAMETOOLONG;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return -errno;
+	ssize_t n = write(fd, cache, sizeof(struct ljcache));
+	err = n < 0 ? -errno : n != sizeof(struct ljcache) ? -EIO : 0;
+	if (close(fd) && !err) err = -errno;
+	if (!err && rename(tmp, path)) err = -errno;
+	if (err) unlink(tmp);
+	return err;
+}
@@ -0,0 +1,47 @@
+/** On-disk cache of per-device calibration and configuration.
+ * Keyed by U3 serial number, so a restart can skip reading back things that
+ * haven't changed since last time.
+ */
+#ifndef LJCACHE_H_
+#define LJCACHE_H_
+
+#include <stdint.h>
+#include "ljtdac.h"
+
+#define LJCACHE_MAGIC 0x4C4A4341	// "LJCA"
+#define LJCACHE_VERSION 1
+
+struct ljcache {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t serial_number;	// of the U3
+	// where the LJTick-DAC was when we read its calibration
+	uint8_t sda_pin;
+	uint8_t scl_pin;
+	struct ljtdac_cal_mem cal_mem;
+	// the timer and counter setup we last wrote
+	uint8_t timer_counter_config;
+	uint8_t clock_config;
+	uint8_t clock_divisor;
+	uint8_t n_timers;
+	uint8_t timer_modes[2];
+	uint16_t timer_values[2];
+}__attribute__((packed));
+
+/** Get the default cache directory ($XDG_CACHE_HOME/aylp_labjack, falling back
+ * to ~/.cache/aylp_labjack). Returns a malloc'd string, or NULL.
+ */
+char *ljcache_default_dir(void);
+
+/** Load the cache entry for the device with this serial number. Returns 0, or
+ * -ENOENT if there's no entry, -EBADMSG if it's stale or corrupt, or another
+ * negative errno.
+ */
+int ljcache_load(const char *dir, uint32_t serial_number, struct ljcache *cache);
+
+/** Save a cache entry, creating the directory if needed. The file is replaced
+ * atomically, so a crash can't leave a half-written entry behind.
+ */
+int ljcache_save(const char *dir, struct ljcache *cache);
+
+#endif
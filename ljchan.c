@@ -0,0 +1,162 @@
+#include <math.h>
+#include <strings.h>
+
+#include "ljchan.h"
+
+
+static const char *const output_names[LJCHAN_N_OUTPUTS] = {
+	[LJCHAN_DACA] = "DACA",
+	[LJCHAN_DACB] = "DACB",
+	[LJCHAN_PWM0] = "PWM0",
+	[LJCHAN_PWM1] = "PWM1",
+	[LJCHAN_DIO0 + 0x00] = "FIO0", [LJCHAN_DIO0 + 0x01] = "FIO1",
+	[LJCHAN_DIO0 + 0x02] = "FIO2", [LJCHAN_DIO0 + 0x03] = "FIO3",
+	[LJCHAN_DIO0 + 0x04] = "FIO4", [LJCHAN_DIO0 + 0x05] = "FIO5",
+	[LJCHAN_DIO0 + 0x06] = "FIO6", [LJCHAN_DIO0 + 0x07] = "FIO7",
+	[LJCHAN_DIO0 + 0x08] = "EIO0", [LJCHAN_DIO0 + 0x09] = "EIO1",
+	[LJCHAN_DIO0 + 0x0A] = "EIO2", [LJCHAN_DIO0 + 0x0B] = "EIO3",
+	[LJCHAN_DIO0 + 0x0C] = "EIO4", [LJCHAN_DIO0 + 0x0D] = "EIO5",
+	[LJCHAN_DIO0 + 0x0E] = "EIO6", [LJCHAN_DIO0 + 0x0F] = "EIO7",
+	[LJCHAN_DIO0 + 0x10] = "CIO0", [LJCHAN_DIO0 + 0x11] = "CIO1",
+	[LJCHAN_DIO0 + 0x12] = "CIO2", [LJCHAN_DIO0 + 0x13] = "CIO3",
+	[LJCHAN_DIO0 + 0x14] = "CIO4", [LJCHAN_DIO0 + 0x15] = "CIO5",
+	[LJCHAN_DIO0 + 0x16] = "CIO6", [LJCHAN_DIO0 + 0x17] = "CIO7",
+	[LJCHAN_SPI0 + 0] = "SPI0", [LJCHAN_SPI0 + 1] = "SPI1",
+	[LJCHAN_SPI0 + 2] = "SPI2", [LJCHAN_SPI0 + 3] = "SPI3",
+	[LJCHAN_SPI0 + 4] = "SPI4", [LJCHAN_SPI0 + 5] = "SPI5",
+	[LJCHAN_SPI0 + 6] = "SPI6", [LJCHAN_SPI0 + 7] = "SPI7",
+};
+
+
+int ljchan_output_from_name(const char *name)
+{
+	for (int i = 0; i < LJCHAN_N_OUTPUTS; i++) {
+		if (!strcasecmp(name, output_names[i])) return i;
+	}
+	return -1;
+}
+
+
+const char *ljchan_output_name(ljchan_output output)
+{
+	if (output >= LJCHAN_N_OUTPUTS) return "?";
+	return output_names[output];
+}
+
+
+int ljchan_add(struct ljchan_map *map, size_t index, ljchan_output output,
+	double scale, double offset, double min, double max, int round,
+	double cal_gain, double cal_offset, double code_min, double code_max
+) {
+	if (map->n >= LJCHAN_MAX) return -1;
+	size_t i = map->n++;
+	map->index[i] = index;
+	map->output[i] = output;
+	// fold the user's scale and offset into the calibration
+	map->gain[i] = scale * cal_gain;
+	map->offset[i] = offset * cal_gain + cal_offset;
+	// the voltage clamp becomes a code clamp, flipped if the gain is
+	double lo = min * cal_gain + cal_offset;
+	double hi = max * cal_gain + cal_offset;
+	if (lo > hi) {
+		double tmp = lo;
+		lo = hi;
+		hi = tmp;
+	}
+	// keep the bounds whole codes, so rounding can't push us past them
+	if (code_min < 0.0) code_min = 0.0;
+	if (code_max > 0xFFFF) code_max = 0xFFFF;
+	map->lo[i] = fmax(ceil(lo), code_min);
+	map->hi[i] = fmin(floor(hi), code_max);
+	if (!(map->lo[i] <= map->hi[i])) map->hi[i] = map->lo[i];
+	map->round[i] = round ? 0.5 : 0.0;
+	map->period_ns[i] = 0;
+	map->priority[i] = 0;
+	map->next_ns[i] = 0;
+	map->deferred[i] = 0;
+	return i;
+}
+
+
+void ljchan_set_rate(struct ljchan_map *map, size_t i,
+	uint64_t period_ns, int priority
+) {
+	map->period_ns[i] = period_ns;
+	map->priority[i] = priority;
+}
+
+
+unsigned ljchan_schedule(struct ljchan_map *map, uint64_t now,
+	const double *cost, double budget, bool *due
+) {
+	size_t order[LJCHAN_MAX];
+	unsigned n_due = 0;
+	for (size_t i = 0; i < map->n; i++) {
+		due[i] = now >= map->next_ns[i];
+		if (!due[i]) continue;
+		// insertion sort by priority, aged by how long it's waited;
+		// there are only ever a few channels
+		long p = (long)map->priority[i] + map->deferred[i];
+		unsigned k = n_due++;
+		while (k && (long)map->priority[order[k - 1]]
+			+ map->deferred[order[k - 1]] < p
+		) {
+			order[k] = order[k - 1];
+			k -= 1;
+		}
+		order[k] = i;
+	}
+	if (!budget) return n_due;
+
+	double spent = 0.0;
+	unsigned n_taken = 0;
+	for (unsigned k = 0; k < n_due; k++) {
+		size_t i = order[k];
+		if (!n_taken || spent + cost[i] <= budget) {
+			spent += cost[i];
+			n_taken += 1;
+		} else {
+			due[i] = false;
+			map->deferred[i] += 1;
+			map->n_deferred += 1;
+		}
+	}
+	return n_taken;
+}
+
+
+void ljchan_written(struct ljchan_map *map, const bool *due, uint64_t now)
+{
+	for (size_t i = 0; i < map->n; i++) {
+		if (!due[i]) continue;
+		map->next_ns[i] = now + map->period_ns[i];
+		map->deferred[i] = 0;
+	}
+}
+
+
+double ljchan_value(const struct ljchan_map *map, size_t i, uint16_t code)
+{
+	if (map->output[i] >= LJCHAN_DIO0 && map->output[i] < LJCHAN_SPI0)
+		return code;
+	return (code - map->offset[i]) / map->gain[i];
+}
+
+
+void ljchan_codes(const struct ljchan_map *map,
+	const double *restrict in, uint16_t *restrict codes
+) {
+	const double *restrict gain = map->gain;
+	const double *restrict offset = map->offset;
+	const double *restrict lo = map->lo;
+	const double *restrict hi = map->hi;
+	const double *restrict round = map->round;
+	// written with compares rather than fmin/fmax/floor so gcc vectorizes
+	// it at the baseline ISA; lo >= 0 so truncating is the same as floor
+	for (size_t i = 0; i < map->n; i++) {
+		double x = in[i] * gain[i] + offset[i];
+		x = x > lo[i] ? x : lo[i];	// NaN compares false, so -> lo
+		x = x < hi[i] ? x : hi[i];
+		codes[i] = (int32_t)(x + round[i]);
+	}
+}
@@ -0,0 +1,103 @@
+/** Mapping from state vector elements to output channels.
+ * Each channel has its own scale, offset, clamp and rounding, which get folded
+ * together with the device calibration at init into one gain, offset and code
+ * range, so the per-loop conversion is a single branch-free pass. Each channel
+ * also has an update period and a priority, for writing slow channels less
+ * often and holding back unimportant ones when the bus is busy.
+ */
+#ifndef LJCHAN_H_
+#define LJCHAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Most channels one map can hold. */
+#define LJCHAN_MAX 64
+
+typedef uint8_t ljchan_output;
+enum {
+	LJCHAN_DACA,
+	LJCHAN_DACB,
+	LJCHAN_PWM0,
+	LJCHAN_PWM1,
+	// digital outputs, one per pin from FIO0 to CIO7, numbered the same way
+	// as the LJU3_ pins after this
+	LJCHAN_DIO0,
+	// channels of a DAC on the SPI bus
+	LJCHAN_SPI0 = LJCHAN_DIO0 + 24,
+	LJCHAN_N_OUTPUTS = LJCHAN_SPI0 + 8,
+};
+
+// struct-of-arrays so that ljchan_codes vectorizes
+struct ljchan_map {
+	size_t n;
+	size_t index[LJCHAN_MAX];	// state vector element to read
+	ljchan_output output[LJCHAN_MAX];
+	double gain[LJCHAN_MAX];	// volts to codes, calibration included
+	double offset[LJCHAN_MAX];
+	double lo[LJCHAN_MAX];		// clamp, in codes
+	double hi[LJCHAN_MAX];
+	double round[LJCHAN_MAX];	// 0.5 to round, 0.0 to truncate
+
+	// scheduling
+	uint64_t period_ns[LJCHAN_MAX];	// 0 to write every time
+	int priority[LJCHAN_MAX];	// higher goes first
+	uint64_t next_ns[LJCHAN_MAX];	// when the channel is next due
+	unsigned deferred[LJCHAN_MAX];	// times held back since last written
+	uint64_t n_deferred;		// times any channel was held back
+};
+
+/** Parse an output name like "DACA" or "PWM1". Returns the output, or -1. */
+int ljchan_output_from_name(const char *name);
+
+/** Name of an output, for logging. */
+const char *ljchan_output_name(ljchan_output output);
+
+/** Add a channel reading element index, converting a value v to the code
+ * round(clamp((v * scale + offset) * cal_gain + cal_offset)), where the clamp
+ * is to [min, max] in volts and then to [code_min, code_max] (code_min is at
+ * least 0, and code_max at most 0xFFFF). Returns the
+ * channel number, or -1 if the map is full.
+ */
+int ljchan_add(struct ljchan_map *map, size_t index, ljchan_output output,
+	double scale, double offset, double min, double max, int round,
+	double cal_gain, double cal_offset, double code_min, double code_max
+);
+
+/** Set how often channel i should be written (0 for every time), and its
+ * priority. Channels start out written every time, at priority 0.
+ */
+void ljchan_set_rate(struct ljchan_map *map, size_t i,
+	uint64_t period_ns, int priority
+);
+
+/** Work out which channels to write at time now (in ns), setting due[i] for
+ * each. A channel is due once its period has passed since it was last
+ * written. If budget is nonzero, due channels are taken in priority order for
+ * as long as their cost[] adds up to no more than budget (the first is always
+ * taken), and the rest are held back. Each time a channel is held back its
+ * priority goes up by one until it's written, so nothing waits forever.
+ * Returns the number of channels to write.
+ */
+unsigned ljchan_schedule(struct ljchan_map *map, uint64_t now,
+	const double *cost, double budget, bool *due
+);
+
+/** Record that the due channels were written at time now. */
+void ljchan_written(struct ljchan_map *map, const bool *due, uint64_t now);
+
+/** The value channel i's code stands for, in state vector units. This undoes
+ * ljchan_codes, short of the clamping and rounding. Digital outputs just give
+ * their code, 0 or 1.
+ */
+double ljchan_value(const struct ljchan_map *map, size_t i, uint16_t code);
+
+/** Convert one value per channel (in channel order) into codes. NaNs end up
+ * at the bottom of the channel's code range.
+ */
+void ljchan_codes(const struct ljchan_map *map,
+	const double *restrict in, uint16_t *restrict codes
+);
+
+#endif
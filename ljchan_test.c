@@ -0,0 +1,144 @@
+/** ljchan_test: check the channel map's conversion from values to codes
+ * (clamping, rounding, NaNs) and its budgeted scheduling, without a device.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ljchan.h"
+
+static int n_failed;
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #cond \
+		); \
+		n_failed += 1; \
+	} \
+} while (0)
+
+
+// A gain that's a power of two keeps the codes below exact, so the rounding
+// checks land exactly on the half-code threshold rather than either side.
+#define GAIN 1024.0
+#define OFFSET 5000.0
+
+
+static void check_codes(void)
+{
+	struct ljchan_map map = {0};
+	// 0: -1 V to 2 V, rounding
+	check(ljchan_add(&map, 0, LJCHAN_DACA, 1.0, 0.0, -1.0, 2.0, 1,
+		GAIN, OFFSET, 0.0, 0xFFFF
+	) == 0);
+	// 1: same but truncating
+	check(ljchan_add(&map, 1, LJCHAN_DACB, 1.0, 0.0, -1.0, 2.0, 0,
+		GAIN, OFFSET, 0.0, 0xFFFF
+	) == 1);
+	// 2: a voltage range wider than the codes, and a negative gain
+	check(ljchan_add(&map, 2, LJCHAN_SPI0, 1.0, 0.0, -100.0, 100.0, 1,
+		-GAIN, OFFSET, 0.0, 0xFFF
+	) == 2);
+	check(map.lo[0] == OFFSET - GAIN && map.hi[0] == OFFSET + 2 * GAIN);
+	check(map.lo[2] == 0.0 && map.hi[2] == 0xFFF);
+
+	double in[3];
+	uint16_t codes[3];
+
+	// clamped at lo and hi, in volts and in codes
+	in[0] = in[1] = -5.0;
+	in[2] = 100.0;
+	ljchan_codes(&map, in, codes);
+	check(codes[0] == OFFSET - GAIN);
+	check(codes[1] == OFFSET - GAIN);
+	check(codes[2] == 0);
+	in[0] = in[1] = 5.0;
+	in[2] = -100.0;
+	ljchan_codes(&map, in, codes);
+	check(codes[0] == OFFSET + 2 * GAIN);
+	check(codes[1] == OFFSET + 2 * GAIN);
+	check(codes[2] == 0xFFF);
+
+	// a quarter code either side of a half, and right on it
+	in[2] = 0.0;
+	in[0] = in[1] = 1.25 / GAIN;
+	ljchan_codes(&map, in, codes);
+	check(codes[0] == OFFSET + 1 && codes[1] == OFFSET + 1);
+	in[0] = in[1] = 1.75 / GAIN;
+	ljchan_codes(&map, in, codes);
+	check(codes[0] == OFFSET + 2 && codes[1] == OFFSET + 1);
+	in[0] = in[1] = 1.5 / GAIN;
+	ljchan_codes(&map, in, codes);
+	check(codes[0] == OFFSET + 2 && codes[1] == OFFSET + 1);
+	check(ljchan_value(&map, 0, OFFSET + 2) == 2.0 / GAIN);
+
+	// NaN goes to the bottom of the range, whichever way the gain goes
+	in[0] = in[1] = in[2] = NAN;
+	ljchan_codes(&map, in, codes);
+	check(codes[0] == OFFSET - GAIN);
+	check(codes[1] == OFFSET - GAIN);
+	check(codes[2] == 0);
+}
+
+
+static void check_schedule(void)
+{
+	struct ljchan_map map = {0};
+	for (int i = 0; i < 3; i++) {
+		check(ljchan_add(&map, i, LJCHAN_SPI0 + i, 1.0, 0.0, 0.0, 1.0, 1,
+			1.0, 0.0, 0.0, 0xFFFF
+		) == i);
+	}
+	// channel 2 goes first, then 1, and 0 only has room when it's waited
+	ljchan_set_rate(&map, 1, 0, 1);
+	ljchan_set_rate(&map, 2, 0, 2);
+	const double cost[3] = {1.0, 1.0, 1.0};
+	bool due[3];
+
+	// no budget: everything due goes
+	check(ljchan_schedule(&map, 0, cost, 0.0, due) == 3);
+	check(due[0] && due[1] && due[2]);
+	ljchan_written(&map, due, 0);
+
+	// room for two: 0 is held back
+	check(ljchan_schedule(&map, 10, cost, 2.0, due) == 2);
+	check(!due[0] && due[1] && due[2]);
+	check(map.deferred[0] == 1);
+	check(map.n_deferred == 1);
+	ljchan_written(&map, due, 10);
+
+	// and having waited, it goes next time, ahead of 1
+	check(ljchan_schedule(&map, 20, cost, 2.0, due) == 2);
+	check(due[0] && !due[1] && due[2]);
+	check(map.deferred[1] == 1);
+	ljchan_written(&map, due, 20);
+	check(map.deferred[0] == 0);
+
+	// the first is taken even when it alone is over budget, and that's 1
+	// now, having waited its way level with 2
+	check(ljchan_schedule(&map, 30, cost, 0.5, due) == 1);
+	check(due[1] && !due[0] && !due[2]);
+	ljchan_written(&map, due, 30);
+
+	// a channel with a period isn't due again until it's up
+	ljchan_set_rate(&map, 0, 1000, 0);
+	bool all[3] = {true, true, true};
+	ljchan_written(&map, all, 100);
+	check(ljchan_schedule(&map, 1099, cost, 0.0, due) == 2);
+	check(!due[0]);
+	check(ljchan_schedule(&map, 1100, cost, 0.0, due) == 3);
+	check(due[0]);
+}
+
+
+int main(void)
+{
+	check_codes();
+	check_schedule();
+	if (n_failed) {
+		fprintf(stderr, "%d checks failed\n", n_failed);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
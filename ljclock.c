@@ -0,0 +1,97 @@
+#include <math.h>
+#include <string.h>
+
+#include "ljclock.h"
+
+// don't let the narrowest windows drown everything else out
+#define MIN_HALF_WINDOW_NS 1000.0
+
+
+void ljclock_init(struct ljclock *c, double hz)
+{
+	memset(c, 0, sizeof(struct ljclock));
+	c->tick_ns = 1e9 / hz;
+}
+
+
+// Device ns per ns of ours, from the fit if there's enough to go on.
+static double rate(const struct ljclock *c)
+{
+	if (c->n_samples < 2 || !(c->c_hh > 0)) return 1.0;
+	return c->c_hd / c->c_hh;
+}
+
+
+// Unwrap a 32-bit reading into device ns, taking the nearest one to guess.
+static double unwrap(const struct ljclock *c, uint32_t ticks, double guess)
+{
+	double wrap = 4294967296.0 * c->tick_ns;
+	double d = ticks * c->tick_ns;
+	return d + wrap * round((guess - d) / wrap);
+}
+
+
+void ljclock_sample(struct ljclock *c, uint32_t ticks, uint64_t t0, uint64_t t1)
+{
+	if (t1 < t0) return;
+	if (!c->n_samples) c->h0 = t0 + (t1 - t0) / 2;
+	double h = (double)t0 - c->h0 + (t1 - t0) / 2.0;
+	double half = (t1 - t0) / 2.0;
+	if (half < MIN_HALF_WINDOW_NS) half = MIN_HALF_WINDOW_NS;
+	double d;
+	if (!c->n_samples) {
+		d = ticks * c->tick_ns;
+	} else {
+		d = unwrap(c, ticks,
+			c->last_d + (h - c->last_h) * rate(c)
+		);
+	}
+
+	// fade what we have, then add this one in (West's weighted update)
+	double fade = c->n_samples ? exp(-(h - c->last_h) / LJCLOCK_TAU_NS) : 0;
+	if (fade > 1.0) fade = 1.0;
+	double w = 1.0 / (half * half);
+	c->w = c->w * fade + w;
+	c->c_hh *= fade;
+	c->c_hd *= fade;
+	c->c_dd *= fade;
+	double dh = h - c->mean_h;
+	double dd = d - c->mean_d;
+	c->mean_h += w / c->w * dh;
+	c->mean_d += w / c->w * dd;
+	c->c_hh += w * dh * (h - c->mean_h);
+	c->c_hd += w * dh * (d - c->mean_d);
+	c->c_dd += w * dd * (d - c->mean_d);
+
+	c->last_h = h;
+	c->last_d = d;
+	c->n_samples += 1;
+}
+
+
+uint64_t ljclock_to_host(const struct ljclock *c, uint32_t ticks)
+{
+	if (!c->n_samples) return 0;
+	double r = rate(c);
+	double d = unwrap(c, ticks, c->last_d);
+	double h = c->mean_h + (d - c->mean_d) / r;
+	if (h < -(double)c->h0) return 0;
+	return c->h0 + (int64_t)llround(h);
+}
+
+
+double ljclock_drift_ppm(const struct ljclock *c)
+{
+	if (c->n_samples < 2 || !(c->c_hh > 0)) return 0.0;
+	return (rate(c) - 1.0) * 1e6;
+}
+
+
+double ljclock_rms_ns(const struct ljclock *c)
+{
+	if (c->n_samples < 3 || !(c->c_hh > 0) || !(c->w > 0)) return NAN;
+	double r = rate(c);
+	// residual variance in device time, over the rate squared for ours
+	double var = (c->c_dd - c->c_hd * c->c_hd / c->c_hh) / c->w;
+	return var > 0 ? sqrt(var) / r : 0.0;
+}
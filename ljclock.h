@@ -0,0 +1,64 @@
+/** Correlating our clock with a device's free-running clock.
+ * A timestamp taken around a USB write says little about when the device
+ * actually did anything, since the packet can sit in queues on either side.
+ * A device clock reading taken by a command does: it says when that command
+ * ran, in device time. To turn that into our time, this keeps a running
+ * estimate of the device clock's offset and rate against CLOCK_MONOTONIC.
+ *
+ * Each reading comes with the window it must have been taken in: from when
+ * its packet started going out to when its response was back. The fit takes
+ * the middle of the window as when the reading was taken, weights it by how
+ * narrow the window was, and fades older readings out over LJCLOCK_TAU_NS of
+ * our time, so it follows the rate as it wanders with temperature.
+ */
+#ifndef LJCLOCK_H_
+#define LJCLOCK_H_
+
+#include <stdint.h>
+
+/** How long it takes for old readings to fade to 1/e of their weight. */
+#define LJCLOCK_TAU_NS 60e9
+
+struct ljclock {
+	double tick_ns;		// device clock period
+	uint64_t n_samples;
+
+	// exponentially weighted means and co-moments, with our times and
+	// device times in ns relative to the first reading
+	uint64_t h0;		// our time of the first reading
+	double w;		// total weight
+	double mean_h;
+	double mean_d;
+	double c_hh;
+	double c_hd;
+	double c_dd;
+
+	// the newest reading, for unwrapping the next one
+	double last_h;
+	double last_d;
+};
+
+/** Start over, with a device clock running at hz. */
+void ljclock_init(struct ljclock *c, double hz);
+
+/** Fold in a reading of the low 32 bits of the device clock, taken by a
+ * command whose packet started going out at t0 and whose response was back
+ * by t1 (CLOCK_MONOTONIC ns).
+ */
+void ljclock_sample(struct ljclock *c, uint32_t ticks, uint64_t t0, uint64_t t1);
+
+/** When a reading of the low 32 bits of the device clock was taken, in
+ * CLOCK_MONOTONIC ns. Readings are unwrapped against the newest one, so they
+ * should be from within half a wrap of it. Returns 0 before any readings.
+ */
+uint64_t ljclock_to_host(const struct ljclock *c, uint32_t ticks);
+
+/** How fast the device clock runs against ours, in parts per million, or 0
+ * until there's enough to tell.
+ */
+double ljclock_drift_ppm(const struct ljclock *c);
+
+/** Weighted RMS distance of readings from the fit, in ns of our time. */
+double ljclock_rms_ns(const struct ljclock *c);
+
+#endif
@@ -0,0 +1,72 @@
+/** ljclock_test: feed the device clock fit readings from a made-up clock that
+ * runs fast and wraps partway through, and check that it gets the rate and
+ * maps readings from either side of the wrap back to our time.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ljclock.h"
+
+static int n_failed;
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #cond \
+		); \
+		n_failed += 1; \
+	} \
+} while (0)
+
+// a U3's system timer, running 50 ppm fast and a second short of wrapping
+#define HZ 4e6
+#define PPM 50.0
+#define WRAP 4294967296.0
+#define T0 1000000000000ULL
+
+// what the made-up device clock reads at our time t
+static uint32_t ticks_at(uint64_t t)
+{
+	double d = (t - T0) * (1 + PPM * 1e-6) * HZ / 1e9 + (WRAP - HZ);
+	return (uint64_t)d % (1ULL << 32);
+}
+
+
+int main(void)
+{
+	struct ljclock c;
+	ljclock_init(&c, HZ);
+	check(ljclock_to_host(&c, 1234) == 0);
+	check(ljclock_drift_ppm(&c) == 0.0);
+
+	// 3 s of readings every 10 ms, taken in the middle of windows from
+	// 100 to 500 us wide, across the wrap at about 1 s
+	uint64_t t;
+	for (unsigned i = 0; i < 300; i++) {
+		t = T0 + i * 10000000ULL;
+		uint64_t half = 50000 + 200000 * (i % 3);
+		ljclock_sample(&c, ticks_at(t), t - half, t + half);
+	}
+	check(c.n_samples == 300);
+	check(fabs(ljclock_drift_ppm(&c) - PPM) < 0.1);
+	check(ljclock_rms_ns(&c) < 100.0);
+
+	// after the wrap, and from before it, which is within half a wrap
+	uint64_t t_after = T0 + 2500000000ULL;
+	uint64_t t_before = T0 + 500000000ULL;
+	check(ticks_at(t_after) < ticks_at(t_before));
+	check(llabs((long long)(ljclock_to_host(&c, ticks_at(t_after))
+		- t_after)) < 1000);
+	check(llabs((long long)(ljclock_to_host(&c, ticks_at(t_before))
+		- t_before)) < 1000);
+	// and a little past the newest reading
+	check(llabs((long long)(ljclock_to_host(&c, ticks_at(t + 5000000))
+		- (t + 5000000))) < 1000);
+
+	if (n_failed) {
+		fprintf(stderr, "%d checks failed\n", n_failed);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,479 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <libusb.h>
+
+#include "ljdisc.h"
+#include "ljprobe.h"
+
+#define TIMEOUT_MS 1000	// same as liblabjackusb
+
+
+struct entry {
+	uint32_t serial;	// 0 for an empty slot
+	unsigned long product_id;
+	libusb_device *dev;	// we hold a reference
+	bool open;
+};
+
+struct event {
+	libusb_device *dev;	// we hold a reference
+	bool arrived;		// or left
+};
+
+static struct {
+	// refs, and starting and stopping discovery
+	pthread_mutex_t life_lock;
+	unsigned refs;
+	libusb_context *usb;
+	libusb_hotplug_callback_handle cb;
+	pthread_t thread;
+	atomic_bool stop;
+
+	// the map, an open addressing hash table keyed by serial number
+	pthread_mutex_t lock;
+	struct entry map[LJDISC_MAX];
+	size_t n;
+
+	// events the hotplug callback has queued for us
+	pthread_mutex_t pending_lock;
+	struct event *pending;
+	size_t n_pending;
+	size_t cap_pending;
+} disc = {
+	.life_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.pending_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static int usb_err(int err)
+{
+	switch (err) {
+	case LIBUSB_SUCCESS: return 0;
+	case LIBUSB_ERROR_INVALID_PARAM: return -EINVAL;
+	case LIBUSB_ERROR_ACCESS: return -EACCES;
+	case LIBUSB_ERROR_NO_DEVICE: return -ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND: return -ENOENT;
+	case LIBUSB_ERROR_BUSY: return -EBUSY;
+	case LIBUSB_ERROR_TIMEOUT: return -ETIMEDOUT;
+	case LIBUSB_ERROR_OVERFLOW: return -EOVERFLOW;
+	case LIBUSB_ERROR_PIPE: return -EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED: return -EINTR;
+	case LIBUSB_ERROR_NO_MEM: return -ENOMEM;
+	case LIBUSB_ERROR_NOT_SUPPORTED: return -ENOTSUP;
+	default: return -EIO;
+	}
+}
+
+
+static size_t home(uint32_t serial)
+{
+	serial ^= serial >> 16;
+	serial *= 0x45D9F3B;
+	serial ^= serial >> 16;
+	return serial & (LJDISC_MAX - 1);
+}
+
+
+// All of the map functions need disc.lock.
+
+static int find(uint32_t serial)
+{
+	for (size_t i = home(serial); disc.map[i].serial;
+		i = (i + 1) & (LJDISC_MAX - 1)
+	) {
+		if (disc.map[i].serial == serial) return i;
+	}
+	return -1;
+}
+
+
+// The lowest serial with this product ID, preferring ones that aren't open.
+static int find_any(unsigned long product_id)
+{
+	int best = -1;
+	for (size_t i = 0; i < LJDISC_MAX; i++) {
+		const struct entry *e = &disc.map[i];
+		if (!e->serial || e->product_id != product_id) continue;
+		if (best < 0) {
+			best = i;
+			continue;
+		}
+		const struct entry *b = &disc.map[best];
+		if (e->open != b->open ? !e->open : e->serial < b->serial)
+			best = i;
+	}
+	return best;
+}
+
+
+static void remove_at(size_t i)
+{
+	libusb_unref_device(disc.map[i].dev);
+	disc.map[i].serial = 0;
+	disc.n -= 1;
+	// pull later entries in the same run back into the hole, unless that
+	// would put them before their home slot
+	for (size_t j = (i + 1) & (LJDISC_MAX - 1); disc.map[j].serial;
+		j = (j + 1) & (LJDISC_MAX - 1)
+	) {
+		size_t k = home(disc.map[j].serial);
+		if (i <= j ? i < k && k <= j : i < k || k <= j) continue;
+		disc.map[i] = disc.map[j];
+		disc.map[j].serial = 0;
+		i = j;
+	}
+}
+
+
+// The serial number from the device's string descriptor, or 0.
+static uint32_t read_serial(libusb_device *dev, uint8_t index)
+{
+	libusb_device_handle *h;
+	unsigned char buf[32];
+	if (!index || libusb_open(dev, &h)) return 0;
+	int n = libusb_get_string_descriptor_ascii(h, index, buf, sizeof(buf));
+	libusb_close(h);
+	if (n <= 0 || n >= (int)sizeof(buf)) return 0;
+	buf[n] = '\0';
+	char *end;
+	unsigned long serial = strtoul((char *)buf, &end, 10);
+	if (*end || serial > UINT32_MAX) return 0;
+	return serial;
+}
+
+
+static void arrived(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(dev, &desc)) return;
+	uint32_t serial = read_serial(dev, desc.iSerialNumber);
+	if (!serial) return;
+	int i = find(serial);
+	if (i >= 0) {
+		// came back before we heard it leave
+		libusb_unref_device(disc.map[i].dev);
+	} else {
+		// keep a slot free so lookups always end
+		if (disc.n >= LJDISC_MAX - 1) return;
+		i = home(serial);
+		while (disc.map[i].serial) i = (i + 1) & (LJDISC_MAX - 1);
+		disc.n += 1;
+	}
+	disc.map[i] = (struct entry){
+		.serial = serial,
+		.product_id = desc.idProduct,
+		.dev = libusb_ref_device(dev),
+	};
+}
+
+
+static void left(libusb_device *dev)
+{
+	for (size_t i = 0; i < LJDISC_MAX; i++) {
+		if (disc.map[i].serial && disc.map[i].dev == dev) {
+			remove_at(i);
+			return;
+		}
+	}
+}
+
+
+// Fold queued hotplug events into the map. Reading serial numbers takes I/O,
+// which libusb doesn't want done inside the callback, so it happens here.
+static void process_pending(void)
+{
+	pthread_mutex_lock(&disc.pending_lock);
+	struct event *ev = disc.pending;
+	size_t n = disc.n_pending;
+	disc.pending = NULL;
+	disc.n_pending = 0;
+	disc.cap_pending = 0;
+	pthread_mutex_unlock(&disc.pending_lock);
+	for (size_t i = 0; i < n; i++) {
+		if (ev[i].arrived) arrived(ev[i].dev);
+		else left(ev[i].dev);
+		libusb_unref_device(ev[i].dev);
+	}
+	free(ev);
+}
+
+
+static int LIBUSB_CALL hotplug(libusb_context *usb, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data
+) {
+	(void)usb;
+	(void)user_data;
+	pthread_mutex_lock(&disc.pending_lock);
+	if (disc.n_pending == disc.cap_pending) {
+		size_t cap = disc.cap_pending ? 2 * disc.cap_pending : 8;
+		struct event *p = realloc(disc.pending, cap * sizeof(*p));
+		if (!p) {
+			pthread_mutex_unlock(&disc.pending_lock);
+			return 0;
+		}
+		disc.pending = p;
+		disc.cap_pending = cap;
+	}
+	disc.pending[disc.n_pending++] = (struct event){
+		.dev = libusb_ref_device(dev),
+		.arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+	};
+	pthread_mutex_unlock(&disc.pending_lock);
+	// stay registered
+	return 0;
+}
+
+
+static void *event_main(void *arg)
+{
+	(void)arg;
+	while (!atomic_load(&disc.stop)) {
+		struct timeval tv = {.tv_sec = 1};
+		libusb_handle_events_timeout_completed(disc.usb, &tv, NULL);
+		pthread_mutex_lock(&disc.lock);
+		process_pending();
+		pthread_mutex_unlock(&disc.lock);
+	}
+	return NULL;
+}
+
+
+// Tear down what ljdisc_get set up, once hotplug is registered. Needs
+// disc.life_lock, and the event thread stopped.
+static void teardown(void)
+{
+	libusb_hotplug_deregister_callback(disc.usb, disc.cb);
+	pthread_mutex_lock(&disc.lock);
+	process_pending();
+	for (size_t i = 0; i < LJDISC_MAX; i++) {
+		if (!disc.map[i].serial) continue;
+		libusb_unref_device(disc.map[i].dev);
+		disc.map[i].serial = 0;
+	}
+	disc.n = 0;
+	pthread_mutex_unlock(&disc.lock);
+	libusb_exit(disc.usb);
+	disc.usb = NULL;
+}
+
+
+int ljdisc_get(void)
+{
+	int err = 0;
+	pthread_mutex_lock(&disc.life_lock);
+	if (disc.refs) {
+		disc.refs += 1;
+		goto out;
+	}
+	err = usb_err(libusb_init(&disc.usb));
+	if (err) goto out;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		err = -ENOTSUP;
+		libusb_exit(disc.usb);
+		goto out;
+	}
+	// the first scan comes through the callback before this returns
+	err = usb_err(libusb_hotplug_register_callback(disc.usb,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+		| LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, LJDISC_VENDOR_ID,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug, NULL, &disc.cb
+	));
+	if (err) {
+		libusb_exit(disc.usb);
+		goto out;
+	}
+	pthread_mutex_lock(&disc.lock);
+	process_pending();
+	pthread_mutex_unlock(&disc.lock);
+	atomic_store(&disc.stop, false);
+	err = -pthread_create(&disc.thread, NULL, event_main, NULL);
+	if (err) {
+		teardown();
+		goto out;
+	}
+	disc.refs = 1;
+out:
+	pthread_mutex_unlock(&disc.life_lock);
+	return err;
+}
+
+
+void ljdisc_put(void)
+{
+	pthread_mutex_lock(&disc.life_lock);
+	if (disc.refs && !--disc.refs) {
+		atomic_store(&disc.stop, true);
+		libusb_interrupt_event_handler(disc.usb);
+		pthread_join(disc.thread, NULL);
+		teardown();
+	}
+	pthread_mutex_unlock(&disc.life_lock);
+}
+
+
+size_t ljdisc_count(unsigned long product_id)
+{
+	size_t n = 0;
+	pthread_mutex_lock(&disc.lock);
+	process_pending();
+	for (size_t i = 0; i < LJDISC_MAX; i++) {
+		if (disc.map[i].serial && disc.map[i].product_id == product_id)
+			n += 1;
+	}
+	pthread_mutex_unlock(&disc.lock);
+	return n;
+}
+
+
+struct usb_ctx {
+	libusb_device_handle *h;
+	libusb_device *dev;
+	unsigned char ep_out;
+	unsigned char ep_in;
+};
+
+
+static unsigned long usb_write(void *ctx, const uint8_t *buf, unsigned long n)
+{
+	struct usb_ctx *u = ctx;
+	int done = 0;
+	LJ_PROBE1(usb_write_start, n);
+	int err = usb_err(libusb_bulk_transfer(u->h, u->ep_out,
+		(unsigned char *)buf, n, &done, TIMEOUT_MS
+	));
+	LJ_PROBE2(usb_write_done, n, done);
+	if (err) errno = -err;
+	return done;
+}
+
+static unsigned long usb_read(void *ctx, uint8_t *buf, unsigned long n)
+{
+	struct usb_ctx *u = ctx;
+	int done = 0;
+	LJ_PROBE1(usb_read_start, n);
+	int err = usb_err(libusb_bulk_transfer(u->h, u->ep_in,
+		buf, n, &done, TIMEOUT_MS
+	));
+	LJ_PROBE2(usb_read_done, n, done);
+	if (err) errno = -err;
+	return done;
+}
+
+static void usb_close(void *ctx)
+{
+	struct usb_ctx *u = ctx;
+	libusb_release_interface(u->h, 0);
+	libusb_close(u->h);
+	pthread_mutex_lock(&disc.lock);
+	for (size_t i = 0; i < LJDISC_MAX; i++) {
+		if (disc.map[i].serial && disc.map[i].dev == u->dev)
+			disc.map[i].open = false;
+	}
+	pthread_mutex_unlock(&disc.lock);
+	libusb_unref_device(u->dev);
+	free(u);
+	ljdisc_put();
+}
+
+static const struct ljud_transport usb_transport = {
+	.name = "usb",
+	.write = usb_write,
+	.read = usb_read,
+	.close = usb_close,
+};
+
+
+// The first bulk endpoints each way on the first interface, which is where
+// the UD devices take commands.
+static int find_endpoints(libusb_device *dev, struct usb_ctx *u)
+{
+	struct libusb_config_descriptor *config;
+	int err = usb_err(libusb_get_active_config_descriptor(dev, &config));
+	if (err) return err;
+	u->ep_out = 0;
+	u->ep_in = 0;
+	if (config->bNumInterfaces && config->interface[0].num_altsetting) {
+		const struct libusb_interface_descriptor *alt =
+			&config->interface[0].altsetting[0];
+		for (uint8_t i = 0; i < alt->bNumEndpoints; i++) {
+			const struct libusb_endpoint_descriptor *ep =
+				&alt->endpoint[i];
+			if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+				!= LIBUSB_TRANSFER_TYPE_BULK
+			) continue;
+			if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+				if (!u->ep_in) u->ep_in = ep->bEndpointAddress;
+			} else if (!u->ep_out) {
+				u->ep_out = ep->bEndpointAddress;
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+	return u->ep_out && u->ep_in ? 0 : -ENODEV;
+}
+
+
+struct ljud_dev *ljdisc_open(unsigned long product_id, uint32_t serial)
+{
+	int err;
+	// the open device holds a reference of its own until it's closed
+	pthread_mutex_lock(&disc.life_lock);
+	bool running = disc.refs;
+	if (running) disc.refs += 1;
+	pthread_mutex_unlock(&disc.life_lock);
+	if (!running) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct usb_ctx *u = calloc(1, sizeof(struct usb_ctx));
+	if (!u) {
+		err = -ENOMEM;
+		goto put;
+	}
+
+	pthread_mutex_lock(&disc.lock);
+	process_pending();
+	int i = serial ? find(serial) : find_any(product_id);
+	if (i < 0 || disc.map[i].product_id != product_id) {
+		err = -ENOENT;
+		goto unlock;
+	}
+	if (disc.map[i].open) {
+		err = -EBUSY;
+		goto unlock;
+	}
+	err = find_endpoints(disc.map[i].dev, u);
+	if (err) goto unlock;
+	err = usb_err(libusb_open(disc.map[i].dev, &u->h));
+	if (err) goto unlock;
+	libusb_set_auto_detach_kernel_driver(u->h, 1);
+	err = usb_err(libusb_claim_interface(u->h, 0));
+	if (err) {
+		libusb_close(u->h);
+		goto unlock;
+	}
+	disc.map[i].open = true;
+	u->dev = libusb_ref_device(disc.map[i].dev);
+	pthread_mutex_unlock(&disc.lock);
+
+	struct ljud_dev *dev = ljud_open(&usb_transport, u, product_id);
+	if (!dev) {
+		usb_close(u);
+		errno = ENOMEM;
+	}
+	return dev;
+
+unlock:
+	pthread_mutex_unlock(&disc.lock);
+	free(u);
+put:
+	ljdisc_put();
+	errno = -err;
+	return NULL;
+}
@@ -0,0 +1,42 @@
+/** Finding devices by serial number without walking the bus every time.
+ * liblabjackusb finds a device by listing the whole bus and counting matching
+ * ones, and which one is first can change from boot to boot. Instead, this
+ * keeps a map from serial number to device, filled in by one scan when it
+ * starts and kept current by libusb hotplug events after that, so opening a
+ * device by serial is a table lookup.
+ *
+ * There's one map per process, shared by everyone that takes a reference with
+ * ljdisc_get. Serial numbers come from the USB serial number string, which
+ * the UD devices report. Devices opened here talk straight to libusb, with
+ * the same semantics as liblabjackusb's reads and writes.
+ */
+#ifndef LJDISC_H_
+#define LJDISC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "labjack_ud.h"
+
+#define LJDISC_VENDOR_ID 0x0CD5
+/** Most devices the map can hold. Must be a power of 2. */
+#define LJDISC_MAX 64
+
+/** Take a reference to the map, starting discovery if nobody else has.
+ * Returns 0 or negative error code: -ENOTSUP if libusb can't do hotplug here.
+ */
+int ljdisc_get(void);
+
+/** Drop a reference, stopping discovery when it's the last one. */
+void ljdisc_put(void);
+
+/** How many devices with this product ID are around right now. */
+size_t ljdisc_count(unsigned long product_id);
+
+/** Open the device with this product ID and serial number, or with serial 0,
+ * whichever with the product ID has the lowest serial number and isn't open
+ * already. Needs a reference. Returns NULL and sets errno on failure: ENOENT
+ * if there's no such device, EBUSY if it's open already.
+ */
+struct ljud_dev *ljdisc_open(unsigned long product_id, uint32_t serial);
+
+#endif
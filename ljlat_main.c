@@ -0,0 +1,549 @@
+/** aylp_ljlat: measure the time from proc taking a setpoint to the LJTick's
+ * output actually changing.
+ * The plugin is built in, and driven the same way anyloop drives it, toggling
+ * one DAC between two levels. After each toggle, an input that the DAC is
+ * wired back to (an analog input, or a digital one for a big enough swing) is
+ * polled with Feedback commands of our own until it follows. The change
+ * happened between the last poll that didn't see it and the first that did,
+ * so that's the measurement, give or take half the gap between them. With the
+ * "sim" transport, the simulated LJTick is wired back to the analog input and
+ * takes about as long as the real thing, so no hardware is needed.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <gsl/gsl_vector.h>
+#include <libaylp/anyloop.h>
+#include <libaylp/logging.h>
+#include <libaylp/xalloc.h>
+
+#include "labjack_u3.h"
+#include "ljchan.h"
+#include "ljclock.h"
+#include "ljmodel.h"
+#include "ljmon.h"
+#include "ljpredict.h"
+#include "ljsim.h"
+#include "ljspi.h"
+#include "ljtdac.h"
+#include "aylp_ljtdac.h"
+
+// how long to wait for the input to follow before giving up on a toggle
+#define TIMEOUT_NS 100000000ULL
+// most responses to read through on the way to a poll's own
+#define MAX_READS 64
+// the echo byte on our polls, so they can't be mistaken for the plugin's
+#define POLL_ECHO 0x55
+
+struct mode {
+	const char *name;
+	const char *params;	// JSON merged into the plugin's params
+};
+
+static const struct mode modes[] = {
+	{"read", "{\"fast\": false}"},
+	{"fast", "{\"fast\": true}"},
+	{"budget", "{\"budget_us\": 1000}"},
+	{"clock", "{\"clock\": true}"},
+};
+
+// the input the DAC is wired back to
+struct input {
+	bool digital;
+	uint8_t pin;		// AIN channel or digital pin
+	bool hv;		// a U3-HV's AIN0-3
+	double slope;		// V per raw bit, for an analog input
+	double offset;
+	double threshold;	// V between the two levels
+};
+
+struct result {
+	unsigned n;		// toggles the input followed
+	unsigned n_missed;	// toggles it didn't follow in time
+	unsigned n_failed;	// toggles proc returned an error for
+	double *lat_us;		// proc entry to output change
+	double *proc_us;	// proc entry to return
+	double res_sum_us;	// sum of each measurement's uncertainty
+};
+
+static bool verbose = false;
+
+
+// The plugin logs through whatever runs it, which is us here.
+void log_log(int level, const char *file, int line, const char *fmt, ...)
+{
+	if (!verbose) return;
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "%d %s:%d: ", level, file, line);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+}
+
+
+void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+
+void xfree(void *p)
+{
+	free(p);
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-t transport] [-o dac] [-a ain | -d pin] [-H] "
+		"[-l low] [-u high]\n"
+		"       [-n toggles] [-g gap_us] [-m modes] [-p params] [-v]\n"
+		"  -t transport  \"usb\", \"sim\" or \"broker\" (default usb)\n"
+		"  -o dac        DAC to toggle, DACA or DACB (default DACA)\n"
+		"  -a ain        analog input it's wired back to, e.g. AIN2\n"
+		"  -d pin        digital input it's wired back to, e.g. FIO5\n"
+		"  -H            the analog input is one of a U3-HV's AIN0-3\n"
+		"  -l low        low level in volts (default 0.2, 0 with -d)\n"
+		"  -u high       high level in volts (default 2, 3.3 with -d)\n"
+		"  -n toggles    toggles per mode (default 200)\n"
+		"  -g gap_us     random wait of up to this between toggles "
+		"(default 1000)\n"
+		"  -m modes      comma-separated, from read, fast, budget and "
+		"clock\n"
+		"                (default read,fast)\n"
+		"  -p params     JSON object of extra plugin params for every "
+		"mode\n"
+		"  -v            show what the plugin logs\n",
+		argv0
+	);
+}
+
+
+// Poll the input once. The poll goes out with an echo of its own, and any
+// responses the plugin left unread are read through and thrown away on the
+// way to its response. *t_tx and *t_rx bracket when the input was read.
+static int poll_input(struct aylp_ljtdac_data *data, const struct input *in,
+	bool *high, uint64_t *t_tx, uint64_t *t_rx
+) {
+	uint8_t cmd[3];
+	unsigned n_cmd, n_resp;
+	if (in->digital) {
+		cmd[0] = BIT_STATE_READ;
+		cmd[1] = in->pin;
+		n_cmd = 2;
+		n_resp = 1;
+	} else {
+		cmd[0] = AIN;
+		cmd[1] = in->pin;
+		cmd[2] = 31;	// single-ended
+		n_cmd = 3;
+		n_resp = 2;
+	}
+	uint8_t tx[LJUD_PACKET_MAX];
+	uint8_t rx[LJUD_PACKET_MAX];
+	const unsigned n_tx = lju3_pack_feedback(tx, cmd, n_cmd);
+	const unsigned n_rx = lju3_feedback_resp_len(n_resp);
+	struct lju3_feedback_header *head = (struct lju3_feedback_header *)tx;
+	head->echo = POLL_ECHO;
+	head->header.checksum16 = ljud_checksum16(tx + 6, n_tx - 6);
+	head->header.checksum8 = ljud_checksum8(tx + 1,
+		sizeof(struct ljud_extended_header) - 1
+	);
+
+	*t_tx = now_ns();
+	if (ljud_write(data->dev, tx, n_tx) < n_tx) return -ECOMM;
+	for (unsigned i = 0; i < MAX_READS; i++) {
+		unsigned long n = ljud_read(data->dev, rx, LJUD_PACKET_MAX);
+		if (!n) return -ETIMEDOUT;
+		const struct lju3_feedback_resp_header *resp = (
+			(const struct lju3_feedback_resp_header *)rx
+		);
+		if (n != n_rx || resp->header.extended_command != 0x00
+			|| resp->echo != POLL_ECHO
+		) {
+			continue;
+		}
+		*t_rx = now_ns();
+		// we've read everything that was in front of us
+		data->n_unread = 0;
+		if (resp->header.checksum16
+			!= ljud_checksum16(rx + 6, n_rx - 6)
+		) {
+			return -EBADMSG;
+		}
+		if (resp->err) return resp->err;
+		const uint8_t *r = rx
+			+ offsetof(struct lju3_feedback_resp_header, _padding);
+		if (in->digital) {
+			*high = r[0] & 1;
+		} else {
+			double v = (r[0] | r[1] << 8) * in->slope + in->offset;
+			*high = v > in->threshold;
+		}
+		return 0;
+	}
+	return -EPROTO;
+}
+
+
+// Get the input ready to poll, and its calibration if it's analog.
+static int setup_input(struct aylp_ljtdac_data *data, struct input *in,
+	int dac
+) {
+	int err;
+	if (data->transport == AYLP_LJTDAC_SIM) {
+		struct ljsim *sim = ljsim_get(data->dev);
+		sim->ljtdac_ain[dac] = in->pin;
+		sim->ljtdac_ain_gain = 1.0;
+		sim->hv = in->hv;
+	}
+	if (in->pin == data->sda_pin || in->pin == data->scl_pin) {
+		fprintf(stderr, "the input is on one of the LJTick's pins\n");
+		return -EINVAL;
+	}
+	if (in->digital) return 0;
+
+	// the plugin leaves the flexible pins digital, so make ours analog,
+	// keeping the timers and counters it set up
+	if (!(in->hv && in->pin < 4) && in->pin < 16) {
+		struct ljmodel_io io;
+		err = data->model->config_io(data->dev, NULL, &io);
+		if (!err) {
+			io.analog |= 1 << in->pin;
+			err = data->model->config_io(data->dev, &io, &io);
+		}
+		if (err) {
+			fprintf(stderr, "config_io returned %d: %s\n",
+				err, strerror(-err)
+			);
+			return err;
+		}
+	}
+	struct lju3_cal_mem cal_mem;
+	err = lju3_read_cal_mem(data->dev, &cal_mem);
+	if (err) {
+		fprintf(stderr, "lju3_read_cal_mem returned %d: %s\n",
+			err, strerror(-err)
+		);
+		return err;
+	}
+	lju3_ain_cal(&cal_mem, in->hv, in->pin, &in->slope, &in->offset);
+	return 0;
+}
+
+
+// Set the DAC to v, and see how long the input takes to follow. Returns 0
+// and fills in *lat_us, *res_us and *proc_us, 1 if the input didn't follow
+// in time, or negative error code.
+static int toggle(struct aylp_device *dev, const struct input *in,
+	gsl_vector *v, double level, bool high,
+	double *lat_us, double *res_us, double *proc_us
+) {
+	struct aylp_ljtdac_data *data = dev->device_data;
+	struct aylp_state state = {.vector = v};
+	gsl_vector_set(v, 0, level);
+	uint64_t t_entry = now_ns();
+	int err = dev->proc(dev, &state);
+	uint64_t t_ret = now_ns();
+	if (err) return err < 0 ? err : -EIO;
+	*proc_us = (t_ret - t_entry) / 1e3;
+
+	// the change can't have happened before proc took the setpoint
+	double before = t_entry;
+	for (;;) {
+		bool got;
+		uint64_t t_tx, t_rx;
+		err = poll_input(data, in, &got, &t_tx, &t_rx);
+		if (err) return err < 0 ? err : -EIO;
+		double at = t_tx + (t_rx - t_tx) / 2.0;
+		if (got == high) {
+			if (at < before) at = before;
+			*lat_us = ((before + at) / 2 - t_entry) / 1e3;
+			*res_us = (at - before) / 2e3;
+			return 0;
+		}
+		if (at > before) before = at;
+		if (t_rx - t_entry > TIMEOUT_NS) return 1;
+	}
+}
+
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+static double quantile(const double *sorted, unsigned n, double q)
+{
+	return sorted[(unsigned)(q * (n - 1) + 0.5)];
+}
+
+
+// Run one mode's worth of toggles with a fresh instance of the plugin.
+static int run_mode(const struct mode *mode, json_object *base,
+	json_object *extra, struct input in, int dac, double low, double high,
+	unsigned n_toggles, unsigned gap_us, struct result *res
+) {
+	int err;
+	json_object *params = json_object_new_object();
+	json_object_object_foreach(base, bk, bv) {
+		json_object_object_add(params, bk, json_object_get(bv));
+	}
+	json_object *mode_params = json_tokener_parse(mode->params);
+	json_object_object_foreach(mode_params, mk, mv) {
+		json_object_object_add(params, mk, json_object_get(mv));
+	}
+	json_object_put(mode_params);
+	if (extra) {
+		json_object_object_foreach(extra, ek, ev) {
+			json_object_object_add(params, ek, json_object_get(ev));
+		}
+	}
+
+	struct aylp_device dev = {.params = params};
+	err = aylp_ljtdac_init(&dev);
+	if (err) {
+		fprintf(stderr, "%s: the plugin didn't start (-v shows why)\n",
+			mode->name
+		);
+		json_object_put(params);
+		return -1;
+	}
+	struct aylp_ljtdac_data *data = dev.device_data;
+	err = setup_input(data, &in, dac);
+	if (err) goto out;
+	in.threshold = (low + high) / 2;
+
+	gsl_vector *v = gsl_vector_alloc(1);
+	double lat, res_us, proc;
+	// start from low, however long it takes to get there
+	err = toggle(&dev, &in, v, low, false, &lat, &res_us, &proc);
+	if (err > 0) {
+		fprintf(stderr, "%s: the input never read low; is it wired "
+			"to the DAC?\n", mode->name
+		);
+		err = -1;
+	}
+	for (unsigned i = 0; !err && i < n_toggles; i++) {
+		if (gap_us) {
+			uint64_t ns = random() % (gap_us * 1000ULL + 1);
+			struct timespec ts = {
+				.tv_sec = ns / 1000000000,
+				.tv_nsec = ns % 1000000000,
+			};
+			nanosleep(&ts, NULL);
+		}
+		bool up = !(i & 1);
+		int e = toggle(&dev, &in, v, up ? high : low, up,
+			&lat, &res_us, &proc
+		);
+		if (e == 1) {
+			res->n_missed += 1;
+		} else if (e < 0) {
+			res->n_failed += 1;
+			if (verbose) {
+				fprintf(stderr, "%s: toggle %u: %s\n",
+					mode->name, i, strerror(-e)
+				);
+			}
+		} else {
+			res->lat_us[res->n] = lat;
+			res->proc_us[res->n] = proc;
+			res->res_sum_us += res_us;
+			res->n += 1;
+		}
+	}
+	gsl_vector_free(v);
+out:
+	dev.fini(&dev);
+	json_object_put(params);
+	return err;
+}
+
+
+static void report(const char *name, struct result *res)
+{
+	if (!res->n) {
+		printf("%-8s %5u %5u %5u\n",
+			name, 0, res->n_missed, res->n_failed
+		);
+		return;
+	}
+	qsort(res->lat_us, res->n, sizeof(double), compare);
+	qsort(res->proc_us, res->n, sizeof(double), compare);
+	double sum = 0.0;
+	for (unsigned i = 0; i < res->n; i++) sum += res->lat_us[i];
+	printf("%-8s %5u %5u %5u %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f "
+		"%8.1f %6.1f\n",
+		name, res->n, res->n_missed, res->n_failed,
+		quantile(res->proc_us, res->n, 0.5),
+		res->lat_us[0],
+		quantile(res->lat_us, res->n, 0.5),
+		quantile(res->lat_us, res->n, 0.9),
+		quantile(res->lat_us, res->n, 0.99),
+		res->lat_us[res->n - 1],
+		sum / res->n, res->res_sum_us / res->n
+	);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *transport = "usb";
+	const char *dac_name = "DACA";
+	const char *ain_name = NULL;
+	const char *pin_name = NULL;
+	const char *mode_list = "read,fast";
+	const char *extra_json = NULL;
+	bool hv = false;
+	double low = NAN, high = NAN;
+	unsigned n_toggles = 200;
+	unsigned gap_us = 1000;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:o:a:d:Hl:u:n:g:m:p:vh")) != -1) {
+		switch (opt) {
+		case 't': transport = optarg; break;
+		case 'o': dac_name = optarg; break;
+		case 'a': ain_name = optarg; break;
+		case 'd': pin_name = optarg; break;
+		case 'H': hv = true; break;
+		case 'l': low = strtod(optarg, NULL); break;
+		case 'u': high = strtod(optarg, NULL); break;
+		case 'n': n_toggles = strtoul(optarg, NULL, 0); break;
+		case 'g': gap_us = strtoul(optarg, NULL, 0); break;
+		case 'm': mode_list = optarg; break;
+		case 'p': extra_json = optarg; break;
+		case 'v': verbose = true; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	struct input in = {.hv = hv};
+	int dac;
+	if (!strcasecmp(dac_name, "DACA")) {
+		dac = 0;
+	} else if (!strcasecmp(dac_name, "DACB")) {
+		dac = 1;
+	} else {
+		fprintf(stderr, "unknown DAC: %s\n", dac_name);
+		return EXIT_FAILURE;
+	}
+	if (!strcmp(transport, "sim") && !ain_name && !pin_name)
+		ain_name = "AIN0";
+	if (!strcmp(transport, "sim") && pin_name) {
+		fprintf(stderr, "the sim only wires the LJTick back to an "
+			"analog input\n"
+		);
+		return EXIT_FAILURE;
+	}
+	if (!ain_name == !pin_name) {
+		fprintf(stderr, "need one of -a and -d\n");
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	int p = ain_name
+		? lju3_ain_from_name(ain_name) : lju3_pin_from_name(pin_name);
+	if (p < 0) {
+		fprintf(stderr, "unknown input: %s\n",
+			ain_name ? ain_name : pin_name
+		);
+		return EXIT_FAILURE;
+	}
+	in.pin = p;
+	in.digital = !ain_name;
+	if (isnan(low)) low = in.digital ? 0.0 : 0.2;
+	if (isnan(high)) high = in.digital ? 3.3 : 2.0;
+	json_object *extra = NULL;
+	if (extra_json) {
+		extra = json_tokener_parse(extra_json);
+		if (!extra || !json_object_is_type(extra, json_type_object)) {
+			fprintf(stderr, "-p needs a JSON object\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	json_object *base = json_object_new_object();
+	json_object_object_add(base, "host", json_object_new_string("U3"));
+	json_object_object_add(base, "transport",
+		json_object_new_string(transport)
+	);
+	json_object_object_add(base, "cache", json_object_new_boolean(false));
+	json_object_object_add(base, "sim_latency",
+		json_object_new_boolean(true)
+	);
+	json_object *chan = json_object_new_object();
+	json_object_object_add(chan, "output",
+		json_object_new_string(dac ? "DACB" : "DACA")
+	);
+	json_object_object_add(chan, "index", json_object_new_int(0));
+	json_object *chans = json_object_new_array();
+	json_object_array_add(chans, chan);
+	json_object_object_add(base, "channels", chans);
+
+	srandom(now_ns());
+	printf("%-8s %5s %5s %5s %8s %8s %8s %8s %8s %8s %8s %6s\n",
+		"mode", "n", "miss", "fail", "proc", "min", "p50", "p90",
+		"p99", "max", "mean", "+/-"
+	);
+	int ret = EXIT_SUCCESS;
+	char *list = strdup(mode_list);
+	char *save = NULL;
+	for (char *name = strtok_r(list, ",", &save); name;
+		name = strtok_r(NULL, ",", &save)
+	) {
+		const struct mode *mode = NULL;
+		for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+			if (!strcmp(name, modes[i].name)) mode = &modes[i];
+		}
+		if (!mode) {
+			fprintf(stderr, "unknown mode: %s\n", name);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		struct result res = {
+			.lat_us = calloc(n_toggles + 1, sizeof(double)),
+			.proc_us = calloc(n_toggles + 1, sizeof(double)),
+		};
+		if (run_mode(mode, base, extra, in, dac, low, high,
+			n_toggles, gap_us, &res
+		)) {
+			ret = EXIT_FAILURE;
+		}
+		report(mode->name, &res);
+		free(res.lat_us);
+		free(res.proc_us);
+	}
+	printf("(times in us from proc entry; +/- is the mean uncertainty "
+		"from polling)\n"
+	);
+	free(list);
+	json_object_put(base);
+	if (extra) json_object_put(extra);
+	return ret;
+}
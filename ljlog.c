@@ -0,0 +1,415 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libaylp/logging.h>
+
+#include "ljlog.h"
+
+// how long the thread sleeps between looking at the rings
+#define POLL_NS 2000000
+// most call sites waiting to be summarised at once
+#define MAX_NOISY 64
+// longest message, after formatting
+#define MSG_MAX 512
+
+static struct {
+	// the rings and everything about formatting, including call sites'
+	// rate limiting, which only happens with this held
+	pthread_mutex_t lock;
+	struct ljlog *rings;
+	struct ljlog_site *noisy[MAX_NOISY];
+	size_t n_noisy;
+
+	// starting and stopping the thread
+	pthread_mutex_t life_lock;
+	unsigned refs;
+	pthread_t thread;
+	atomic_bool stop;
+} lg = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.life_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// One conversion in a format, from the % to the conversion character.
+struct conv {
+	const char *start;
+	const char *end;	// just past the conversion character
+	char c;
+	char len[3];		// length modifier
+	bool star_width;
+	bool star_prec;
+};
+
+
+// Parse the conversion at *p (just past a %), returning false at the end of
+// the format. %% comes back as a conversion of its own.
+static bool parse_conv(const char *p, struct conv *cv)
+{
+	cv->start = p - 1;
+	cv->star_width = cv->star_prec = false;
+	while (*p && strchr("-+ #0'", *p)) p++;
+	if (*p == '*') {
+		cv->star_width = true;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9') p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			cv->star_prec = true;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9') p++;
+	}
+	size_t n_len = 0;
+	while (*p && strchr("hlLqjzt", *p) && n_len < 2)
+		cv->len[n_len++] = *p++;
+	cv->len[n_len] = '\0';
+	if (!*p) return false;
+	cv->c = *p;
+	cv->end = p + 1;
+	return true;
+}
+
+
+static union ljlog_arg int_arg(const struct conv *cv, va_list *ap)
+{
+	bool sign = cv->c == 'd' || cv->c == 'i';
+	const char *l = cv->len;
+	union ljlog_arg a;
+	if (!strcmp(l, "ll") || !strcmp(l, "q")) {
+		if (sign) a.i = va_arg(*ap, long long);
+		else a.i = (int64_t)va_arg(*ap, unsigned long long);
+	} else if (!strcmp(l, "l")) {
+		if (sign) a.i = va_arg(*ap, long);
+		else a.i = (int64_t)va_arg(*ap, unsigned long);
+	} else if (!strcmp(l, "z") || !strcmp(l, "t") || !strcmp(l, "j")) {
+		a.i = (int64_t)va_arg(*ap, size_t);
+	} else if (sign) {
+		// char and short are promoted to int
+		a.i = va_arg(*ap, int);
+		if (!strcmp(l, "hh")) a.i = (signed char)a.i;
+		if (!strcmp(l, "h")) a.i = (short)a.i;
+	} else {
+		a.i = va_arg(*ap, unsigned);
+		if (!strcmp(l, "hh")) a.i = (uint8_t)a.i;
+		if (!strcmp(l, "h")) a.i = (uint16_t)a.i;
+	}
+	return a;
+}
+
+
+// Copy the arguments the format says are there into args, returning how
+// many there were.
+static unsigned collect(const char *fmt, va_list *ap, union ljlog_arg *args)
+{
+	unsigned n = 0;
+	struct conv cv;
+	for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+		if (!parse_conv(p + 1, &cv)) break;
+		p = cv.end;
+		if (cv.c == '%') continue;
+		if (cv.star_width && n < LJLOG_MAX_ARGS)
+			args[n++].i = va_arg(*ap, int);
+		if (cv.star_prec && n < LJLOG_MAX_ARGS)
+			args[n++].i = va_arg(*ap, int);
+		if (n >= LJLOG_MAX_ARGS) break;
+		switch (cv.c) {
+		case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		case 'c':
+			args[n++] = int_arg(&cv, ap);
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+		case 'a': case 'A':
+			if (!strcmp(cv.len, "L"))
+				args[n++].d = va_arg(*ap, long double);
+			else
+				args[n++].d = va_arg(*ap, double);
+			break;
+		case 's': case 'p':
+			args[n++].p = va_arg(*ap, const void *);
+			break;
+		default:
+			// nothing we know how to carry, so stop here
+			return n;
+		}
+	}
+	return n;
+}
+
+
+// Format a record the way printf would have, as far as its arguments go.
+static void format(const struct ljlog_rec *rec, char *out, size_t n_out)
+{
+	size_t o = 0;
+	unsigned i = 0;
+	struct conv cv;
+	const char *p = rec->site->fmt;
+	while (*p && o + 1 < n_out) {
+		if (*p != '%' || !parse_conv(p + 1, &cv)) {
+			out[o++] = *p++;
+			continue;
+		}
+		if (cv.c == '%') {
+			out[o++] = '%';
+			p = cv.end;
+			continue;
+		}
+		unsigned need = 1 + cv.star_width + cv.star_prec;
+		if (i + need > rec->n_args) break;
+		// rebuild the conversion with any *s filled in and the length
+		// modifier swapped for the type we kept the argument as
+		char spec[64];
+		size_t s = 0;
+		for (const char *q = cv.start; q < cv.end - 1
+			&& s + 16 < sizeof(spec); q++
+		) {
+			if (*q == '*') {
+				s += snprintf(spec + s, sizeof(spec) - s, "%d",
+					(int)rec->args[i++].i
+				);
+			} else if (!strchr("hlLqjzt", *q)) {
+				spec[s++] = *q;
+			}
+		}
+		const union ljlog_arg *a = &rec->args[i++];
+		int n;
+		switch (cv.c) {
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+		case 'a': case 'A':
+			spec[s++] = cv.c;
+			spec[s] = '\0';
+			n = snprintf(out + o, n_out - o, spec, a->d);
+			break;
+		case 's':
+			spec[s++] = 's';
+			spec[s] = '\0';
+			n = snprintf(out + o, n_out - o, spec,
+				a->p ? (const char *)a->p : "(null)"
+			);
+			break;
+		case 'p':
+			spec[s++] = 'p';
+			spec[s] = '\0';
+			n = snprintf(out + o, n_out - o, spec, a->p);
+			break;
+		case 'c':
+			spec[s++] = 'c';
+			spec[s] = '\0';
+			n = snprintf(out + o, n_out - o, spec, (int)a->i);
+			break;
+		default:
+			spec[s++] = 'l';
+			spec[s++] = 'l';
+			spec[s++] = cv.c;
+			spec[s] = '\0';
+			n = snprintf(out + o, n_out - o, spec, (long long)a->i);
+			break;
+		}
+		if (n > 0)
+			o += (size_t)n < n_out - o ? (size_t)n : n_out - o - 1;
+		p = cv.end;
+	}
+	out[o] = '\0';
+}
+
+
+static void emit(uint8_t level, const char *file, int line, const char *msg)
+{
+	switch (level) {
+	case LJLOG_TRACE: log_trace("%s:%d: %s", file, line, msg); break;
+	case LJLOG_DEBUG: log_debug("%s:%d: %s", file, line, msg); break;
+	case LJLOG_INFO: log_info("%s:%d: %s", file, line, msg); break;
+	case LJLOG_WARN: log_warn("%s:%d: %s", file, line, msg); break;
+	default: log_error("%s:%d: %s", file, line, msg); break;
+	}
+}
+
+
+// Say how many messages a site didn't log in its last window. Needs lg.lock.
+static void summarise(struct ljlog_site *site, uint64_t t)
+{
+	if (!site->n_suppressed) return;
+	char msg[MSG_MAX];
+	snprintf(msg, sizeof(msg), "%lu more like \"%s\" in %.1f s",
+		site->n_suppressed, site->fmt, (t - site->window_ns) * 1e-9
+	);
+	emit(site->level, site->file, site->line, msg);
+	site->n_suppressed = 0;
+}
+
+
+// Log a record, unless its site has had its fill this window. Needs lg.lock.
+static void handle(const struct ljlog_rec *rec)
+{
+	struct ljlog_site *site = rec->site;
+	if (rec->t_ns - site->window_ns >= LJLOG_WINDOW_NS) {
+		summarise(site, rec->t_ns);
+		site->window_ns = rec->t_ns;
+		site->n_window = 0;
+	}
+	if (++site->n_window > LJLOG_BURST) {
+		site->n_suppressed += 1;
+		if (!site->noisy && lg.n_noisy < MAX_NOISY) {
+			site->noisy = true;
+			lg.noisy[lg.n_noisy++] = site;
+		}
+		return;
+	}
+	char msg[MSG_MAX];
+	format(rec, msg, sizeof(msg));
+	emit(site->level, site->file, site->line, msg);
+}
+
+
+// Format everything in a ring. Needs lg.lock.
+static void drain(struct ljlog *log)
+{
+	unsigned head = atomic_load_explicit(&log->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+	for (; head != tail; head++) {
+		handle(&log->recs[head % LJLOG_RING]);
+		atomic_store_explicit(&log->head, head + 1,
+			memory_order_release
+		);
+	}
+	unsigned long n = atomic_load(&log->n_dropped);
+	if (n != log->n_dropped_seen) {
+		log_warn("Log ring full; dropped %lu messages",
+			n - log->n_dropped_seen
+		);
+		log->n_dropped_seen = n;
+	}
+}
+
+
+// Summarise the sites whose windows are over, or all of them. Needs lg.lock.
+static void summarise_noisy(uint64_t t, bool all)
+{
+	size_t j = 0;
+	for (size_t i = 0; i < lg.n_noisy; i++) {
+		struct ljlog_site *site = lg.noisy[i];
+		if (all || t - site->window_ns >= LJLOG_WINDOW_NS) {
+			summarise(site, t);
+			site->noisy = false;
+		} else {
+			lg.noisy[j++] = site;
+		}
+	}
+	lg.n_noisy = j;
+}
+
+
+static void *log_main(void *arg)
+{
+	(void)arg;
+	struct timespec ts = {.tv_nsec = POLL_NS};
+	while (!atomic_load(&lg.stop)) {
+		pthread_mutex_lock(&lg.lock);
+		for (struct ljlog *log = lg.rings; log; log = log->next)
+			drain(log);
+		summarise_noisy(now_ns(), false);
+		pthread_mutex_unlock(&lg.lock);
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+
+struct ljlog *ljlog_open(void)
+{
+	struct ljlog *log = calloc(1, sizeof(struct ljlog));
+	if (!log) return NULL;
+	pthread_mutex_lock(&lg.life_lock);
+	if (!lg.refs) {
+		atomic_store(&lg.stop, false);
+		int err = pthread_create(&lg.thread, NULL, log_main, NULL);
+		if (err) {
+			pthread_mutex_unlock(&lg.life_lock);
+			free(log);
+			errno = err;
+			return NULL;
+		}
+	}
+	lg.refs += 1;
+	pthread_mutex_lock(&lg.lock);
+	log->next = lg.rings;
+	lg.rings = log;
+	pthread_mutex_unlock(&lg.lock);
+	pthread_mutex_unlock(&lg.life_lock);
+	return log;
+}
+
+
+void ljlog_close(struct ljlog *log)
+{
+	if (!log) return;
+	pthread_mutex_lock(&lg.life_lock);
+	pthread_mutex_lock(&lg.lock);
+	drain(log);
+	for (struct ljlog **p = &lg.rings; *p; p = &(*p)->next) {
+		if (*p == log) {
+			*p = log->next;
+			break;
+		}
+	}
+	bool last = !--lg.refs;
+	if (last) summarise_noisy(now_ns(), true);
+	pthread_mutex_unlock(&lg.lock);
+	if (last) {
+		atomic_store(&lg.stop, true);
+		pthread_join(lg.thread, NULL);
+	}
+	pthread_mutex_unlock(&lg.life_lock);
+	free(log);
+}
+
+
+void ljlog_record(struct ljlog *log, struct ljlog_site *site,
+	const char *fmt, ...
+) {
+	struct ljlog_rec local;
+	struct ljlog_rec *rec = &local;
+	unsigned tail = 0;
+	if (log) {
+		tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+		unsigned head = atomic_load_explicit(&log->head,
+			memory_order_acquire
+		);
+		if (tail - head >= LJLOG_RING) {
+			atomic_fetch_add_explicit(&log->n_dropped, 1,
+				memory_order_relaxed
+			);
+			return;
+		}
+		rec = &log->recs[tail % LJLOG_RING];
+	}
+	rec->site = site;
+	rec->t_ns = now_ns();
+	va_list ap;
+	va_start(ap, fmt);
+	rec->n_args = collect(fmt, &ap, rec->args);
+	va_end(ap);
+	if (log) {
+		atomic_store_explicit(&log->tail, tail + 1,
+			memory_order_release
+		);
+	} else {
+		pthread_mutex_lock(&lg.lock);
+		handle(rec);
+		pthread_mutex_unlock(&lg.lock);
+	}
+}
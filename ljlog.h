@@ -0,0 +1,107 @@
+/** Logging from the loop without formatting or I/O in it.
+ * A log call in the loop only copies its arguments into a record, along with
+ * a pointer to its call site (which holds the level, where it is, and the
+ * format), and puts that in a ring of its own. A background thread shared by
+ * every ring does the formatting and hands the messages to the usual logger.
+ * Each ring has one writer (whoever runs the loop it belongs to), so the ring
+ * is lock-free, and a full ring drops records rather than wait.
+ *
+ * So that an error storm doesn't turn into a flood of messages, each call
+ * site only logs LJLOG_BURST messages every LJLOG_WINDOW_NS, and sums up how
+ * many more it had once the window is over.
+ *
+ * Records only hold arguments by value, so a %s argument has to outlive the
+ * record: a string literal, a name from a table, or strerror's answer.
+ */
+#ifndef LJLOG_H_
+#define LJLOG_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Records in each ring. Must be a power of two. */
+#define LJLOG_RING 256
+/** Most arguments a record holds, counting any * widths and precisions. */
+#define LJLOG_MAX_ARGS 8
+/** Messages a call site can log in a window before it's summarised. */
+#define LJLOG_BURST 10
+#define LJLOG_WINDOW_NS 1000000000ULL
+
+enum {
+	LJLOG_TRACE,
+	LJLOG_DEBUG,
+	LJLOG_INFO,
+	LJLOG_WARN,
+	LJLOG_ERROR,
+};
+
+/** A call site, one per use of the macros below. */
+struct ljlog_site {
+	uint8_t level;
+	const char *file;
+	int line;
+	const char *fmt;
+
+	// rate limiting, only touched with the formatting lock held
+	uint64_t window_ns;	// when this site's window started
+	unsigned n_window;	// messages in it so far
+	unsigned long n_suppressed;	// ones we didn't log
+	bool noisy;		// on the list to be summarised
+};
+
+union ljlog_arg {
+	int64_t i;
+	double d;
+	const void *p;
+};
+
+struct ljlog_rec {
+	struct ljlog_site *site;
+	uint64_t t_ns;		// CLOCK_MONOTONIC when it was logged
+	unsigned n_args;
+	union ljlog_arg args[LJLOG_MAX_ARGS];
+};
+
+struct ljlog {
+	atomic_uint head;	// next record to format
+	atomic_uint tail;	// next record to fill
+	atomic_ulong n_dropped;	// records lost to a full ring
+	unsigned long n_dropped_seen;	// how many of those we've reported
+	struct ljlog *next;	// the next ring the thread looks at
+	struct ljlog_rec recs[LJLOG_RING];
+};
+
+/** Make a ring, starting the formatting thread if this is the first.
+ * Returns NULL and sets errno on failure.
+ */
+struct ljlog *ljlog_open(void);
+
+/** Format whatever's left in the ring and free it, stopping the formatting
+ * thread if this was the last one.
+ */
+void ljlog_close(struct ljlog *log);
+
+/** Record a message for the formatting thread. fmt must be site->fmt. With a
+ * NULL log, the message is formatted and logged straight away.
+ */
+void ljlog_record(struct ljlog *log, struct ljlog_site *site,
+	const char *fmt, ...
+) __attribute__((format(printf, 3, 4)));
+
+#define LJLOG_FMT_(fmt, ...) fmt
+#define LJLOG(log, lvl, ...) do { \
+	static struct ljlog_site ljlog_site_ = { \
+		.level = (lvl), .file = __FILE__, .line = __LINE__, \
+		.fmt = LJLOG_FMT_(__VA_ARGS__, 0), \
+	}; \
+	ljlog_record((log), &ljlog_site_, __VA_ARGS__); \
+} while (0)
+
+#define ljlog_trace(log, ...) LJLOG(log, LJLOG_TRACE, __VA_ARGS__)
+#define ljlog_debug(log, ...) LJLOG(log, LJLOG_DEBUG, __VA_ARGS__)
+#define ljlog_info(log, ...) LJLOG(log, LJLOG_INFO, __VA_ARGS__)
+#define ljlog_warn(log, ...) LJLOG(log, LJLOG_WARN, __VA_ARGS__)
+#define ljlog_error(log, ...) LJLOG(log, LJLOG_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <stddef.h>
+#include <strings.h>
+
+#include "labjack_u3.h"
+#include "labjack_u6.h"
+#include "ljmodel.h"
+
+
+static struct ljud_dev *u3_open(unsigned dev_num)
+{
+	return ljud_open_usb(U3_PRODUCT_ID, dev_num);
+}
+
+
+static int u3_read_config(struct ljud_dev *dev, struct ljmodel_info *info)
+{
+	struct lju3_config_resp resp;
+	int err = lju3_read_config(dev, &resp);
+	if (err) return err;
+	info->serial_number = resp.serial_number;
+	info->product_id = resp.product_id;
+	info->firmware_version = resp.firmware_version;
+	info->bootloader_version = resp.bootloader_version;
+	info->hardware_version = resp.hardware_version;
+	info->local_id = resp.local_id;
+	return 0;
+}
+
+
+static int u3_config_io(struct ljud_dev *dev,
+	const struct ljmodel_io *set, struct ljmodel_io *got
+) {
+	struct lju3_config_io config_io = {0};
+	struct lju3_config_io_resp config_io_resp;
+	if (set) {
+		config_io.write_mask |= 1 << 0;		// set counter_config
+		config_io.write_mask |= 1 << 1;		// set dac1_enable
+		config_io.write_mask |= 1 << 2;		// set fio_analog
+		config_io.write_mask |= 1 << 3;		// set eio_analog
+		config_io.timer_counter_config = ljmodel_io_pack(set);
+		config_io.dac1_enable = 0;		// disable dac1
+		config_io.fio_analog = set->analog & 0xFF;
+		config_io.eio_analog = set->analog >> 8;
+	}
+	int err = lju3_config_io(dev, &config_io, &config_io_resp);
+	if (err) return err;
+	ljmodel_io_unpack(config_io_resp.timer_counter_config, got);
+	got->digital = config_io_resp.dac1_enable == 0;
+	got->analog = config_io_resp.fio_analog
+		| config_io_resp.eio_analog << 8;
+	return 0;
+}
+
+
+static int u3_config_timers(struct ljud_dev *dev,
+	lju3_clock_config clock_config, uint8_t clock_divisor,
+	ljud_pin offset, uint8_t counters,
+	unsigned n_timers, const lju3_timer_mode *modes, const uint16_t *values
+) {
+	return lju3_config_timers(dev, clock_config, clock_divisor, offset,
+		(counters & 3) << 2, n_timers, modes, values
+	);
+}
+
+
+static struct ljud_dev *u6_open(unsigned dev_num)
+{
+	return ljud_open_usb(U6_PRODUCT_ID, dev_num);
+}
+
+
+static int u6_read_config(struct ljud_dev *dev, struct ljmodel_info *info)
+{
+	struct lju6_config_resp resp;
+	int err = lju6_read_config(dev, &resp);
+	if (err) return err;
+	info->serial_number = resp.serial_number;
+	info->product_id = resp.product_id;
+	info->firmware_version = resp.firmware_version;
+	info->bootloader_version = resp.bootloader_version;
+	info->hardware_version = resp.hardware_version;
+	info->local_id = resp.local_id;
+	return 0;
+}
+
+
+static int u6_config_io(struct ljud_dev *dev,
+	const struct ljmodel_io *set, struct ljmodel_io *got
+) {
+	struct lju6_config_io config_io = {0};
+	struct lju6_config_io_resp config_io_resp;
+	if (set) {
+		config_io.write_mask = 1 << 0;
+		config_io.n_timers = set->n_timers;
+		config_io.counter_enable = set->counters;
+		config_io.pin_offset = set->offset;
+	}
+	int err = lju6_config_io(dev, &config_io, &config_io_resp);
+	if (err) return err;
+	got->n_timers = config_io_resp.n_timers;
+	got->counters = config_io_resp.counter_enable;
+	got->offset = config_io_resp.pin_offset;
+	// the U6's analog inputs have pins of their own
+	got->digital = true;
+	got->analog = 0;
+	return 0;
+}
+
+
+// Latency profiles are rough figures for a full-speed USB connection: the U6
+// turns commands around faster than the U3, and clocks I2C faster too.
+const struct ljmodel ljmodel_u3 = {
+	.name = "U3",
+	.product_id = U3_PRODUCT_ID,
+	.max_offset = LJU3_EIO0,
+	.scl_pin = LJU3_FIO4,
+	.sda_pin = LJU3_FIO5,
+	.sim_profile = {.rtt_us = 1000, .cmd_us = 150, .i2c_byte_us = 60},
+	.open = u3_open,
+	.read_config = u3_read_config,
+	.config_io = u3_config_io,
+	.config_timers = u3_config_timers,
+	.square_clock = lju3_square_clock,
+	.pack_feedback = lju3_pack_feedback,
+	.feedback_resp_len = lju3_feedback_resp_len,
+	.unpack_feedback = lju3_unpack_feedback,
+	.feedback = lju3_feedback,
+	.read_counter = lju3_read_counter,
+	.resync = lju3_resync,
+};
+
+// the U6 has the same timer clocks and Feedback framing as the U3
+const struct ljmodel ljmodel_u6 = {
+	.name = "U6",
+	.product_id = U6_PRODUCT_ID,
+	.max_offset = LJU3_EIO0,
+	.scl_pin = LJU3_FIO2,
+	.sda_pin = LJU3_FIO3,
+	.sim_profile = {.rtt_us = 600, .cmd_us = 50, .i2c_byte_us = 40},
+	.open = u6_open,
+	.read_config = u6_read_config,
+	.config_io = u6_config_io,
+	.config_timers = lju6_config_timers,
+	.square_clock = lju3_square_clock,
+	.pack_feedback = lju3_pack_feedback,
+	.feedback_resp_len = lju3_feedback_resp_len,
+	.unpack_feedback = lju3_unpack_feedback,
+	.feedback = lju3_feedback,
+	.read_counter = lju3_read_counter,
+	.resync = lju3_resync,
+};
+
+
+const struct ljmodel *ljmodel_from_name(const char *name)
+{
+	if (!strcasecmp(name, ljmodel_u3.name)) return &ljmodel_u3;
+	if (!strcasecmp(name, ljmodel_u6.name)) return &ljmodel_u6;
+	return NULL;
+}
+
+
+uint8_t ljmodel_io_pack(const struct ljmodel_io *io)
+{
+	return (io->n_timers & 3) | (io->counters & 3) << 2 | io->offset << 4;
+}
+
+
+void ljmodel_io_unpack(uint8_t timer_counter_config, struct ljmodel_io *io)
+{
+	io->n_timers = timer_counter_config & 3;
+	io->counters = timer_counter_config >> 2 & 3;
+	io->offset = timer_counter_config >> 4;
+	io->digital = true;
+	io->analog = 0;
+}
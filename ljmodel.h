@@ -0,0 +1,107 @@
+/** Per-model operations for UD-family devices.
+ * Everything the plugin does that depends on which LabJack it's talking to
+ * goes through one of these tables, so that the same pipeline can run on a
+ * U3 or a U6. The framing in labjack_ud.h is common to all of them, and so
+ * are the Feedback and I2C commands as far as we use them; the tables point
+ * those at the shared implementations, and differ in how the device is
+ * configured.
+ */
+#ifndef LJMODEL_H_
+#define LJMODEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "labjack_ud.h"
+#include "labjack_u3.h"
+#include "ljsim.h"
+
+/** What we need to know about a device once it's open. */
+struct ljmodel_info {
+	uint32_t serial_number;
+	uint16_t product_id;
+	uint16_t firmware_version;
+	uint16_t bootloader_version;
+	uint16_t hardware_version;
+	uint8_t local_id;
+};
+
+/** Timer and counter pin assignment, whatever the model calls it. */
+struct ljmodel_io {
+	uint8_t n_timers;
+	uint8_t counters;	// bit 0 for counter 0, bit 1 for counter 1
+	ljud_pin offset;	// pin the first timer (or counter) is on
+	bool digital;		// flexible pins digital and spare outputs off
+	uint16_t analog;	// except these, FIO in the low byte, EIO high
+};
+
+struct ljmodel {
+	const char *name;
+	unsigned long product_id;
+	ljud_pin max_offset;	// highest pin timers and counters can start on
+	ljud_pin scl_pin;	// where an LJTick usually sits
+	ljud_pin sda_pin;
+	/** Rough latency of the real thing, for simulating it. */
+	struct ljsim_profile sim_profile;
+
+	/** Open the dev_num'th device of this model over USB (from 1). */
+	struct ljud_dev *(*open)(unsigned dev_num);
+
+	/** Read serial number and versions. */
+	int (*read_config)(struct ljud_dev *dev, struct ljmodel_info *info);
+
+	/** Set the timer and counter pins (if set isn't NULL, also making
+	 * flexible pins digital) and read back what the device holds.
+	 */
+	int (*config_io)(struct ljud_dev *dev,
+		const struct ljmodel_io *set, struct ljmodel_io *got
+	);
+
+	/** Set the timer clock, enable timers and counters, and set each
+	 * timer's mode and value, as lju3_config_timers does.
+	 */
+	int (*config_timers)(struct ljud_dev *dev,
+		lju3_clock_config clock_config, uint8_t clock_divisor,
+		ljud_pin offset, uint8_t counters,
+		unsigned n_timers, const lju3_timer_mode *modes,
+		const uint16_t *values
+	);
+
+	/** Work out the timer clock and value for a square wave. */
+	void (*square_clock)(unsigned long hz_req,
+		lju3_clock_config *clock_config, uint8_t *clock_divisor,
+		uint16_t *value, double *hz_real
+	);
+
+	/** Feedback batching, as the lju3_ functions of the same names. */
+	unsigned (*pack_feedback)(uint8_t *tx,
+		const uint8_t *cmd, unsigned n_cmd
+	);
+	unsigned (*feedback_resp_len)(unsigned n_resp);
+	int (*unpack_feedback)(const uint8_t *rx,
+		uint8_t *resp, unsigned n_resp
+	);
+	int (*feedback)(struct ljud_dev *dev,
+		const uint8_t *cmd, unsigned n_cmd,
+		uint8_t *resp, unsigned n_resp
+	);
+	int (*read_counter)(struct ljud_dev *dev, unsigned counter,
+		bool reset, uint32_t *count
+	);
+	int (*resync)(struct ljud_dev *dev, unsigned max_reads);
+};
+
+extern const struct ljmodel ljmodel_u3;
+extern const struct ljmodel ljmodel_u6;
+
+/** Look up a model by name, like "U3" or "u6". Returns NULL if unknown. */
+const struct ljmodel *ljmodel_from_name(const char *name);
+
+/** Pack an ljmodel_io the way the U3's ConfigIO has it, which is how ljcache
+ * keeps it whatever the model. digital isn't kept.
+ */
+uint8_t ljmodel_io_pack(const struct ljmodel_io *io);
+
+/** Undo ljmodel_io_pack, with digital set and no analog pins. */
+void ljmodel_io_unpack(uint8_t timer_counter_config, struct ljmodel_io *io);
+
+#endif
@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ljmon.h"
+
+
+int ljmon_create(struct ljmon *mon, const char *name)
+{
+	memset(mon, 0, sizeof(struct ljmon));
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) return -errno;
+	if (ftruncate(fd, sizeof(struct ljmon_shm))) {
+		int err = -errno;
+		close(fd);
+		shm_unlink(name);
+		return err;
+	}
+	struct ljmon_shm *shm = mmap(NULL, sizeof(struct ljmon_shm),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+	);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		int err = -errno;
+		shm_unlink(name);
+		return err;
+	}
+	mon->name = strdup(name);
+	if (!mon->name) {
+		munmap(shm, sizeof(struct ljmon_shm));
+		shm_unlink(name);
+		return -ENOMEM;
+	}
+	shm->version = LJMON_VERSION;
+	shm->pid = getpid();
+	// readers check the magic number first, so write it last
+	atomic_thread_fence(memory_order_release);
+	shm->magic = LJMON_MAGIC;
+	mon->shm = shm;
+	return 0;
+}
+
+
+void ljmon_publish(struct ljmon *mon, const struct ljmon_snapshot *snap)
+{
+	struct ljmon_shm *shm = mon->shm;
+	uint32_t n = snap->n_chans < LJCHAN_MAX ? snap->n_chans : LJCHAN_MAX;
+	uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+	atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+	// nobody may see the copy start before they see the odd number
+	atomic_thread_fence(memory_order_release);
+	memcpy(&shm->snap, snap,
+		offsetof(struct ljmon_snapshot, chans)
+		+ n * sizeof(struct ljmon_chan)
+	);
+	atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+
+void ljmon_destroy(struct ljmon *mon)
+{
+	if (mon->shm) {
+		munmap(mon->shm, sizeof(struct ljmon_shm));
+		mon->shm = NULL;
+	}
+	if (mon->name) {
+		shm_unlink(mon->name);
+		free(mon->name);
+		mon->name = NULL;
+	}
+}
+
+
+const struct ljmon_shm *ljmon_open(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct ljmon_shm)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	const struct ljmon_shm *shm = mmap(NULL, sizeof(struct ljmon_shm),
+		PROT_READ, MAP_SHARED, fd, 0
+	);
+	close(fd);
+	if (shm == MAP_FAILED) return NULL;
+	if (shm->magic != LJMON_MAGIC || shm->version != LJMON_VERSION) {
+		munmap((void *)shm, sizeof(struct ljmon_shm));
+		errno = EPROTO;
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	return shm;
+}
+
+
+int ljmon_read(const struct ljmon_shm *shm, struct ljmon_snapshot *snap,
+	unsigned tries
+) {
+	// the page is mapped read-only, and an atomic load doesn't write
+	_Atomic uint32_t *seq = (_Atomic uint32_t *)&shm->seq;
+	for (unsigned i = 0; i < tries; i++) {
+		uint32_t s0 = atomic_load_explicit(seq, memory_order_acquire);
+		if (s0 & 1) continue;
+		memcpy(snap, &shm->snap, sizeof(struct ljmon_snapshot));
+		// the copy has to be done before we look at the number again
+		atomic_thread_fence(memory_order_acquire);
+		uint32_t s1 = atomic_load_explicit(seq, memory_order_relaxed);
+		if (s0 != s1) continue;
+		if (snap->n_chans > LJCHAN_MAX) snap->n_chans = LJCHAN_MAX;
+		return 0;
+	}
+	return -EAGAIN;
+}
+
+
+void ljmon_close(const struct ljmon_shm *shm)
+{
+	munmap((void *)shm, sizeof(struct ljmon_shm));
+}
@@ -0,0 +1,103 @@
+/** Publishing what the plugin last applied, for monitors in other processes.
+ * The plugin copies a snapshot of its channels into a page of POSIX shared
+ * memory every loop, guarded by a sequence lock: the writer makes the
+ * sequence number odd, copies, and makes it even again, and a reader retries
+ * its copy if the number was odd or changed underneath it. The writer never
+ * waits on or makes a syscall for a reader, so any number of monitors can
+ * poll at any rate without slowing the loop down.
+ */
+#ifndef LJMON_H_
+#define LJMON_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "ljchan.h"
+
+#define LJMON_MAGIC 0x4C4A4D4E	// "LJMN"
+#define LJMON_VERSION 3
+#define LJMON_DEFAULT_NAME "/aylp_ljmon"
+
+/** What happened to a channel on the last loop. */
+enum {
+	LJMON_WRITTEN,	// written
+	LJMON_WAITING,	// not due yet, going by its period
+	LJMON_HELD,	// due, but held back for the budget
+	LJMON_UNMAPPED,	// its element is past the end of the state vector
+};
+
+/** How the last loop went. */
+enum {
+	LJMON_OK,
+	LJMON_FAILED,	// I/O failed and the loop was given up on
+	LJMON_LOST,	// the device is gone and we're reconnecting
+};
+
+struct ljmon_chan {
+	uint32_t index;		// state vector element
+	uint8_t output;		// an ljchan_output
+	uint8_t status;		// LJMON_WRITTEN etc.
+	uint16_t code;		// last code written
+	double value;		// in state vector units, as the code has it
+	uint64_t t_ns;		// when it was last written, CLOCK_MONOTONIC, by
+				// the device's clock if we're correlating it
+	double residual;	// last prediction residual, NAN if not predicting
+};
+
+struct ljmon_snapshot {
+	uint64_t t_ns;		// when this was published, CLOCK_MONOTONIC
+	uint64_t n_loops;
+	uint64_t n_failed;
+	uint32_t status;	// LJMON_OK etc.
+	uint32_t n_inputs;
+	double inputs[2];	// timer input readings, NAN if missed
+	double delay_ns;	// estimated actuation delay
+	double drift_ppm;	// device clock against ours, 0 if not known
+	uint32_t n_chans;
+	uint32_t reserved;
+	struct ljmon_chan chans[LJCHAN_MAX];	// only n_chans are valid
+};
+
+struct ljmon_shm {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;		// of the writer
+	/** Odd while the writer is copying. */
+	_Alignas(64) _Atomic uint32_t seq;
+	_Alignas(64) struct ljmon_snapshot snap;
+};
+
+/** Writer-side state. */
+struct ljmon {
+	struct ljmon_shm *shm;
+	char *name;
+};
+
+/** Create the shared memory page. Any old one with the same name is
+ * replaced. Returns 0 or negative error code.
+ */
+int ljmon_create(struct ljmon *mon, const char *name);
+
+/** Publish a snapshot. Only the first snap->n_chans channels are copied. */
+void ljmon_publish(struct ljmon *mon, const struct ljmon_snapshot *snap);
+
+/** Unlink the page. Monitors that have it mapped keep the last snapshot. */
+void ljmon_destroy(struct ljmon *mon);
+
+/** Map a published page read-only, for monitors. Returns NULL and sets errno
+ * on failure: ENOENT if nothing's been published under that name, EPROTO if
+ * it isn't ours.
+ */
+const struct ljmon_shm *ljmon_open(const char *name);
+
+/** Take a consistent copy of the latest snapshot, trying up to tries times
+ * while the writer is busy. Returns 0, or -EAGAIN if the writer never held
+ * still long enough.
+ */
+int ljmon_read(const struct ljmon_shm *shm, struct ljmon_snapshot *snap,
+	unsigned tries
+);
+
+/** Unmap a page from ljmon_open. */
+void ljmon_close(const struct ljmon_shm *shm);
+
+#endif
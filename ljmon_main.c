@@ -0,0 +1,144 @@
+/** aylp_ljmon: watch what aylp_ljtdac is applying, from another process.
+ * See ljmon.h for how it's published.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ljmon.h"
+
+static volatile sig_atomic_t running = 1;
+
+static const char *const loop_status[] = {
+	[LJMON_OK] = "ok",
+	[LJMON_FAILED] = "failed",
+	[LJMON_LOST] = "lost",
+};
+
+static const char *const chan_status[] = {
+	[LJMON_WRITTEN] = "written",
+	[LJMON_WAITING] = "waiting",
+	[LJMON_HELD] = "held",
+	[LJMON_UNMAPPED] = "unmapped",
+};
+
+
+static void stop(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static const char *name_of(const char *const *names, size_t n, unsigned i)
+{
+	return i < n && names[i] ? names[i] : "?";
+}
+#define NAME_OF(names, i) name_of(names, sizeof(names) / sizeof(*names), i)
+
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-n name] [-i interval_ms] [-1]\n"
+		"  -n name         shared memory name (default %s)\n"
+		"  -i interval_ms  time between snapshots (default 500)\n"
+		"  -1              print one snapshot and exit\n",
+		argv0, LJMON_DEFAULT_NAME
+	);
+}
+
+
+static void print_snapshot(const struct ljmon_snapshot *snap)
+{
+	uint64_t t = now_ns();
+	printf("loop %lu  %s  %.3f ms ago  %lu failed  delay %.1f us",
+		(unsigned long)snap->n_loops,
+		NAME_OF(loop_status, snap->status),
+		(t - snap->t_ns) * 1e-6, (unsigned long)snap->n_failed,
+		snap->delay_ns * 1e-3
+	);
+	if (snap->drift_ppm) printf("  drift %+.2f ppm", snap->drift_ppm);
+	printf("\n");
+	for (uint32_t i = 0; i < snap->n_chans; i++) {
+		const struct ljmon_chan *c = &snap->chans[i];
+		printf("  [%2u] %-4s  code %5u  %12.6g  %-8s",
+			c->index, ljchan_output_name(c->output), c->code,
+			c->value, NAME_OF(chan_status, c->status)
+		);
+		if (c->t_ns)
+			printf("  written %.3f ms ago", (t - c->t_ns) * 1e-6);
+		if (!isnan(c->residual))
+			printf("  residual %.6g", c->residual);
+		printf("\n");
+	}
+	for (uint32_t i = 0; i < snap->n_inputs && i < 2; i++) {
+		printf("  input %u  %12.6g\n", i, snap->inputs[i]);
+	}
+	fflush(stdout);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *name = LJMON_DEFAULT_NAME;
+	unsigned long interval_ms = 500;
+	bool once = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:i:1h")) != -1) {
+		switch (opt) {
+		case 'n': name = optarg; break;
+		case 'i': interval_ms = strtoul(optarg, NULL, 0); break;
+		case '1': once = true; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	const struct ljmon_shm *shm = ljmon_open(name);
+	if (!shm) {
+		fprintf(stderr, "couldn't open %s: %s\n", name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "watching pid %d on %s\n", (int)shm->pid, name);
+
+	struct sigaction sa = {.sa_handler = stop};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	struct ljmon_snapshot snap;
+	while (running) {
+		int err = ljmon_read(shm, &snap, 1000);
+		if (err) {
+			fprintf(stderr, "ljmon_read returned %d: %s\n",
+				err, strerror(-err)
+			);
+		} else {
+			print_snapshot(&snap);
+		}
+		if (once) break;
+		struct timespec ts = {
+			.tv_sec = interval_ms / 1000,
+			.tv_nsec = interval_ms % 1000 * 1000000,
+		};
+		nanosleep(&ts, NULL);
+	}
+
+	ljmon_close(shm);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+#include <math.h>
+#include <string.h>
+
+#include "ljpredict.h"
+
+
+// Evaluate the polynomial through the k newest points s ns after the newest,
+// as a Lagrange interpolation with times taken relative to the newest.
+static double extrapolate(const uint64_t *t, const double *x,
+	unsigned k, double s
+) {
+	double u1 = -(double)(t[0] - t[1]);
+	if (u1 >= 0) return x[0];
+	if (k < 3) return x[0] + (x[0] - x[1]) * s / -u1;
+	double u2 = -(double)(t[0] - t[2]);
+	if (u2 >= u1) return x[0];
+	return x[0] * (s - u1) * (s - u2) / (u1 * u2)
+		+ x[1] * s * (s - u2) / (u1 * (u1 - u2))
+		+ x[2] * s * (s - u1) / (u2 * (u2 - u1));
+}
+
+
+void ljpredict_init(struct ljpredict *p, unsigned order)
+{
+	memset(p, 0, sizeof(struct ljpredict));
+	p->order = order > 2 ? 2 : order;
+	for (size_t i = 0; i < LJCHAN_MAX; i++) p->resid[i] = NAN;
+}
+
+
+void ljpredict_delay(struct ljpredict *p, uint64_t delay_ns)
+{
+	double x = delay_ns;
+	p->delay_ns = p->n_delays ? p->delay_ns + (x - p->delay_ns) / 8 : x;
+	p->n_delays += 1;
+}
+
+
+void ljpredict_apply(struct ljpredict *p, size_t n, uint64_t t, double *x)
+{
+	if (!p->order) return;
+	if (n > LJCHAN_MAX) n = LJCHAN_MAX;
+	unsigned k = p->order + 1;
+
+	// see how well last loop's fit did at guessing this loop
+	if (p->n_hist >= k) {
+		double s = t - p->t[0];
+		for (size_t i = 0; i < n; i++) {
+			double r = x[i] - extrapolate(p->t, p->x[i], k, s);
+			p->resid[i] = r;
+			if (!isfinite(r)) continue;
+			p->resid_sq_sum[i] += r * r;
+			p->n_resid[i] += 1;
+		}
+	}
+
+	p->t[2] = p->t[1];
+	p->t[1] = p->t[0];
+	p->t[0] = t;
+	for (size_t i = 0; i < n; i++) {
+		p->x[i][2] = p->x[i][1];
+		p->x[i][1] = p->x[i][0];
+		p->x[i][0] = x[i];
+	}
+	if (p->n_hist < 3) p->n_hist += 1;
+
+	// fit what history there is, up to the order asked for
+	if (p->n_hist < k) k = p->n_hist;
+	if (k < 2) return;
+	for (size_t i = 0; i < n; i++) {
+		double y = extrapolate(p->t, p->x[i], k, p->delay_ns);
+		// NaNs anywhere in the history mean no fit
+		if (isfinite(y)) x[i] = y;
+	}
+}
+
+
+double ljpredict_rms(const struct ljpredict *p, size_t i)
+{
+	if (!p->n_resid[i]) return NAN;
+	return sqrt(p->resid_sq_sum[i] / p->n_resid[i]);
+}
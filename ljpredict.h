@@ -0,0 +1,53 @@
+/** Extrapolating setpoints forward over the actuation delay.
+ * A setpoint reaches the plant some time after proc sees it, once its packet
+ * has gone over USB and its I2C write has run. At high loop gains that delay
+ * eats into phase margin. This keeps the last few setpoints of each channel
+ * with when they were seen, fits a line or a parabola through them, and
+ * evaluates it the estimated delay ahead, so what lands on the DAC is closer
+ * to what the controller wants by the time it lands.
+ *
+ * The delay is estimated from when each loop's writes completed, relative to
+ * when its setpoints were taken. Each channel's residual is how far its last
+ * setpoint was from where the previous loop's fit said it would be, which is
+ * how well the predictor is tracking.
+ */
+#ifndef LJPREDICT_H_
+#define LJPREDICT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ljchan.h"
+
+struct ljpredict {
+	unsigned order;		// 0 for off, 1 for a line, 2 for a parabola
+	double delay_ns;	// moving average of the actuation delay
+	uint64_t n_delays;	// delay measurements so far
+
+	// the last three loops, newest first
+	unsigned n_hist;
+	uint64_t t[3];
+	double x[LJCHAN_MAX][3];
+
+	double resid[LJCHAN_MAX];	// last residual, NAN if there isn't one
+	double resid_sq_sum[LJCHAN_MAX];
+	uint64_t n_resid[LJCHAN_MAX];
+};
+
+/** Start over with a predictor of the given order (0 to 2). */
+void ljpredict_init(struct ljpredict *p, unsigned order);
+
+/** Fold in one measured delay, from taking setpoints to the writes having
+ * completed.
+ */
+void ljpredict_delay(struct ljpredict *p, uint64_t delay_ns);
+
+/** Take this loop's n setpoints x, seen at time t (in ns), and replace each
+ * with its extrapolation delay_ns ahead. Channels with too little history so
+ * far, or NaN setpoints, are left alone. Does nothing if order is 0.
+ */
+void ljpredict_apply(struct ljpredict *p, size_t n, uint64_t t, double *x);
+
+/** Root mean square residual of channel i so far, or NAN if none yet. */
+double ljpredict_rms(const struct ljpredict *p, size_t i);
+
+#endif
@@ -0,0 +1,111 @@
+/** ljpredict_test: check that the setpoint predictor extrapolates lines and
+ * parabolas exactly, however unevenly the loops are spaced, and that it keeps
+ * its hands off channels it can't fit.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ljpredict.h"
+
+static int n_failed;
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #cond \
+		); \
+		n_failed += 1; \
+	} \
+} while (0)
+
+#define near(a, b) (fabs((a) - (b)) < 1e-9)
+
+// loop times in ns, unevenly spaced as a real loop's are
+static const uint64_t t[] = {
+	1000000000, 1001000000, 1002500000, 1003100000, 1005000000,
+};
+#define N_LOOPS (sizeof(t) / sizeof(t[0]))
+#define DELAY_NS 400000
+
+// the setpoints, in seconds since the first loop
+static double line(uint64_t ns)
+{
+	return 3.0 * (ns - t[0]) * 1e-9 - 1.0;
+}
+
+static double parabola(uint64_t ns)
+{
+	double s = (ns - t[0]) * 1e-9;
+	return 2e5 * s * s - 40.0 * s + 0.5;
+}
+
+
+static void check_order(unsigned order, double (*f)(uint64_t))
+{
+	struct ljpredict p;
+	ljpredict_init(&p, order);
+	ljpredict_delay(&p, DELAY_NS);
+	for (unsigned i = 0; i < N_LOOPS; i++) {
+		// channel 1 goes NaN for a loop, which stays in its history
+		double x[2] = {f(t[i]), i == 1 ? NAN : f(t[i])};
+		ljpredict_apply(&p, 2, t[i], x);
+		if (i < 1) {
+			// nothing to fit to yet
+			check(x[0] == f(t[i]));
+		} else if (i < order) {
+			// not enough for this order, but enough for a line
+			check(near(x[0], line(t[i] + DELAY_NS)) == (f == line));
+		} else {
+			check(near(x[0], f(t[i] + DELAY_NS)));
+		}
+		if (i >= 1 && i <= order + 1) {
+			check(i == 1 ? isnan(x[1]) : x[1] == f(t[i]));
+		} else if (i > order + 1) {
+			check(near(x[1], f(t[i] + DELAY_NS)));
+		}
+	}
+	// each loop after the first order + 1 was right where the fit said
+	check(p.n_resid[0] == N_LOOPS - order - 1);
+	check(ljpredict_rms(&p, 0) < 1e-9);
+}
+
+
+int main(void)
+{
+	// the delay is a moving average over 8 loops
+	struct ljpredict p;
+	ljpredict_init(&p, 1);
+	ljpredict_delay(&p, 800);
+	check(p.delay_ns == 800);
+	ljpredict_delay(&p, 1600);
+	check(p.delay_ns == 900);
+	check(isnan(ljpredict_rms(&p, 0)));
+
+	// off leaves setpoints alone
+	ljpredict_init(&p, 0);
+	ljpredict_delay(&p, DELAY_NS);
+	for (unsigned i = 0; i < N_LOOPS; i++) {
+		double x = line(t[i]);
+		ljpredict_apply(&p, 1, t[i], &x);
+		check(x == line(t[i]));
+	}
+
+	check_order(1, line);
+	check_order(2, line);
+	check_order(2, parabola);
+
+	// and a line through a parabola misses, which the residuals show
+	ljpredict_init(&p, 1);
+	for (unsigned i = 0; i < N_LOOPS; i++) {
+		double x = parabola(t[i]);
+		ljpredict_apply(&p, 1, t[i], &x);
+	}
+	check(ljpredict_rms(&p, 0) > 1e-3);
+
+	if (n_failed) {
+		fprintf(stderr, "%d checks failed\n", n_failed);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
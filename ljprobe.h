@@ -0,0 +1,39 @@
+/** Static tracepoints (USDT), for correlating the plugin with the kernel.
+ * When sys/sdt.h is around at build time, each probe compiles to a single nop
+ * plus an ELF note saying where it is and where its arguments live. Nothing
+ * runs until a tracer like bpftrace or perf attaches and patches the nop, so
+ * they cost nothing otherwise. Arguments should be things already in
+ * registers or on the stack, since they're worked out regardless. Without
+ * sys/sdt.h the probes compile to nothing at all.
+ *
+ * Probes belong to the aylp_labjack provider:
+ *
+ *   proc_entry(vector_size)	proc was called
+ *   proc_return(err)		proc is about to return err
+ *   build_start(n_chans)	starting to pack a loop's packets
+ *   pack_chan(index, output, code)	a channel was packed
+ *   build_end(n_packets, n_feedback_bytes, read)	packets are packed
+ *   usb_write_start(n)		LJUSB_Write is about to send n bytes
+ *   usb_write_done(n, ret)	LJUSB_Write returned ret
+ *   usb_read_start(n)		LJUSB_Read is about to wait for n bytes
+ *   usb_read_done(n, ret)	LJUSB_Read returned ret
+ *   checksum_fail(ours, cmd, n)	a bad checksum: ours is 1 if the device
+ *				refused our packet, 0 if its response was bad
+ *
+ * See contrib/bpftrace for example scripts.
+ */
+#ifndef LJPROBE_H_
+#define LJPROBE_H_
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define LJ_PROBE1(name, a) STAP_PROBE1(aylp_labjack, name, a)
+#define LJ_PROBE2(name, a, b) STAP_PROBE2(aylp_labjack, name, a, b)
+#define LJ_PROBE3(name, a, b, c) STAP_PROBE3(aylp_labjack, name, a, b, c)
+#else
+#define LJ_PROBE1(name, a) do {} while (0)
+#define LJ_PROBE2(name, a, b) do {} while (0)
+#define LJ_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
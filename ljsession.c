@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "labjack_u3.h"
+#include "ljsession.h"
+
+
+struct ljsession;
+
+struct member {
+	struct ljsession *s;
+	bool done;		// finished this loop
+	bool failed;		// the device failed us since our last call
+	unsigned n_queued;	// our packets waiting to go out
+	// responses waiting to be read
+	struct {
+		uint8_t buf[LJUD_PACKET_MAX];
+		unsigned n;
+	} ring[LJSESSION_RING];
+	unsigned head;
+	unsigned tail;
+};
+
+struct ljsession {
+	struct ljsession *next;
+	pthread_mutex_t lock;
+	unsigned long product_id;
+	uint32_t serial;
+	struct ljud_dev *dev;
+	struct member *members[LJSESSION_MAX_MEMBERS];
+	unsigned n_members;
+	unsigned n_done;
+
+	// member packets, oldest first
+	struct {
+		struct member *m;
+		uint8_t tx[LJUD_PACKET_MAX];
+		unsigned n_tx;
+	} queue[LJSESSION_QUEUE];
+	unsigned n_queue;
+
+	struct ljsession_stats stats;
+};
+
+static_assert(LJSESSION_QUEUE <= LJU3_MERGE_JOBS, "LJSESSION_QUEUE too big");
+
+// every session in the process
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ljsession *sessions;
+
+
+static void deliver(struct member *m, const uint8_t *rx, unsigned n)
+{
+	if (m->tail - m->head >= LJSESSION_RING) {
+		// member isn't reading its responses
+		m->s->stats.n_dropped += 1;
+		return;
+	}
+	unsigned i = m->tail++ % LJSESSION_RING;
+	memcpy(m->ring[i].buf, rx, n);
+	m->ring[i].n = n;
+}
+
+
+// Send the oldest queued packets, as many as fit in one batch of device
+// packets, and hand out their responses. Needs s->lock.
+static void flush_batch(struct ljsession *s)
+{
+	struct lju3_merge merge;
+	unsigned last_out[LJSESSION_MAX_MEMBERS] = {0};
+	unsigned n_jobs = 0;
+	lju3_merge_reset(&merge);
+
+	for (; n_jobs < s->n_queue; n_jobs++) {
+		struct member *m = s->queue[n_jobs].m;
+		unsigned k = 0;
+		while (s->members[k] != m) k++;
+		int o = lju3_merge_add(&merge,
+			s->queue[n_jobs].tx, s->queue[n_jobs].n_tx,
+			last_out[k], s->product_id == U3_PRODUCT_ID
+		);
+		// no room; the rest wait for the next batch
+		if (o < 0) break;
+		last_out[k] = o;
+	}
+	lju3_merge_run(&merge, s->dev);
+
+	// Hand the responses back. A short response reads as a failed read on
+	// the member's side, which is the closest thing to what happened.
+	for (unsigned j = 0; j < n_jobs; j++) {
+		struct member *m = s->queue[j].m;
+		uint8_t buf[LJUD_PACKET_MAX];
+		m->n_queued -= 1;
+		int n = lju3_merge_result(&merge, j, buf);
+		if (n < 0) m->failed = true;
+		else deliver(m, buf, n);
+	}
+	s->n_queue -= n_jobs;
+	memmove(s->queue, s->queue + n_jobs, s->n_queue * sizeof(s->queue[0]));
+
+	s->stats.n_member_packets += n_jobs;
+	s->stats.n_device_packets += merge.n_sent;
+	s->stats.n_flushes += 1;
+}
+
+
+static void flush(struct ljsession *s)
+{
+	while (s->n_queue) flush_batch(s);
+}
+
+
+// Everyone's finished a loop, or someone's started the next one without
+// waiting for the rest: either way, send what's queued and start over.
+static void next_loop(struct ljsession *s)
+{
+	flush(s);
+	for (unsigned k = 0; k < s->n_members; k++)
+		s->members[k]->done = false;
+	s->n_done = 0;
+}
+
+
+static unsigned long member_write(void *ctx, const uint8_t *buf, unsigned long n)
+{
+	struct member *m = ctx;
+	struct ljsession *s = m->s;
+	if (n > LJUD_PACKET_MAX) return 0;
+	pthread_mutex_lock(&s->lock);
+	if (m->failed) {
+		m->failed = false;
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+	if (m->done) next_loop(s);
+	if (s->n_queue >= LJSESSION_QUEUE) flush_batch(s);
+	s->queue[s->n_queue].m = m;
+	memcpy(s->queue[s->n_queue].tx, buf, n);
+	s->queue[s->n_queue].n_tx = n;
+	s->n_queue += 1;
+	m->n_queued += 1;
+	pthread_mutex_unlock(&s->lock);
+	return n;
+}
+
+
+static unsigned long member_read(void *ctx, uint8_t *buf, unsigned long n)
+{
+	struct member *m = ctx;
+	struct ljsession *s = m->s;
+	unsigned long n_rx = 0;
+	pthread_mutex_lock(&s->lock);
+	// our response hasn't been asked for yet, so send everyone's along
+	if (m->head == m->tail && m->n_queued) flush(s);
+	if (m->head != m->tail) {
+		unsigned i = m->head++ % LJSESSION_RING;
+		n_rx = m->ring[i].n < n ? m->ring[i].n : n;
+		memcpy(buf, m->ring[i].buf, n_rx);
+	} else {
+		m->failed = false;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return n_rx;
+}
+
+
+// Unlink a session nobody's in any more and close its device. Needs
+// registry_lock.
+static void drop_session(struct ljsession *s)
+{
+	struct ljsession **p = &sessions;
+	while (*p != s) p = &(*p)->next;
+	*p = s->next;
+	ljud_close(s->dev);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+
+static void member_close(void *ctx)
+{
+	struct member *m = ctx;
+	struct ljsession *s = m->s;
+	pthread_mutex_lock(&registry_lock);
+	pthread_mutex_lock(&s->lock);
+	// our writes still go out, even if nobody hears back
+	flush(s);
+	unsigned k = 0;
+	while (s->members[k] != m) k++;
+	if (m->done) s->n_done -= 1;
+	s->members[k] = s->members[--s->n_members];
+	free(m);
+	bool last = !s->n_members;
+	// the rest might have been waiting on us
+	if (!last && s->n_done == s->n_members) next_loop(s);
+	pthread_mutex_unlock(&s->lock);
+	if (last) drop_session(s);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+
+static const struct ljud_transport member_transport = {
+	.name = "session",
+	.write = member_write,
+	.read = member_read,
+	.close = member_close,
+};
+
+
+struct ljud_dev *ljsession_join(unsigned long product_id, uint32_t serial,
+	struct ljud_dev *(*open)(void *arg), void *arg
+) {
+	int err = 0;
+	struct ljud_dev *dev = NULL;
+	struct member *m = calloc(1, sizeof(struct member));
+	if (!m) return NULL;
+	pthread_mutex_lock(&registry_lock);
+	struct ljsession *s = sessions;
+	while (s && (s->product_id != product_id || s->serial != serial))
+		s = s->next;
+	if (!s) {
+		s = calloc(1, sizeof(struct ljsession));
+		if (!s) {
+			err = ENOMEM;
+			goto out;
+		}
+		s->dev = open(arg);
+		if (!s->dev) {
+			err = errno;
+			free(s);
+			goto out;
+		}
+		pthread_mutex_init(&s->lock, NULL);
+		s->product_id = product_id;
+		s->serial = serial;
+		s->next = sessions;
+		sessions = s;
+	}
+	pthread_mutex_lock(&s->lock);
+	if (s->n_members >= LJSESSION_MAX_MEMBERS) {
+		err = EBUSY;
+	} else {
+		dev = ljud_open(&member_transport, m, product_id);
+		if (!dev) err = ENOMEM;
+	}
+	if (dev) {
+		m->s = s;
+		s->members[s->n_members++] = m;
+	}
+	pthread_mutex_unlock(&s->lock);
+	// don't leave a session we just made behind with nobody in it
+	if (!s->n_members) drop_session(s);
+out:
+	pthread_mutex_unlock(&registry_lock);
+	if (!dev) {
+		free(m);
+		errno = err;
+	}
+	return dev;
+}
+
+
+void ljsession_loop_done(struct ljud_dev *dev)
+{
+	if (dev->ops != &member_transport) return;
+	struct member *m = dev->ctx;
+	struct ljsession *s = m->s;
+	pthread_mutex_lock(&s->lock);
+	if (!m->done) {
+		m->done = true;
+		s->n_done += 1;
+	}
+	if (s->n_done == s->n_members) next_loop(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+
+void ljsession_stats(struct ljud_dev *dev, struct ljsession_stats *stats)
+{
+	memset(stats, 0, sizeof(struct ljsession_stats));
+	if (dev->ops != &member_transport) return;
+	struct ljsession *s = ((struct member *)dev->ctx)->s;
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	stats->n_members = s->n_members;
+	pthread_mutex_unlock(&s->lock);
+}
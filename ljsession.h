@@ -0,0 +1,53 @@
+/** Sharing one device between plugin instances in the same process.
+ * Every instance that asks for the same device joins its session, and the
+ * first one in opens it. Members' packets are queued rather than sent, and go
+ * out together, with Feedback commands from different members merged into as
+ * few Feedback packets as they fit in, either when a member wants a response
+ * it doesn't have yet or when every member has finished its loop. Each member
+ * reads back the responses it would have got from the device alone.
+ *
+ * Since the pipeline runs each instance's proc in turn, a member that only
+ * writes has its packets held until a later member reads or the loop ends, so
+ * with the writers ahead of the readers in the pipeline, each loop takes one
+ * round trip per device however many instances share it. Merging needs a U3;
+ * other models' packets are still sent together, but one for one.
+ */
+#ifndef LJSESSION_H_
+#define LJSESSION_H_
+
+#include <stdint.h>
+#include "labjack_ud.h"
+
+#define LJSESSION_MAX_MEMBERS 8
+/** Most member packets queued before they're sent anyway. */
+#define LJSESSION_QUEUE 64
+/** Most responses a member can leave unread. */
+#define LJSESSION_RING 64
+
+struct ljsession_stats {
+	unsigned n_members;
+	uint64_t n_member_packets;	// packets members sent
+	uint64_t n_device_packets;	// packets that went to the device
+	uint64_t n_flushes;		// round trips
+	uint64_t n_dropped;		// responses nobody read in time
+};
+
+/** Join the session for the device with this product ID and serial number
+ * (0 for the default one), opening it with open(arg) if this is the first
+ * member. Closing the returned device leaves the session, and the last member
+ * out closes the real one. Returns NULL and sets errno on failure: EBUSY if
+ * the session is full.
+ */
+struct ljud_dev *ljsession_join(unsigned long product_id, uint32_t serial,
+	struct ljud_dev *(*open)(void *arg), void *arg
+);
+
+/** Say this member has finished its loop. Once every member has, anything
+ * still queued goes out.
+ */
+void ljsession_loop_done(struct ljud_dev *dev);
+
+/** Get the counters of the session this member belongs to. */
+void ljsession_stats(struct ljud_dev *dev, struct ljsession_stats *stats);
+
+#endif
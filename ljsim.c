@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "labjack_u3.h"
+#include "labjack_u6.h"
+#include "ljsim.h"
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void wait_until(uint64_t t)
+{
+	uint64_t now = now_ns();
+	if (t > now + 100000) {
+		// sleep most of the way, then spin for accuracy
+		uint64_t dt = t - now - 50000;
+		struct timespec ts = {
+			.tv_sec = dt / 1000000000, .tv_nsec = dt % 1000000000
+		};
+		nanosleep(&ts, NULL);
+	}
+	while (now_ns() < t);
+}
+
+
+// Queue up a response that will be ready at the given time.
+static void respond(struct ljsim *sim, uint8_t *rx, unsigned n, uint64_t ready)
+{
+	if (sim->n_drop) {
+		sim->n_drop -= 1;
+		return;
+	}
+	if (sim->n_corrupt && n > 2) {
+		sim->n_corrupt -= 1;
+		rx[0] = rx[1] = 0xB8;
+		n = 2;
+	}
+	if (n >= sizeof(struct ljud_extended_header)) {
+		struct ljud_extended_header *head = (void *)rx;
+		head->command = 0xF8;
+		head->n_data_words = (n - 6) / 2;
+		head->checksum16 = ljud_checksum16(rx + 6, n - 6);
+		head->checksum8 = ljud_checksum8(rx + 1, 5);
+	}
+	if (sim->tail - sim->head >= LJSIM_QUEUE) {
+		sim->n_dropped += 1;
+		return;
+	}
+	unsigned i = sim->tail++ % LJSIM_QUEUE;
+	memcpy(sim->queue[i].buf, rx, n);
+	sim->queue[i].n = n;
+	sim->queue[i].ready_ns = ready;
+}
+
+
+static uint32_t system_timer(struct ljsim *sim, uint64_t t)
+{
+	return (t - sim->t0_ns) * (LJU3_SYSTEM_TIMER_HZ / 1000000) / 1000;
+}
+
+
+static void set_bit(struct ljsim *sim, uint8_t *ports, uint8_t b)
+{
+	unsigned pin = b & 0x1F;
+	if (pin >= 24) return;
+	if (b & 0x80) ports[pin / 8] |= 1 << (pin % 8);
+	else ports[pin / 8] &= ~(1 << (pin % 8));
+	(void)sim;
+}
+
+
+// What an AIN reads, following the LJTick-DAC if it's wired back to it.
+static uint16_t ain(struct ljsim *sim, unsigned ch)
+{
+	for (unsigned k = 0; k < 2; k++) {
+		if (sim->ljtdac_ain[k] != (int)ch) continue;
+		double dac_slope = fp642dbl(k
+			? sim->ljtdac_cal.dacb_slope : sim->ljtdac_cal.daca_slope
+		);
+		double dac_offset = fp642dbl(k
+			? sim->ljtdac_cal.dacb_offset
+			: sim->ljtdac_cal.daca_offset
+		);
+		double v = (sim->ljtdac_codes[k] - dac_offset) / dac_slope
+			* sim->ljtdac_ain_gain;
+		double slope, offset;
+		lju3_ain_cal(&sim->u3_cal, sim->hv, ch, &slope, &offset);
+		double raw = (v - offset) / slope;
+		if (!(raw > 0)) raw = 0;
+		if (raw > 0xFFFF) raw = 0xFFFF;
+		// 12 bits, left-justified
+		return (uint16_t)raw & 0xFFF0;
+	}
+	return sim->ain[ch];
+}
+
+
+// Run a Feedback command, returning the length of response data in rx.
+static unsigned feedback(struct ljsim *sim,
+	const uint8_t *tx, unsigned n_tx, uint8_t *rx, uint64_t t
+) {
+	unsigned o = 9;
+	unsigned i = sizeof(struct lju3_feedback_header);
+	uint8_t frame = 0;
+	while (i < n_tx) {
+		const uint8_t *c = tx + i;
+		unsigned n_c, n_r;
+		if (lju3_iotype_len(c[0], &n_c, &n_r)) {
+			// padding ends the command; anything else is an error
+			if (c[0] && i + 1 < n_tx) {
+				rx[6] = LJ_IOTYPE_NOT_VALID;
+				rx[7] = frame;
+			}
+			break;
+		}
+		if (i + n_c > n_tx) break;
+		uint8_t *r = rx + o;
+		switch (c[0]) {
+		case AIN: {
+			uint16_t v = ain(sim, c[1] & 0x1F);
+			r[0] = v & 0xFF;
+			r[1] = v >> 8;
+			break;
+		}
+		case BIT_STATE_READ:
+			r[0] = sim->port_state[(c[1] & 0x1F) / 8]
+				>> ((c[1] & 0x1F) % 8) & 1;
+			break;
+		case BIT_DIR_READ:
+			r[0] = sim->port_dir[(c[1] & 0x1F) / 8]
+				>> ((c[1] & 0x1F) % 8) & 1;
+			break;
+		case BIT_STATE_WRITE:
+			set_bit(sim, sim->port_state, c[1]);
+			break;
+		case BIT_DIR_WRITE:
+			set_bit(sim, sim->port_dir, c[1]);
+			break;
+		case PORT_STATE_READ:
+			memcpy(r, sim->port_state, 3);
+			break;
+		case PORT_DIR_READ:
+			memcpy(r, sim->port_dir, 3);
+			break;
+		case PORT_STATE_WRITE:
+		case PORT_DIR_WRITE: {
+			uint8_t *ports = c[0] == PORT_STATE_WRITE
+				? sim->port_state : sim->port_dir;
+			for (unsigned k = 0; k < 3; k++) {
+				ports[k] = (ports[k] & ~c[1 + k])
+					| (c[4 + k] & c[1 + k]);
+			}
+			break;
+		}
+		case TIMER2:
+		case TIMER3:
+			// only the U6 has these
+			if (sim->product_id != U6_PRODUCT_ID) break;
+			// fall through
+		case TIMER0:
+		case TIMER1: {
+			unsigned k = (c[0] - TIMER0) / 2;
+			uint32_t v = sim->timer_values[k];
+			if (sim->timer_modes[k] == LJU3_TIMER_READ_LOW) {
+				v = system_timer(sim, t);
+			} else if (sim->timer_modes[k] == LJU3_TIMER_READ_HIGH) {
+				v = 0;
+			}
+			r[0] = v;
+			r[1] = v >> 8;
+			r[2] = v >> 16;
+			r[3] = v >> 24;
+			if (c[1] & 1) sim->timer_values[k] = c[2] | c[3] << 8;
+			if (c[1] & 2) sim->timer_values[k] = 0;
+			break;
+		}
+		case TIMER2_CONFIG:
+		case TIMER3_CONFIG:
+			if (sim->product_id != U6_PRODUCT_ID) break;
+			// fall through
+		case TIMER0_CONFIG:
+		case TIMER1_CONFIG: {
+			unsigned k = (c[0] - TIMER0_CONFIG) / 2;
+			sim->timer_modes[k] = c[1];
+			sim->timer_values[k] = c[2] | c[3] << 8;
+			break;
+		}
+		case COUNTER0:
+		case COUNTER1: {
+			unsigned k = c[0] - COUNTER0;
+			uint32_t v = sim->counters[k];
+			if (sim->profile.counter_hz > 0) {
+				v += (t - sim->t0_ns) * 1e-9
+					* sim->profile.counter_hz;
+			}
+			r[0] = v;
+			r[1] = v >> 8;
+			r[2] = v >> 16;
+			r[3] = v >> 24;
+			if (c[1] & 1) sim->counters[k] -= v;
+			break;
+		}
+		default:
+			break;
+		}
+		i += n_c;
+		o += n_r;
+		frame += 1;
+	}
+	rx[8] = tx[6];	// echo
+	return o;
+}
+
+
+// Run an I2C command against the LJTick-DAC, returning the response length
+// and adding the bus time to *busy.
+static unsigned i2c(struct ljsim *sim,
+	const uint8_t *tx, unsigned n_tx, uint8_t *rx, uint64_t *busy
+) {
+	const struct ljud_i2c_header *head = (const void *)tx;
+	struct ljud_i2c_resp_header *resp = (void *)rx;
+	unsigned n_w = head->n_i2c_bytes_tx;
+	unsigned n_r = head->n_i2c_bytes_rx;
+	const uint8_t *w = tx + sizeof(struct ljud_i2c_header);
+	uint8_t *r = rx + sizeof(struct ljud_i2c_resp_header);
+	if (sizeof(struct ljud_i2c_header) + n_w > n_tx) {
+		resp->err = LJ_TOO_FEW_BYTES;
+		return sizeof(struct ljud_i2c_resp_header);
+	}
+	// speed_adjust 0 is full speed, and 255 about 1/15 of it
+	*busy += (uint64_t)(n_w + n_r + 1) * sim->profile.i2c_byte_us
+		* (18 + head->speed_adjust) * 1000 / 18;
+	bool ack = false;
+	if (head->speed_adjust < sim->i2c_min_speed_adjust) {
+		// too fast for the bus: nobody hears us, and we read back junk
+		memset(r, 0xFF, n_r);
+	} else if (head->address_byte == 0xA0) {
+		// EEPROM: first byte written is the address to read from
+		ack = true;
+		uint8_t cal[256] = {0};
+		memcpy(cal + 0x40, &sim->ljtdac_cal, sizeof(sim->ljtdac_cal));
+		unsigned addr = n_w ? w[0] : 0;
+		for (unsigned k = 0; k < n_r; k++) r[k] = cal[(addr + k) & 0xFF];
+	} else if (head->address_byte == 0x24 && n_w == 0) {
+		ack = true;
+	} else if (head->address_byte == 0x24 && n_w == 3) {
+		ack = true;
+		if (sim->ljtdac_stuck) {
+			// ignore it
+		} else if (w[0] == 0x30) {
+			sim->ljtdac_codes[0] = w[1] << 8 | w[2];
+		} else if (w[0] == 0x31) {
+			sim->ljtdac_codes[1] = w[1] << 8 | w[2];
+		}
+	}
+	if (ack) {
+		// one ACK for the address and one for each byte written
+		uint32_t acks = n_w + 1 >= 32
+			? 0xFFFFFFFF : (1U << (n_w + 1)) - 1;
+		resp->ackarray0 = acks;
+		resp->ackarray1 = acks >> 8;
+		resp->ackarray2 = acks >> 16;
+		resp->ackarray3 = acks >> 24;
+	}
+	return (sizeof(struct ljud_i2c_resp_header) + n_r + 1) & ~1U;
+}
+
+
+static unsigned long sim_write(void *ctx, const uint8_t *tx, unsigned long n)
+{
+	struct ljsim *sim = ctx;
+	uint8_t rx[LJUD_PACKET_MAX] = {0};
+	unsigned n_rx;
+	uint64_t t = now_ns();
+	sim->n_writes += 1;
+	if (sim->unplugged || sim->n_writes == sim->fail_write_at) return 0;
+
+	// the device runs commands one at a time, in order
+	uint64_t start = t + sim->profile.rtt_us * 500ULL;
+	if (start < sim->busy_until_ns) start = sim->busy_until_ns;
+	uint64_t busy = sim->profile.cmd_us * 1000ULL;
+
+	if (n < sizeof(struct ljud_extended_header) || tx[1] != 0xF8) {
+		// we only speak extended commands
+		rx[0] = rx[1] = 0xB8;
+		respond(sim, rx, 2, start);
+		return n;
+	}
+	if (
+		*(const uint16_t *)(tx + 4) != ljud_checksum16(
+			(uint8_t *)tx + 6, n - 6
+		)
+	) {
+		rx[0] = rx[1] = 0xB8;
+		respond(sim, rx, 2, start);
+		return n;
+	}
+
+	rx[3] = tx[3];
+	switch (tx[3]) {
+	case 0x00:
+		n_rx = (feedback(sim, tx, n, rx, start) + 1) & ~1U;
+		break;
+	case 0x08: {
+		if (sim->product_id == U6_PRODUCT_ID) {
+			struct lju6_config_resp *resp = (void *)rx;
+			resp->firmware_version = 0x0191;
+			resp->hardware_version = 0x0200;
+			resp->serial_number = sim->serial_number;
+			resp->product_id = 6;
+			n_rx = sizeof(struct lju6_config_resp);
+			break;
+		}
+		struct lju3_config_resp *resp = (void *)rx;
+		resp->firmware_version = 0x0146;
+		resp->hardware_version = 0x011E;
+		resp->serial_number = sim->serial_number;
+		resp->product_id = 3;
+		resp->timer_counter_mask = sim->timer_counter_config;
+		resp->fio_analog = sim->fio_analog;
+		resp->eio_analog = sim->eio_analog;
+		resp->clock_config = sim->clock_config;
+		resp->clock_divisor = sim->clock_divisor;
+		n_rx = sizeof(struct lju3_config_resp);
+		break;
+	}
+	case 0x0A: {
+		const struct lju3_config_timer_clock *cmd = (const void *)tx;
+		struct lju3_config_timer_clock_resp *resp = (void *)rx;
+		if (cmd->clock_config & LJU3_WRITE_CLOCK_CONFIG) {
+			sim->clock_config = cmd->clock_config & 0x07;
+			sim->clock_divisor = cmd->clock_divisor;
+		}
+		resp->clock_config = sim->clock_config;
+		resp->clock_divisor = sim->clock_divisor;
+		n_rx = sizeof(struct lju3_config_timer_clock_resp);
+		break;
+	}
+	case 0x0B: {
+		if (sim->product_id == U6_PRODUCT_ID) {
+			const struct lju6_config_io *cmd = (const void *)tx;
+			struct lju6_config_io_resp *resp = (void *)rx;
+			if (cmd->write_mask & 1 << 0) {
+				sim->n_timers = cmd->n_timers;
+				sim->counter_enable = cmd->counter_enable;
+				sim->pin_offset = cmd->pin_offset;
+			}
+			resp->n_timers = sim->n_timers;
+			resp->counter_enable = sim->counter_enable;
+			resp->pin_offset = sim->pin_offset;
+			n_rx = sizeof(struct lju6_config_io_resp);
+			break;
+		}
+		const struct lju3_config_io *cmd = (const void *)tx;
+		struct lju3_config_io_resp *resp = (void *)rx;
+		if (cmd->write_mask & 1 << 0)
+			sim->timer_counter_config = cmd->timer_counter_config;
+		if (cmd->write_mask & 1 << 1)
+			sim->dac1_enable = cmd->dac1_enable;
+		if (cmd->write_mask & 1 << 2)
+			sim->fio_analog = cmd->fio_analog;
+		if (cmd->write_mask & 1 << 3)
+			sim->eio_analog = cmd->eio_analog;
+		resp->timer_counter_config = sim->timer_counter_config;
+		resp->dac1_enable = sim->dac1_enable;
+		resp->fio_analog = sim->fio_analog;
+		resp->eio_analog = sim->eio_analog;
+		n_rx = sizeof(struct lju3_config_io_resp);
+		break;
+	}
+	case 0x2D: {
+		// calibration memory, the U3's whatever the model
+		struct lju3_readmem_resp *resp = (void *)rx;
+		unsigned block = n > 7 ? tx[7] : 0;
+		if (block < sizeof(sim->u3_cal) / sizeof(resp->data)) {
+			memcpy(resp->data, (uint8_t *)&sim->u3_cal
+				+ block * sizeof(resp->data),
+				sizeof(resp->data)
+			);
+		} else {
+			resp->err = LJ_INVALID_BLOCK;
+		}
+		n_rx = sizeof(struct lju3_readmem_resp);
+		break;
+	}
+	case 0x3A: {
+		// SPI: MISO is looped back to MOSI
+		unsigned n_b = n > 13 ? tx[13] : 0;
+		if (14 + n_b > n || n_b > sizeof(sim->spi_bytes)) {
+			rx[6] = LJ_TOO_MANY_BYTES;
+			n_rx = 8;
+			break;
+		}
+		memcpy(sim->spi_bytes, tx + 14, n_b);
+		sim->n_spi_bytes = n_b;
+		rx[7] = n_b;
+		memcpy(rx + 8, tx + 14, n_b);
+		n_rx = (8 + n_b + 1) & ~1U;
+		break;
+	}
+	case 0x3B:
+		n_rx = i2c(sim, tx, n, rx, &busy);
+		break;
+	default:
+		rx[6] = LJ_FUNCTION_INVALID;
+		n_rx = 10;
+		break;
+	}
+	sim->busy_until_ns = start + busy;
+	respond(sim, rx, n_rx, start + busy + sim->profile.rtt_us * 500ULL);
+	return n;
+}
+
+
+static unsigned long sim_read(void *ctx, uint8_t *rx, unsigned long n)
+{
+	struct ljsim *sim = ctx;
+	sim->n_reads += 1;
+	if (sim->unplugged) return 0;
+	// a real device would time out; we don't need to wait to know
+	if (sim->head == sim->tail) return 0;
+	unsigned i = sim->head++ % LJSIM_QUEUE;
+	wait_until(sim->queue[i].ready_ns);
+	unsigned long n_rx = sim->queue[i].n;
+	if (n_rx > n) n_rx = n;
+	memcpy(rx, sim->queue[i].buf, n_rx);
+	return n_rx;
+}
+
+
+static void sim_close(void *ctx)
+{
+	free(ctx);
+}
+
+
+static const struct ljud_transport sim_transport = {
+	.name = "sim",
+	.write = sim_write,
+	.read = sim_read,
+	.close = sim_close,
+};
+
+
+struct ljud_dev *ljsim_open(
+	unsigned long product_id, const struct ljsim_profile *profile
+) {
+	struct ljsim *sim = calloc(1, sizeof(struct ljsim));
+	if (!sim) return NULL;
+	if (profile) sim->profile = *profile;
+	sim->product_id = product_id;
+	sim->serial_number = 320000000 + product_id;
+	sim->timer_counter_config = 0x40;
+	sim->t0_ns = now_ns();
+	for (unsigned i = 0; i < 32; i++) sim->ain[i] = 0x8000;
+	// nominal LJTick-DAC calibration: +-10 V over 16 bits
+	sim->ljtdac_cal.daca_slope = dbl2fp64(3158.6);
+	sim->ljtdac_cal.daca_offset = dbl2fp64(32624.0);
+	sim->ljtdac_cal.dacb_slope = dbl2fp64(3158.6);
+	sim->ljtdac_cal.dacb_offset = dbl2fp64(32624.0);
+	sim->ljtdac_cal.serial_number = 100000;
+	// not wired back to any AIN until a test says so
+	sim->ljtdac_ain[0] = -1;
+	sim->ljtdac_ain[1] = -1;
+	sim->ljtdac_ain_gain = 1.0;
+	// nominal U3 calibration: 0 to 2.44 V single-ended on the low voltage
+	// inputs, about +-10.3 V on the high voltage ones
+	sim->u3_cal.block0.lv_ain_se_slope = dbl2fp64(2.44 / 65536);
+	sim->u3_cal.block0.lv_ain_se_offset = dbl2fp64(0.0);
+	sim->u3_cal.block0.lv_ain_diff_slope = dbl2fp64(4.88 / 65536);
+	sim->u3_cal.block0.lv_ain_diff_offset = dbl2fp64(-2.44);
+	sim->u3_cal.block1.dac0_slope = dbl2fp64(51.717);
+	sim->u3_cal.block1.dac1_slope = dbl2fp64(51.717);
+	sim->u3_cal.block2.vref_cal = dbl2fp64(2.44);
+	sim->u3_cal.block3.hv_ain0_slope = dbl2fp64(3.14e-4);
+	sim->u3_cal.block3.hv_ain1_slope = dbl2fp64(3.14e-4);
+	sim->u3_cal.block3.hv_ain2_slope = dbl2fp64(3.14e-4);
+	sim->u3_cal.block3.hv_ain3_slope = dbl2fp64(3.14e-4);
+	sim->u3_cal.block4.hv_ain0_offset = dbl2fp64(-10.3);
+	sim->u3_cal.block4.hv_ain1_offset = dbl2fp64(-10.3);
+	sim->u3_cal.block4.hv_ain2_offset = dbl2fp64(-10.3);
+	sim->u3_cal.block4.hv_ain3_offset = dbl2fp64(-10.3);
+	struct ljud_dev *dev = ljud_open(&sim_transport, sim, product_id);
+	if (!dev) {
+		free(sim);
+		errno = ENOMEM;
+	}
+	return dev;
+}
@@ -0,0 +1,98 @@
+/** A simulated U3 or U6 with an LJTick-DAC, behind the ljud_transport
+ * interface, for exercising everything above the transport without hardware.
+ * It answers the commands we use with well-formed responses, and can model
+ * USB and command latency so that timing comparisons mean something.
+ */
+#ifndef LJSIM_H_
+#define LJSIM_H_
+
+#include <stdint.h>
+#include "labjack_ud.h"
+#include "labjack_u3.h"
+#include "ljtdac.h"
+
+#define LJSIM_QUEUE 64
+
+/** Latency model. A command arrives rtt_us/2 after it's written, waits for
+ * the device to finish earlier commands, takes cmd_us (plus i2c_byte_us per
+ * I2C byte at full speed, or up to 15 times that going by speed_adjust) to
+ * run, and its response is readable rtt_us/2 after that.
+ */
+struct ljsim_profile {
+	unsigned rtt_us;
+	unsigned cmd_us;
+	unsigned i2c_byte_us;
+	double counter_hz;	// rate at which edges turn up on the counters
+};
+
+struct ljsim {
+	struct ljsim_profile profile;
+	unsigned long product_id;	// U3_PRODUCT_ID or U6_PRODUCT_ID
+
+	// device state
+	uint32_t serial_number;
+	uint8_t timer_counter_config;	// U3 ConfigIO
+	uint8_t n_timers;		// U6 ConfigIO
+	uint8_t counter_enable;
+	uint8_t pin_offset;
+	uint8_t dac1_enable;
+	uint8_t fio_analog;
+	uint8_t eio_analog;
+	uint8_t clock_config;
+	uint8_t clock_divisor;
+	uint8_t timer_modes[4];
+	uint32_t timer_values[4];	// what a timer read returns
+	uint32_t counters[2];
+	uint8_t port_state[3];		// FIO, EIO, CIO
+	uint8_t port_dir[3];
+	uint16_t ain[32];		// raw AIN readings, by channel
+	struct lju3_cal_mem u3_cal;	// nominal, for ReadCal
+	bool hv;			// AIN0-3 are high voltage, as on a U3-HV
+	struct ljtdac_cal_mem ljtdac_cal;
+	uint16_t ljtdac_codes[2];	// last codes written to DACA, DACB
+	int8_t ljtdac_ain[2];		// AIN each DAC is wired back to, or -1
+	double ljtdac_ain_gain;		// of whatever's in between
+	uint8_t spi_bytes[64];		// last SPI transfer
+	unsigned n_spi_bytes;
+
+	// fault injection, for exercising error recovery
+	unsigned n_corrupt;	// answer the next so many with a bad checksum
+	unsigned n_drop;	// lose the next so many responses
+	bool unplugged;		// fail every write and read
+	unsigned long fail_write_at;	// fail the write n_writes reaches this on
+	bool ljtdac_stuck;	// DACs ACK writes but keep their old codes
+	uint8_t i2c_min_speed_adjust;	// NACK any I2C run faster than this
+
+	// queued responses
+	struct {
+		uint8_t buf[LJUD_PACKET_MAX];
+		unsigned n;
+		uint64_t ready_ns;
+	} queue[LJSIM_QUEUE];
+	unsigned head;
+	unsigned tail;
+	uint64_t busy_until_ns;
+	uint64_t t0_ns;
+
+	// statistics
+	unsigned long n_writes;
+	unsigned long n_reads;
+	unsigned long n_dropped;	// responses lost to a full queue
+};
+
+/** Make a simulated device with a nominal LJTick-DAC calibration. product_id
+ * picks the model, which decides how ConfigU3/ConfigU6 and ConfigIO look and
+ * how many timers there are. profile may be NULL for no added latency. The
+ * simulation is freed by ljud_close.
+ */
+struct ljud_dev *ljsim_open(
+	unsigned long product_id, const struct ljsim_profile *profile
+);
+
+/** Get at the simulation behind a device from ljsim_open. */
+static inline struct ljsim *ljsim_get(struct ljud_dev *dev)
+{
+	return dev->ctx;
+}
+
+#endif
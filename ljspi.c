@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <string.h>
+
+#include "ljspi.h"
+
+
+int ljspi_pack(uint8_t *tx, const struct ljspi_bus *bus,
+	const uint8_t *w, unsigned n
+) {
+	const unsigned n_head = sizeof(struct ljud_extended_header);
+	if (n > LJSPI_DATA_MAX) return -EMSGSIZE;
+	// command packets are a whole number of words long, so an odd number
+	// of bytes gets a zero of padding
+	const unsigned n_tx = LJSPI_TX(n);
+	memset(tx, 0, n_tx);
+	if (n) memcpy(tx + sizeof(struct ljud_spi_header), w, n);
+
+	struct ljud_spi_header *head = (struct ljud_spi_header *)tx;
+	head->spi_options = bus->options;
+	head->clock_factor = bus->clock_factor;
+	head->cs_pin = bus->cs_pin;
+	head->clk_pin = bus->clk_pin;
+	head->miso_pin = bus->miso_pin;
+	head->mosi_pin = bus->mosi_pin;
+	head->n_spi_bytes = n;
+
+	head->header.command = 0xF8;
+	head->header.extended_command = 0x3A;
+	head->header.n_data_words = (n_tx - n_head) / 2;
+	head->header.checksum16 = ljud_checksum16(tx + 6, n_tx - 6);
+	head->header.checksum8 = ljud_checksum8(tx + 1, n_head - 1);
+	return n_tx;
+}
+
+
+int ljspi_unpack(const uint8_t *rx, uint8_t *r, unsigned n)
+{
+	const struct ljud_spi_resp_header *resp = (const void *)rx;
+	if (resp->err) return resp->err;
+	if (resp->n_spi_bytes != n) return -EBADMSG;
+	if (r && n) memcpy(r, rx + sizeof(struct ljud_spi_resp_header), n);
+	return 0;
+}
+
+
+int ljspi_transfer(struct ljud_dev *dev, const struct ljspi_bus *bus,
+	const uint8_t *w, uint8_t *r, unsigned n
+) {
+	int err;
+	uint8_t tx[LJUD_PACKET_MAX];
+	uint8_t rx[LJUD_PACKET_MAX];
+	int n_tx = ljspi_pack(tx, bus, w, n);
+	if (n_tx < 0) return n_tx;
+	if (ljud_write(dev, tx, n_tx) < (unsigned long)n_tx) return -ECOMM;
+	err = ljud_read_resp(dev, rx, LJSPI_RX(n));
+	if (err) return err;
+	return ljspi_unpack(rx, r, n);
+}
+
+
+void ljspi_dac_set_range(struct ljspi_dac *dac, uint8_t chan,
+	double v_min, double v_max
+) {
+	double code_max = (1UL << dac->data_bits) - 1;
+	dac->slope[chan] = code_max / (v_max - v_min);
+	dac->offset[chan] = -v_min * dac->slope[chan];
+}
+
+
+uint16_t ljspi_dac_code(const struct ljspi_dac *dac, uint8_t chan,
+	double voltage
+) {
+	double code_max = (1UL << dac->data_bits) - 1;
+	double code = voltage * dac->slope[chan] + dac->offset[chan];
+	// negative codes would wrap around to the top of the range
+	if (!(code > 0.0)) return 0;
+	if (code >= code_max) return code_max;
+	return code + 0.5;
+}
+
+
+// Put a word into w, most significant byte first, and return its length.
+static unsigned put_word(const struct ljspi_dac *dac, uint8_t *w,
+	uint32_t word
+) {
+	unsigned n_b = dac->word_bits / 8;
+	for (unsigned i = 0; i < n_b; i++)
+		w[i] = word >> 8 * (n_b - 1 - i);
+	return n_b;
+}
+
+
+int ljspi_dac_pack_write(uint8_t *tx, const struct ljspi_dac *dac,
+	unsigned n, const uint8_t *chan, const uint16_t *code
+) {
+	uint8_t w[LJSPI_DATA_MAX];
+	uint32_t mask = (1UL << dac->data_bits) - 1;
+	unsigned n_w = 0;
+	if (n * (dac->word_bits / 8) > LJSPI_DATA_MAX) return -EMSGSIZE;
+	for (unsigned i = 0; i < n; i++) {
+		uint32_t word = dac->command[chan[i]]
+			| (uint32_t)(code[i] & mask) << dac->data_shift;
+		n_w += put_word(dac, w + n_w, word);
+	}
+	return ljspi_pack(tx, &dac->bus, w, n_w);
+}
+
+
+int ljspi_dac_pack_words(uint8_t *tx, const struct ljspi_dac *dac,
+	unsigned n, const uint32_t *words
+) {
+	uint8_t w[LJSPI_DATA_MAX];
+	unsigned n_w = 0;
+	if (n * (dac->word_bits / 8) > LJSPI_DATA_MAX) return -EMSGSIZE;
+	for (unsigned i = 0; i < n; i++)
+		n_w += put_word(dac, w + n_w, words[i]);
+	return ljspi_pack(tx, &dac->bus, w, n_w);
+}
+
+
+int ljspi_dac_write(struct ljud_dev *dev, const struct ljspi_dac *dac,
+	uint8_t chan, double voltage
+) {
+	int err;
+	uint8_t tx[LJUD_PACKET_MAX];
+	uint8_t rx[LJUD_PACKET_MAX];
+	uint16_t code = ljspi_dac_code(dac, chan, voltage);
+	int n_tx = ljspi_dac_pack_write(tx, dac, 1, &chan, &code);
+	if (n_tx < 0) return n_tx;
+	if (ljud_write(dev, tx, n_tx) < (unsigned long)n_tx) return -ECOMM;
+	unsigned n_b = dac->word_bits / 8;
+	err = ljud_read_resp(dev, rx, LJSPI_RX(n_b));
+	if (err) return err;
+	return ljspi_unpack(rx, NULL, n_b);
+}
@@ -0,0 +1,111 @@
+/** SPI transfers through a UD device's SPI command, and a generic SPI DAC on
+ * top of them.
+ * see: https://support.labjack.com/docs/5-2-15-spi-u3
+ *
+ * The device bit-bangs the bus itself, clocking out each byte of a transfer
+ * (and clocking in as many from MISO) with CS held for the whole transfer
+ * if it's asserting CS automatically.
+ */
+#ifndef LJSPI_H_
+#define LJSPI_H_
+
+#include <stdbool.h>
+#include "labjack_ud.h"
+
+/** Most bytes one SPI command can transfer. */
+#define LJSPI_DATA_MAX (LJUD_PACKET_MAX - sizeof(struct ljud_spi_header))
+
+// lengths of the packets sent and received transferring n bytes
+#define LJSPI_TX(n) ((sizeof(struct ljud_spi_header) + (n) + 1) & ~1U)
+#define LJSPI_RX(n) ((sizeof(struct ljud_spi_resp_header) + (n) + 1) & ~1U)
+
+/** Most channels a struct ljspi_dac can have. */
+#define LJSPI_DAC_MAX 8
+
+/** How a bus is driven. Pins are numbered as in labjack_u3.h. */
+struct ljspi_bus {
+	ljud_spi_options options;	// mode, and LJ_SPI_AUTO_CS as a rule
+	uint8_t clock_factor;	// 0 fastest to 255 slowest
+	ljud_pin cs_pin;
+	ljud_pin clk_pin;
+	ljud_pin miso_pin;
+	ljud_pin mosi_pin;
+};
+
+/** A DAC (or a daisy chain of them) on an SPI bus. Each write to a channel is
+ * a word of word_bits, sent most significant byte first, which is the
+ * channel's command word with the code ORed in at data_shift. Most DACs fit:
+ * the MCP4922's 16-bit words carry a 12-bit code under four config bits, say,
+ * and the DAC8568's 32-bit words a 16-bit code shifted up 4 under its command
+ * and address bits.
+ */
+struct ljspi_dac {
+	struct ljspi_bus bus;
+	uint8_t word_bits;	// 8, 16, 24 or 32
+	uint8_t data_bits;	// width of a code, at most 16
+	uint8_t data_shift;	// where a code's LSB sits in the word
+	uint8_t n;		// channels
+	uint32_t command[LJSPI_DAC_MAX];	// channel words, less codes
+	double slope[LJSPI_DAC_MAX];	// volts to codes
+	double offset[LJSPI_DAC_MAX];	// in codes
+};
+
+/** Build the LJSPI_TX(n)-byte packet that transfers the n bytes in w into tx,
+ * without sending it. Returns the length of the packet, or -EMSGSIZE if n is
+ * more than LJSPI_DATA_MAX.
+ */
+int ljspi_pack(uint8_t *tx, const struct ljspi_bus *bus,
+	const uint8_t *w, unsigned n
+);
+
+/** Check the LJSPI_RX(n)-byte response to a transfer of n bytes (whose
+ * checksums have already been checked), and copy the bytes clocked in out of
+ * it into r, unless r is NULL. Returns 0, positive ljud_err, or -EBADMSG if
+ * the device transferred some other number of bytes.
+ */
+int ljspi_unpack(const uint8_t *rx, uint8_t *r, unsigned n);
+
+/** Transfer n bytes, writing the ones in w and reading as many into r (if it
+ * isn't NULL). Returns 0, positive ljud_err, or negative error code.
+ */
+int ljspi_transfer(struct ljud_dev *dev, const struct ljspi_bus *bus,
+	const uint8_t *w, uint8_t *r, unsigned n
+);
+
+/** Calibrate channel chan so that codes 0 to the largest one span v_min to
+ * v_max volts, which is where a DAC without calibration data starts.
+ */
+void ljspi_dac_set_range(struct ljspi_dac *dac, uint8_t chan,
+	double v_min, double v_max
+);
+
+/** Code for voltage on channel chan, calibration applied and clamped to the
+ * codes there are.
+ */
+uint16_t ljspi_dac_code(const struct ljspi_dac *dac, uint8_t chan,
+	double voltage
+);
+
+/** Build the packet that writes code[i] to channel chan[i] for each of n
+ * channels in one transfer into tx, without sending it. Returns the length of
+ * the packet, or -EMSGSIZE if the words don't fit in one transfer.
+ */
+int ljspi_dac_pack_write(uint8_t *tx, const struct ljspi_dac *dac,
+	unsigned n, const uint8_t *chan, const uint16_t *code
+);
+
+/** Build the packet that sends n raw words, the way channel words go, into tx.
+ * For setup commands like turning on an internal reference. Returns the length
+ * of the packet, or -EMSGSIZE.
+ */
+int ljspi_dac_pack_words(uint8_t *tx, const struct ljspi_dac *dac,
+	unsigned n, const uint32_t *words
+);
+
+/** Set (calibration-adjusted) voltage of channel chan. */
+int ljspi_dac_write(struct ljud_dev *dev, const struct ljspi_dac *dac,
+	uint8_t chan, double voltage
+);
+
+
+#endif
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "ljtdac.h"
 
@@ -19,88 +20,98 @@ struct ljtdac_input{
 }__attribute__((packed));
 static_assert(sizeof(struct ljtdac_input) == 3, "bad ljtdac_input");
 
+// I2C speeds for ljtdac_autotune to try, fastest first
+static const uint8_t tune_speeds[] = {
+	0, 2, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 255,
+};
+#define N_TUNE_SPEEDS (sizeof(tune_speeds) / sizeof(*tune_speeds))
 
-int ljtdac_read_cal_mem(
-	HANDLE dev, struct ljtdac_cal_mem *cal_mem,
-	uint8_t sda_pin, uint8_t scl_pin
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// The LJTick's EEPROM or DAC, on the pins it's plugged into.
+static struct ljud_i2c_slave slave(
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust, uint8_t address
 ) {
-	unsigned long n;
-	// we only have one I2C data byte to send, but command packets are
-	// multiple of words long, so we have to add one extra zero of padding
-	const unsigned n_tx = sizeof(struct ljud_i2c_header) + 2;
-	const unsigned n_rx = (
-		sizeof(struct ljud_i2c_resp_header)
-		+ sizeof(struct ljtdac_cal_mem)
-	);
-	const unsigned n_head = sizeof(struct ljud_extended_header);
-	uint8_t tx[sizeof(struct ljud_i2c_header) + 2] = {0};
-	uint8_t rx[
-		sizeof(struct ljud_i2c_resp_header)
-		+ sizeof(struct ljtdac_cal_mem)
-	];
-
-	tx[sizeof(struct ljud_i2c_header)] = LJTDAC_CAL_MEM_START;
-
-	struct ljud_i2c_header *head = (struct ljud_i2c_header *)tx;
-	head->sda_pin = sda_pin;
-	head->scl_pin = scl_pin;
-	head->address_byte = LJTDAC_EEPROM_I2C;
-	head->n_i2c_bytes_tx = 1;
-	head->n_i2c_bytes_rx = sizeof(struct ljtdac_cal_mem);
-
-	head->header.command = 0xF8;
-	head->header.extended_command = 0x3B;
-	head->header.n_data_words = (n_tx - n_head) / 2;
-	head->header.checksum16 = ljud_checksum16(tx + 6, n_tx - 6);
-	head->header.checksum8 = ljud_checksum8(tx + 1, n_head - 1);
-
-	n = LJUSB_Write(dev, tx, n_tx);
-	if (n < n_tx) return -ECOMM;
-
-	n = LJUSB_Read(dev, rx, n_rx);
-	if (n < n_rx) {
-		// LJ is telling us we have a bad checksum
-		if (*(uint16_t *)rx == 0xB8B8) return -EBADMSG;
-		return -EREMOTEIO;
-	}
+	return (struct ljud_i2c_slave){
+		.speed_adjust = speed_adjust,
+		.sda_pin = sda_pin,
+		.scl_pin = scl_pin,
+		.address = address,
+	};
+}
 
-	if (
-		((struct ljud_i2c_resp_header *)rx)->header.checksum16
-		!= ljud_checksum16(rx + 6, n_rx - 6)
-	) {
-		return -EBADE;
-	}
 
-	memcpy(
-		cal_mem, rx + sizeof(struct ljud_i2c_resp_header),
+int ljtdac_batch_read_cal_mem(struct ljud_batch *batch,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust
+) {
+	struct ljud_i2c_slave eeprom = slave(sda_pin, scl_pin, speed_adjust,
+		LJTDAC_EEPROM_I2C
+	);
+	return ljud_i2c_batch_add(batch, &eeprom, &LJTDAC_CAL_MEM_START, 1,
 		sizeof(struct ljtdac_cal_mem)
 	);
+}
+
+
+int ljtdac_unpack_cal_mem(const struct ljud_batch *batch, unsigned k,
+	struct ljtdac_cal_mem *cal_mem
+) {
+	uint8_t r[sizeof(struct ljtdac_cal_mem)];
+	int err = ljud_i2c_result(batch, k, r, NULL);
+	if (err) return err;
+	memcpy(cal_mem, r, sizeof(struct ljtdac_cal_mem));
 	return 0;
 }
 
 
-int ljtdac_write_dac(
-	HANDLE dev, struct ljtdac_cal_mem *cal_mem,
-	uint8_t sda_pin, uint8_t scl_pin,
-	bool fast, ljtdac_output output, double voltage
+int ljtdac_read_cal_mem(
+	struct ljud_dev *dev, struct ljtdac_cal_mem *cal_mem,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust
+) {
+	int err;
+	struct ljud_batch batch = {0};
+	int k = ljtdac_batch_read_cal_mem(&batch,
+		sda_pin, scl_pin, speed_adjust
+	);
+	if (k < 0) return k;
+	err = ljud_batch_run(dev, &batch, true);
+	if (err) return err;
+	return ljtdac_unpack_cal_mem(&batch, k, cal_mem);
+}
+
+
+int ljtdac_batch_write_code(struct ljud_batch *batch,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust,
+	ljtdac_output output, uint16_t code
 ) {
-	unsigned long n;
-	// we only have three I2C data bytes to send, but command packets are
-	// multiple of words long, so we have to add one extra zero of padding
-	const unsigned n_tx = (
-		sizeof(struct ljud_i2c_header) + sizeof(struct ljtdac_input) + 1
+	if (output != LJTDAC_WRITE_DACA && output != LJTDAC_WRITE_DACB)
+		return -EINVAL;
+	struct ljtdac_input input = {
+		.output = output,
+		.value_high = code >> 8,
+		.value_low = code & 0xFF,
+	};
+	struct ljud_i2c_slave dac = slave(sda_pin, scl_pin, speed_adjust,
+		LJTDAC_DAC_I2C
 	);
-	const unsigned n_rx = sizeof(struct ljud_i2c_resp_header);
-	const unsigned n_head = sizeof(struct ljud_extended_header);
-	uint8_t tx[
-		sizeof(struct ljud_i2c_header) + sizeof(struct ljtdac_input) + 1
-	] = {0};
-	uint8_t rx[sizeof(struct ljud_i2c_resp_header)];
-
-	struct ljtdac_input *input = (struct ljtdac_input *)(
-		tx + sizeof(struct ljud_i2c_header)
+	return ljud_i2c_batch_add(batch, &dac,
+		(const uint8_t *)&input, sizeof(input), 0
 	);
-	input->output = output;
+}
+
+
+int ljtdac_batch_write_dac(struct ljud_batch *batch,
+	struct ljtdac_cal_mem *cal_mem,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust,
+	ljtdac_output output, double voltage
+) {
 	switch (output) {
 	case LJTDAC_WRITE_DACA:
 		voltage *= fp642dbl(cal_mem->daca_slope);
@@ -113,44 +124,107 @@ int ljtdac_write_dac(
 	default:
 		return -EINVAL;
 	}
-	unsigned value = voltage;
-	if ((value) > 0xFFFF) value = 0xFFFF;
-	input->value_high = value >> 8;
-	input->value_low = value & 0xFF;
-
-	struct ljud_i2c_header *head = (struct ljud_i2c_header *)tx;
-	head->sda_pin = sda_pin;
-	head->scl_pin = scl_pin;
-	head->address_byte = LJTDAC_DAC_I2C;
-	head->n_i2c_bytes_tx = sizeof(struct ljtdac_input);
-	head->n_i2c_bytes_rx = 0;
-
-	head->header.command = 0xF8;
-	head->header.extended_command = 0x3B;
-	head->header.n_data_words = (n_tx - n_head) / 2;
-	head->header.checksum16 = ljud_checksum16(tx + 6, n_tx - 6);
-	head->header.checksum8 = ljud_checksum8(tx + 1, n_head - 1);
-
-	n = LJUSB_Write(dev, tx, n_tx);
-	if (n < n_tx) return -ECOMM;
+	// negative codes would wrap around to the top of the range
+	uint16_t code;
+	if (!(voltage > 0.0)) code = 0;
+	else if (voltage >= 0xFFFF) code = 0xFFFF;
+	else code = voltage;
+	return ljtdac_batch_write_code(batch, sda_pin, scl_pin, speed_adjust,
+		output, code
+	);
+}
+
+
+int ljtdac_write_dac(
+	struct ljud_dev *dev, struct ljtdac_cal_mem *cal_mem,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust,
+	bool fast, ljtdac_output output, double voltage
+) {
+	int err;
+	struct ljud_batch batch = {0};
+	int k = ljtdac_batch_write_dac(&batch, cal_mem,
+		sda_pin, scl_pin, speed_adjust, output, voltage
+	);
+	if (k < 0) return k;
 
 	// reading things we don't need to know is slow!
-	if (fast) return 0;
+	err = ljud_batch_run(dev, &batch, !fast);
+	if (err || fast) return err;
+	return ljud_i2c_result(&batch, k, NULL, NULL);
+}
 
-	n = LJUSB_Read(dev, rx, n_rx);
-	if (n < n_rx) {
-		// LJ is telling us we have a bad checksum
-		if (*(uint16_t *)rx == 0xB8B8) return -EBADMSG;
-		return -EREMOTEIO;
-	}
 
-	if (
-		((struct ljud_i2c_resp_header *)rx)->header.checksum16
-		!= ljud_checksum16(rx + 6, n_rx - 6)
-	) {
-		return -EBADE;
+// Run n_trials autotune trials at one speed, adding up the calibration read
+// times in *read_ns. The first trial at the slowest speed fills in ref, and
+// after that every read has to match it. Returns 0 if every trial passed, 1
+// if one failed, or negative error code if the transport failed.
+static int tune_speed(struct ljud_dev *dev, uint8_t sda_pin, uint8_t scl_pin,
+	uint8_t speed_adjust, unsigned n_trials,
+	struct ljtdac_cal_mem *ref, bool have_ref, uint64_t *read_ns
+) {
+	int err;
+	// just the address, so the DAC ACKs without anything being written
+	struct ljud_i2c_slave dac = slave(sda_pin, scl_pin, speed_adjust,
+		LJTDAC_DAC_I2C
+	);
+	*read_ns = 0;
+	for (unsigned i = 0; i < n_trials; i++) {
+		struct ljtdac_cal_mem cal_mem;
+		uint64_t t = now_ns();
+		err = ljtdac_read_cal_mem(dev, &cal_mem,
+			sda_pin, scl_pin, speed_adjust
+		);
+		*read_ns += now_ns() - t;
+		if (err < 0 && err != -ENXIO) return err;
+		if (err) return 1;
+		if (!have_ref) {
+			*ref = cal_mem;
+			have_ref = true;
+		} else if (memcmp(&cal_mem, ref, sizeof(cal_mem))) {
+			return 1;
+		}
+		err = ljud_i2c_write(dev, &dac, NULL, 0);
+		if (err < 0 && err != -ENXIO) return err;
+		if (err) return 1;
 	}
-
 	return 0;
 }
 
+
+int ljtdac_autotune(struct ljud_dev *dev, uint8_t sda_pin, uint8_t scl_pin,
+	unsigned n_trials, unsigned margin, uint8_t *speed_adjust,
+	struct ljtdac_cal_mem *cal_mem, double *read_ns
+) {
+	int err;
+	struct ljtdac_cal_mem ref;
+	uint64_t ns;
+	if (!n_trials) n_trials = 1;
+	// the slowest speed is our reference; if it fails, nothing will work
+	err = tune_speed(dev, sda_pin, scl_pin, tune_speeds[N_TUNE_SPEEDS - 1],
+		n_trials, &ref, false, &ns
+	);
+	if (err < 0) return err;
+	if (err) return -ENXIO;
+	for (size_t k = 0; k < N_TUNE_SPEEDS; k++) {
+		err = tune_speed(dev, sda_pin, scl_pin, tune_speeds[k],
+			n_trials, &ref, true, &ns
+		);
+		if (err < 0) return err;
+		if (err) continue;
+		size_t pick = k ? k + margin : k;
+		if (pick >= N_TUNE_SPEEDS) pick = N_TUNE_SPEEDS - 1;
+		if (pick != k) {
+			// check the setting we'll actually use, and time it
+			err = tune_speed(dev, sda_pin, scl_pin,
+				tune_speeds[pick], n_trials, &ref, true, &ns
+			);
+			if (err < 0) return err;
+			if (err) continue;
+		}
+		*speed_adjust = tune_speeds[pick];
+		*cal_mem = ref;
+		*read_ns = (double)ns / n_trials;
+		return 0;
+	}
+	return -ENXIO;
+}
@@ -1,4 +1,4 @@
-/** Interface for the LJTick-DAC.
+/** Interface for the LJTick-DAC, a client of the I2C API in labjack_ud.h.
  * see: Examples/ljTickDacSimple.py at https://github.com/labjack/LabJackPython
  */
 #ifndef LJTDAC_H_
@@ -23,18 +23,70 @@ enum {
 	LJTDAC_WRITE_DACB	= 0x31,
 };
 
-/** Read calibration memory into a struct lju3_cal_mem. */
-int ljtdac_read_cal_mem(HANDLE dev,
-	struct ljtdac_cal_mem *cal_mem, uint8_t sda_pin, uint8_t scl_pin
+/** Queue the calibration memory read that ljtdac_read_cal_mem does in a
+ * batch. Returns the index of its packet, or negative error code.
+ */
+int ljtdac_batch_read_cal_mem(struct ljud_batch *batch,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust
+);
+
+/** Check the response to a calibration memory read queued at index k of a
+ * batch that's been run, and copy the calibration out of it. Returns as
+ * ljud_i2c_result.
+ */
+int ljtdac_unpack_cal_mem(const struct ljud_batch *batch, unsigned k,
+	struct ljtdac_cal_mem *cal_mem
+);
+
+/** Read calibration memory into a struct ljtdac_cal_mem. speed_adjust is the
+ * U3's I2C clock setting, from 0 (fastest) to 255 (slowest), as it is for
+ * everything else here.
+ */
+int ljtdac_read_cal_mem(struct ljud_dev *dev,
+	struct ljtdac_cal_mem *cal_mem,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust
+);
+
+/** Queue a write of a raw 16-bit code to DACA or DACB in a batch. Returns the
+ * index of its packet, or negative error code.
+ */
+int ljtdac_batch_write_code(struct ljud_batch *batch,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust,
+	ljtdac_output output, uint16_t code
+);
+
+/** Queue the write that ljtdac_write_dac does in a batch. Returns the index of
+ * its packet, or negative error code.
+ */
+int ljtdac_batch_write_dac(struct ljud_batch *batch,
+	struct ljtdac_cal_mem *cal_mem,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust,
+	ljtdac_output output, double voltage
 );
 
 /** Set (calibration-adjusted) voltage of DACA or DACB. */
 int ljtdac_write_dac(
-	HANDLE dev, struct ljtdac_cal_mem *cal_mem,
-	uint8_t sda_pin, uint8_t scl_pin,
+	struct ljud_dev *dev, struct ljtdac_cal_mem *cal_mem,
+	uint8_t sda_pin, uint8_t scl_pin, uint8_t speed_adjust,
 	bool fast, ljtdac_output output, double voltage
 );
 
+/** Find the fastest I2C speed_adjust the LJTick answers reliably at. Settings
+ * are tried from fastest to slowest, n_trials times each; a trial reads
+ * calibration memory and addresses the DAC (without writing it), and passes if
+ * everything is ACKed and the calibration matches what was read at the
+ * slowest setting. The first setting where every trial passes is then backed
+ * off by margin steps, unless it's the fastest there is (nothing failed, so
+ * there's no edge to keep away from). On success, fills in *speed_adjust, the
+ * calibration, and the mean time a calibration read took at that setting.
+ * Returns 0, -ENXIO if the LJTick doesn't answer even at the slowest setting,
+ * or another negative error code.
+ */
+int ljtdac_autotune(struct ljud_dev *dev, uint8_t sda_pin, uint8_t scl_pin,
+	unsigned n_trials, unsigned margin, uint8_t *speed_adjust,
+	struct ljtdac_cal_mem *cal_mem, double *read_ns
+);
+
 
 #endif
 
@@ -0,0 +1,138 @@
+/** ljtdac_test: drive the plugin against a simulated U3 with responses going
+ * missing or getting mangled, and check that the loop retries its way through
+ * them, and that one which runs out of time owns up to the deadline miss and
+ * leaves the resync to the next loop rather than blowing the deadline further.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gsl/gsl_vector.h>
+#include <libaylp/anyloop.h>
+
+#include "labjack_u3.h"
+#include "ljchan.h"
+#include "ljclock.h"
+#include "ljmon.h"
+#include "ljpredict.h"
+#include "ljsim.h"
+#include "ljspi.h"
+#include "ljtdac.h"
+#include "aylp_ljtdac.h"
+
+static int n_failed;
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #cond \
+		); \
+		n_failed += 1; \
+	} \
+} while (0)
+
+
+// Start the plugin on a simulated U3 with retries, and a deadline and
+// realistic latency if deadline_us isn't 0.
+static int start(struct aylp_device *dev, unsigned retries,
+	unsigned deadline_us
+) {
+	json_object *params = json_object_new_object();
+	json_object_object_add(params, "host", json_object_new_string("U3"));
+	json_object_object_add(params, "transport",
+		json_object_new_string("sim")
+	);
+	json_object_object_add(params, "cache", json_object_new_boolean(false));
+	json_object_object_add(params, "retries", json_object_new_int(retries));
+	json_object_object_add(params, "on_miss",
+		json_object_new_string("hold")
+	);
+	if (deadline_us) {
+		json_object_object_add(params, "deadline_us",
+			json_object_new_int(deadline_us)
+		);
+		json_object_object_add(params, "sim_latency",
+			json_object_new_boolean(true)
+		);
+	}
+	memset(dev, 0, sizeof(*dev));
+	dev->params = params;
+	int err = aylp_ljtdac_init(dev);
+	if (err) {
+		fprintf(stderr, "the plugin didn't start\n");
+		json_object_put(params);
+	}
+	return err;
+}
+
+
+static void stop(struct aylp_device *dev)
+{
+	dev->fini(dev);
+	json_object_put(dev->params);
+}
+
+
+// Run a loop setting the DACs to a and b volts.
+static int loop(struct aylp_device *dev, gsl_vector *v, double a, double b)
+{
+	struct aylp_state state = {.vector = v};
+	gsl_vector_set(v, 0, a);
+	gsl_vector_set(v, 1, b);
+	return dev->proc(dev, &state);
+}
+
+
+int main(void)
+{
+	struct aylp_device dev;
+	gsl_vector *v = gsl_vector_alloc(2);
+
+	// A mangled response and a lost one each cost a resync and a retry,
+	// and the writes still get through.
+	if (start(&dev, 2, 0)) return EXIT_FAILURE;
+	struct aylp_ljtdac_data *data = dev.device_data;
+	struct ljsim *sim = ljsim_get(data->dev);
+	check(!loop(&dev, v, 1.0, 2.0));
+	check(data->n_retries == 0);
+	sim->n_corrupt = 1;
+	check(!loop(&dev, v, 2.0, 3.0));
+	check(data->n_retries == 1);
+	check(data->n_resyncs == 1);
+	sim->n_drop = 1;
+	check(!loop(&dev, v, 3.0, 4.0));
+	check(data->n_retries == 2);
+	check(data->n_resyncs == 2);
+	check(data->n_given_up == 0);
+	check(data->n_deadline_misses == 0);
+	uint16_t codes[2] = {sim->ljtdac_codes[0], sim->ljtdac_codes[1]};
+	check(!loop(&dev, v, 3.0, 4.0));
+	check(sim->ljtdac_codes[0] == codes[0]);
+	check(sim->ljtdac_codes[1] == codes[1]);
+	stop(&dev);
+
+	// With a deadline shorter than a round trip, a mangled response is a
+	// miss straight away: no retry, and no resync until the next loop.
+	if (start(&dev, 2, 1)) return EXIT_FAILURE;
+	data = dev.device_data;
+	sim = ljsim_get(data->dev);
+	sim->n_corrupt = 1;
+	check(!loop(&dev, v, 1.0, 2.0));
+	check(data->n_retries == 0);
+	check(data->n_resyncs == 0);
+	check(data->n_given_up == 1);
+	check(data->n_deadline_misses == 1);
+	check(!loop(&dev, v, 2.0, 3.0));
+	check(data->n_resyncs == 1);
+	check(data->n_given_up == 1);
+	check(data->n_deadline_misses == 2);
+	check(sim->head == sim->tail);
+	stop(&dev);
+
+	gsl_vector_free(v);
+	if (n_failed) {
+		fprintf(stderr, "%d checks failed\n", n_failed);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ljtrace.h"
+
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+struct recorder {
+	struct ljud_dev *dev;
+	FILE *file;
+	uint64_t t0;
+	int err;	// what stopped the recording, if anything
+};
+
+
+static void record(struct recorder *rec, uint8_t dir, uint64_t t,
+	const uint8_t *buf, unsigned long n_req, unsigned long n
+) {
+	uint64_t t1 = now_ns(CLOCK_MONOTONIC);
+	struct ljtrace_record r = {
+		.t_ns = t - rec->t0,
+		.lat_ns = t1 - t > UINT32_MAX ? UINT32_MAX : t1 - t,
+		.dir = dir,
+		.n_req = n_req > UINT8_MAX ? UINT8_MAX : n_req,
+		.n = n > UINT8_MAX ? UINT8_MAX : n,
+	};
+	if (rec->err) return;
+	// stdio buffers this, so it's a couple of memcpys most of the time
+	unsigned n_payload = ljtrace_payload_len(&r);
+	if (fwrite(&r, sizeof(r), 1, rec->file) != 1
+		|| fwrite(buf, 1, n_payload, rec->file) != n_payload
+	) {
+		// a record cut off here is where loading stops, so don't write
+		// any more after it
+		rec->err = errno ? -errno : -EIO;
+	}
+}
+
+
+static unsigned long record_write(void *ctx, const uint8_t *buf, unsigned long n)
+{
+	struct recorder *rec = ctx;
+	uint64_t t = now_ns(CLOCK_MONOTONIC);
+	unsigned long ret = ljud_write(rec->dev, buf, n);
+	record(rec, LJTRACE_WRITE, t, buf, n, ret);
+	return ret;
+}
+
+
+static unsigned long record_read(void *ctx, uint8_t *buf, unsigned long n)
+{
+	struct recorder *rec = ctx;
+	uint64_t t = now_ns(CLOCK_MONOTONIC);
+	unsigned long ret = ljud_read(rec->dev, buf, n);
+	record(rec, LJTRACE_READ, t, buf, n, ret);
+	return ret;
+}
+
+
+static void record_close(void *ctx)
+{
+	struct recorder *rec = ctx;
+	fclose(rec->file);
+	ljud_close(rec->dev);
+	free(rec);
+}
+
+
+static const struct ljud_transport record_transport = {
+	.name = "record",
+	.write = record_write,
+	.read = record_read,
+	.close = record_close,
+};
+
+
+struct ljud_dev *ljtrace_record(struct ljud_dev *dev, const char *path)
+{
+	struct recorder *rec = malloc(sizeof(struct recorder));
+	if (!rec) return NULL;
+	rec->dev = dev;
+	rec->file = fopen(path, "wb");
+	if (!rec->file) {
+		free(rec);
+		return NULL;
+	}
+	rec->t0 = now_ns(CLOCK_MONOTONIC);
+	rec->err = 0;
+	struct ljtrace_header head = {
+		.magic = LJTRACE_MAGIC,
+		.version = LJTRACE_VERSION,
+		.product_id = dev->product_id,
+		.start_ns = now_ns(CLOCK_REALTIME),
+	};
+	struct ljud_dev *r = NULL;
+	if (fwrite(&head, sizeof(head), 1, rec->file) == 1)
+		r = ljud_open(&record_transport, rec, dev->product_id);
+	if (!r) {
+		int err = errno;
+		fclose(rec->file);
+		remove(path);
+		free(rec);
+		errno = err ? err : EIO;
+	}
+	return r;
+}
+
+
+int ljtrace_load(const char *path, struct ljtrace *trace)
+{
+	memset(trace, 0, sizeof(struct ljtrace));
+	FILE *file = fopen(path, "rb");
+	if (!file) return -errno;
+	int err = 0;
+	long n = -1;
+	if (!fseek(file, 0, SEEK_END)) n = ftell(file);
+	if (n < 0 || fseek(file, 0, SEEK_SET)) err = -errno;
+	else if ((size_t)n < sizeof(struct ljtrace_header)) err = -EPROTO;
+	if (!err) {
+		trace->buf = malloc(n);
+		if (!trace->buf) err = -ENOMEM;
+		else if (fread(trace->buf, 1, n, file) != (size_t)n) err = -EIO;
+	}
+	fclose(file);
+	if (err) goto fail;
+
+	memcpy(&trace->head, trace->buf, sizeof(struct ljtrace_header));
+	if (trace->head.magic != LJTRACE_MAGIC
+		|| trace->head.version != LJTRACE_VERSION
+	) {
+		err = -EPROTO;
+		goto fail;
+	}
+
+	// two passes: count the records, then index them
+	for (int pass = 0; pass < 2; pass++) {
+		size_t i = sizeof(struct ljtrace_header);
+		size_t k = 0;
+		while (i + sizeof(struct ljtrace_record) <= (size_t)n) {
+			const struct ljtrace_record *r = (const void *)(
+				trace->buf + i
+			);
+			size_t len = sizeof(struct ljtrace_record)
+				+ ljtrace_payload_len(r);
+			if (i + len > (size_t)n) break;
+			if (pass) trace->records[k] = r;
+			k += 1;
+			i += len;
+		}
+		if (!pass) {
+			trace->records = malloc(
+				(k ? k : 1) * sizeof(struct ljtrace_record *)
+			);
+			if (!trace->records) {
+				err = -ENOMEM;
+				goto fail;
+			}
+		}
+		trace->n_records = k;
+	}
+	return 0;
+
+fail:
+	ljtrace_free(trace);
+	return err;
+}
+
+
+void ljtrace_free(struct ljtrace *trace)
+{
+	free(trace->records);
+	free(trace->buf);
+	trace->records = NULL;
+	trace->buf = NULL;
+	trace->n_records = 0;
+}
+
+
+struct replayer {
+	struct ljtrace trace;
+	double scale;
+	size_t i_write;
+	size_t i_read;
+	unsigned long n_mismatches;
+};
+
+
+static void wait_until(uint64_t t)
+{
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	if (t > now + 100000) {
+		// sleep most of the way, then spin for accuracy
+		uint64_t dt = t - now - 50000;
+		struct timespec ts = {
+			.tv_sec = dt / 1000000000, .tv_nsec = dt % 1000000000
+		};
+		nanosleep(&ts, NULL);
+	}
+	while (now_ns(CLOCK_MONOTONIC) < t);
+}
+
+
+// Writes and reads are matched up with the trace separately, since the
+// device answers in order no matter how the two are interleaved.
+static const struct ljtrace_record *replay_next(struct replayer *rp,
+	size_t *i, uint8_t dir
+) {
+	while (*i < rp->trace.n_records && rp->trace.records[*i]->dir != dir)
+		*i += 1;
+	if (*i >= rp->trace.n_records) return NULL;
+	return rp->trace.records[(*i)++];
+}
+
+
+static unsigned long replay_write(void *ctx, const uint8_t *buf, unsigned long n)
+{
+	struct replayer *rp = ctx;
+	uint64_t t = now_ns(CLOCK_MONOTONIC);
+	const struct ljtrace_record *r = replay_next(rp, &rp->i_write,
+		LJTRACE_WRITE
+	);
+	// past the end of the trace, the device might as well be unplugged
+	if (!r) return 0;
+	if (r->n_req != n || memcmp(ljtrace_payload(r), buf, n))
+		rp->n_mismatches += 1;
+	if (rp->scale > 0) wait_until(t + r->lat_ns * rp->scale);
+	return r->n == r->n_req ? n : r->n;
+}
+
+
+static unsigned long replay_read(void *ctx, uint8_t *buf, unsigned long n)
+{
+	struct replayer *rp = ctx;
+	uint64_t t = now_ns(CLOCK_MONOTONIC);
+	const struct ljtrace_record *r = replay_next(rp, &rp->i_read,
+		LJTRACE_READ
+	);
+	if (!r) return 0;
+	if (rp->scale > 0) wait_until(t + r->lat_ns * rp->scale);
+	unsigned long n_rx = r->n < n ? r->n : n;
+	memcpy(buf, ljtrace_payload(r), n_rx);
+	return n_rx;
+}
+
+
+static void replay_close(void *ctx)
+{
+	struct replayer *rp = ctx;
+	ljtrace_free(&rp->trace);
+	free(rp);
+}
+
+
+static const struct ljud_transport replay_transport = {
+	.name = "replay",
+	.write = replay_write,
+	.read = replay_read,
+	.close = replay_close,
+};
+
+
+struct ljud_dev *ljtrace_replay(const char *path, double scale)
+{
+	struct replayer *rp = calloc(1, sizeof(struct replayer));
+	if (!rp) return NULL;
+	int err = ljtrace_load(path, &rp->trace);
+	if (err) {
+		free(rp);
+		errno = -err;
+		return NULL;
+	}
+	rp->scale = scale;
+	struct ljud_dev *dev = ljud_open(&replay_transport, rp,
+		rp->trace.head.product_id
+	);
+	if (!dev) replay_close(rp);
+	return dev;
+}
+
+
+int ljtrace_record_error(struct ljud_dev *dev)
+{
+	if (dev->ops != &record_transport) return 0;
+	return ((struct recorder *)dev->ctx)->err;
+}
+
+
+unsigned long ljtrace_mismatches(struct ljud_dev *dev)
+{
+	// look through a recorder, for recording a replay
+	if (dev->ops == &record_transport)
+		return ljtrace_mismatches(((struct recorder *)dev->ctx)->dev);
+	if (dev->ops != &replay_transport) return 0;
+	return ((struct replayer *)dev->ctx)->n_mismatches;
+}
@@ -0,0 +1,95 @@
+/** Recording and replaying device traffic. The recorder sits in front of any
+ * other transport and logs every write and read, with its payload, a
+ * timestamp, and how long the call took, to a compact binary trace. The
+ * replayer serves a trace back as a device, taking the recorded time for
+ * each call (optionally scaled), so a recorded session can be rerun offline
+ * against changed code.
+ *
+ * A trace is a struct ljtrace_header followed by records, each a struct
+ * ljtrace_record followed by its payload: everything we asked to write for a
+ * write, and everything we got back for a read. Everything is little-endian.
+ */
+#ifndef LJTRACE_H_
+#define LJTRACE_H_
+
+#include <stdint.h>
+#include "labjack_ud.h"
+
+#define LJTRACE_MAGIC 0x4C4A5452	// "LJTR"
+#define LJTRACE_VERSION 1
+
+struct ljtrace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t product_id;
+	uint32_t reserved2;
+	uint64_t start_ns;	// CLOCK_REALTIME at the start of recording
+}__attribute__((packed));
+static_assert(sizeof(struct ljtrace_header) == 24, "bad ljtrace_header");
+
+enum {
+	LJTRACE_WRITE = 'W',
+	LJTRACE_READ = 'R',
+};
+
+struct ljtrace_record {
+	uint64_t t_ns;		// when the call started, since start_ns
+	uint32_t lat_ns;	// how long the call took
+	uint8_t dir;		// LJTRACE_WRITE or LJTRACE_READ
+	uint8_t n_req;		// bytes asked to write or read
+	uint8_t n;		// bytes actually written or read
+	uint8_t reserved;
+}__attribute__((packed));
+static_assert(sizeof(struct ljtrace_record) == 16, "bad ljtrace_record");
+
+static inline unsigned ljtrace_payload_len(const struct ljtrace_record *r)
+{
+	return r->dir == LJTRACE_WRITE ? r->n_req : r->n;
+}
+
+/** A trace loaded into memory. */
+struct ljtrace {
+	struct ljtrace_header head;
+	uint8_t *buf;
+	const struct ljtrace_record **records;
+	size_t n_records;
+};
+
+/** Load a trace. Returns 0 or negative error code; a trace cut off partway
+ * through a record (say by a crash) loads up to the last whole record.
+ */
+int ljtrace_load(const char *path, struct ljtrace *trace);
+
+void ljtrace_free(struct ljtrace *trace);
+
+static inline const uint8_t *ljtrace_payload(const struct ljtrace_record *r)
+{
+	return (const uint8_t *)(r + 1);
+}
+
+/** Record everything that goes through dev to a trace at path. Takes
+ * ownership of dev, which is closed along with the returned device. Returns
+ * NULL and sets errno on failure, in which case dev is left open.
+ */
+struct ljud_dev *ljtrace_record(struct ljud_dev *dev, const char *path);
+
+/** Why a recording from ljtrace_record stopped early, as a negative error
+ * code, or 0 if it's still going (or dev isn't recording). Once a write to
+ * the trace fails, nothing more is recorded, so the trace loads up to there.
+ */
+int ljtrace_record_error(struct ljud_dev *dev);
+
+/** Serve the trace at path back as a device. Each call takes scale times as
+ * long as it did when recorded; 0 means as fast as possible. Returns NULL and
+ * sets errno on failure.
+ */
+struct ljud_dev *ljtrace_replay(const char *path, double scale);
+
+/** How many writes to a replay device didn't match the trace. A nonzero count
+ * means the code under test has diverged from the recording, and the
+ * responses it's getting aren't to be trusted.
+ */
+unsigned long ljtrace_mismatches(struct ljud_dev *dev);
+
+#endif
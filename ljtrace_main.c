@@ -0,0 +1,110 @@
+/** aylp_ljtrace: summarize a trace recorded with the "record" param.
+ * See ljtrace.h for the format.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ljtrace.h"
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void summarize(const char *what, uint64_t *lat, size_t n)
+{
+	if (!n) return;
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; i++) sum += lat[i];
+	printf("%-12s %8zu  min %8.1f  mean %8.1f  p50 %8.1f  "
+		"p99 %8.1f  max %8.1f us\n",
+		what, n, lat[0] * 1e-3, sum * 1e-3 / n, lat[n / 2] * 1e-3,
+		lat[n * 99 / 100] * 1e-3, lat[n - 1] * 1e-3
+	);
+}
+
+
+int main(int argc, char **argv)
+{
+	bool verbose = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "vh")) != -1) {
+		switch (opt) {
+		case 'v': verbose = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-v] trace\n", argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-v] trace\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct ljtrace trace;
+	int err = ljtrace_load(argv[optind], &trace);
+	if (err) {
+		fprintf(stderr, "couldn't load %s: %s\n",
+			argv[optind], strerror(-err)
+		);
+		return EXIT_FAILURE;
+	}
+
+	size_t n = trace.n_records;
+	uint64_t *w_lat = malloc((n + 1) * sizeof(uint64_t));
+	uint64_t *r_lat = malloc((n + 1) * sizeof(uint64_t));
+	uint64_t *rtt = malloc((n + 1) * sizeof(uint64_t));
+	uint64_t *w_start = malloc((n + 1) * sizeof(uint64_t));
+	if (!w_lat || !r_lat || !rtt || !w_start) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	size_t n_w = 0, n_r = 0, n_rtt = 0, n_short = 0;
+	for (size_t i = 0; i < n; i++) {
+		const struct ljtrace_record *r = trace.records[i];
+		if (verbose) {
+			printf("%12.3f %c %3u/%3u %8.1f us ",
+				r->t_ns * 1e-6, r->dir, r->n, r->n_req,
+				r->lat_ns * 1e-3
+			);
+			const uint8_t *p = ljtrace_payload(r);
+			for (unsigned k = 0; k < ljtrace_payload_len(r); k++)
+				printf("%02x", p[k]);
+			printf("\n");
+		}
+		if (r->n < r->n_req) n_short += 1;
+		if (r->dir == LJTRACE_WRITE) {
+			w_start[n_w] = r->t_ns;
+			w_lat[n_w++] = r->lat_ns;
+		} else if (r->dir == LJTRACE_READ) {
+			// the device answers in order, so the kth read goes
+			// with the kth write
+			if (n_r < n_w) {
+				rtt[n_rtt++] = r->t_ns + r->lat_ns
+					- w_start[n_r];
+			}
+			r_lat[n_r++] = r->lat_ns;
+		}
+	}
+
+	uint64_t span = n ? trace.records[n - 1]->t_ns : 0;
+	printf("product %u, %zu records over %.3f s, %zu short\n",
+		trace.head.product_id, n, span * 1e-9, n_short
+	);
+	summarize("write", w_lat, n_w);
+	summarize("read", r_lat, n_r);
+	summarize("write->read", rtt, n_rtt);
+
+	free(w_lat);
+	free(r_lat);
+	free(rtt);
+	free(w_start);
+	ljtrace_free(&trace);
+	return EXIT_SUCCESS;
+}